@@ -0,0 +1,56 @@
+#include "mbed.h"
+#include "PowerOut.h"
+
+PowerOut::PowerOut( PinName pin, int frequency ) {
+    m_pwm = NULL;
+    m_out = NULL;
+    m_duty = 0;
+    m_softDuty = 0;
+    m_periodUs = 0;
+
+    if ( frequency > 0 && hasPwm( pin ) ) {
+        m_periodUs = 1000000 / frequency;
+        m_pwm = new PwmOut( pin );
+        m_pwm->period_us( m_periodUs );
+        m_pwm->pulsewidth_us( 0 );
+    } else {
+        m_out = new DigitalOut( pin );
+        *m_out = 0;
+    }
+}
+
+bool PowerOut::hasPwm( PinName pin ) {
+    switch ( pin ) {
+        case p21: case p22: case p23: case p24: case p25: case p26:
+        case LED1: case LED2: case LED3: case LED4:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void PowerOut::write( int duty ) {
+    if ( duty < 0 )
+        duty = 0;
+    if ( duty > POWER_OUT_MAX )
+        duty = POWER_OUT_MAX;
+    if ( duty == m_duty )
+        return;
+    m_duty = duty;
+    if ( m_pwm )
+        m_pwm->pulsewidth_us( duty * m_periodUs / POWER_OUT_MAX );
+    else if ( duty == 0 )
+        *m_out = 0;         // switching off doesn't wait for the end of the soft PWM cycle
+}
+
+void PowerOut::softTick( unsigned char count ) {
+    if ( m_out == NULL )
+        return;
+    if ( count == 0 ) {
+        m_softDuty = m_duty >> 3;
+        if ( m_softDuty > 0 )
+            *m_out = 1;
+    }
+    if ( m_softDuty <= count )
+        *m_out = 0;
+}
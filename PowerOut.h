@@ -0,0 +1,38 @@
+#ifndef POWER_OUT_H_
+#define POWER_OUT_H_
+
+#include "mbed.h"
+
+#define POWER_OUT_MAX 1023
+
+// A heater or fan output with a duty cycle of 0..POWER_OUT_MAX.
+// Pins with a PWM1 channel (p21-p26, LED1-LED4) are driven by the PWM hardware. All PWM1 channels share
+// one period, so the last frequency given wins. The pulse width is set in microseconds, which gives
+// 1000000 / frequency steps of resolution, at least 10 bit up to 976 Hz.
+// Other pins, or a frequency of 0, fall back to soft PWM: softTick() has to be called periodically
+// with a counter running through 0..127, and switches the pin at 7 bit resolution.
+
+class PowerOut {
+public:
+    PowerOut( PinName pin, int frequency );
+
+    void write( int duty );     // takes effect at once with hardware PWM, at the next soft PWM cycle otherwise
+    int read() {
+        return m_duty;
+    }
+    bool isSoft() {
+        return m_pwm == NULL;
+    }
+    void softTick( unsigned char count );
+
+    static bool hasPwm( PinName pin );
+
+private:
+    PwmOut *m_pwm;
+    DigitalOut *m_out;
+    int m_duty;
+    int m_periodUs;
+    unsigned char m_softDuty;   // duty of the running soft PWM cycle, 0..127
+};
+
+#endif
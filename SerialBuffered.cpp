@@ -1,13 +1,57 @@
 #include "mbed.h"
 #include "SerialBuffered.h"
-
-SerialBuffered::SerialBuffered( size_t bufferSize, PinName tx, PinName rx ) : Serial(  tx,  rx ) {
+#include "marlin/profile.h"
+
+// Bytes the UART transmit FIFO takes once it is empty
+#define UART_TX_FIFO_SIZE 16
+#define UART_LSR_THRE (1 << 5)
+#define UART_FCR_FIFO_ENABLE (1 << 0)
+#define UART_FCR_RX_RESET (1 << 1)
+#define UART_FCR_DMA_MODE (1 << 3)     // with the receive trigger level bits 0: a DMA request per byte
+
+#define GPDMA_MAX_TRANSFER 4095
+#define GPDMA_CONTROL_DI (1UL << 27)   // increment the destination address
+#define GPDMA_CONFIG_E (1UL << 0)
+#define GPDMA_CONFIG_SRC_PERIPHERAL(n) ((n) << 1)
+#define GPDMA_CONFIG_PERIPHERAL_TO_MEMORY (2UL << 11)
+#define PCONP_PCGPDMA (1UL << 29)
+
+SerialBuffered::SerialBuffered( size_t bufferSize, PinName tx, PinName rx, size_t txBufferSize, TxOverflow txOverflow ) : Serial(  tx,  rx ) {
     m_buffSize = 0;
     m_contentStart = 0;
     m_contentEnd = 0;
+    m_linesIn = 0;
+    m_linesOut = 0;
+    m_rxDma = NULL;
+    m_rxScan = 0;
+
+    m_txBuffSize = 0;
+    m_txStart = 0;
+    m_txEnd = 0;
+    m_txOverflow = txOverflow;
+    m_txDropped = 0;
+    m_uart = (LPC_UART_TypeDef *)_uart;
+    m_txBuff = NULL;
+    if ( txBufferSize ) {
+        m_txBuff = (uint8_t *) malloc( txBufferSize );
+        if ( m_txBuff != NULL ) {
+            m_txBuffSize = txBufferSize;
+            attach( this, &SerialBuffered::handleTxInterrupt, TxIrq );
+        }
+    }
 
     attach( this, &SerialBuffered::handleInterrupt );
 
+    // The UART interrupt starts at priority 0 with the stepper interrupt, which it must not hold back
+    IRQn_Type irq;
+    switch ( _uart ) {
+        case UART_1: irq = UART1_IRQn; break;
+        case UART_2: irq = UART2_IRQn; break;
+        case UART_3: irq = UART3_IRQn; break;
+        default: irq = UART0_IRQn; break;
+    }
+    NVIC_SetPriority( irq, 1 );
+
     m_buff = (uint8_t *) malloc( bufferSize );
     if ( m_buff == NULL ) {
         print("SerialBuffered - failed to alloc buffer size \n");
@@ -18,12 +62,74 @@ SerialBuffered::SerialBuffered( size_t bufferSize, PinName tx, PinName rx ) : Se
 
 
 SerialBuffered::~SerialBuffered() {
+    if ( m_txBuff ) {
+        remove_interrupt( TxIrq );
+        free( m_txBuff );
+    }
     if ( m_buff )
         free( m_buff );
 }
 
+void SerialBuffered::write(const char c) {
+    if ( m_txBuffSize == 0 ) {
+        Serial::putc(c);
+        return;
+    }
+
+    uint16_t next = (m_txEnd + 1) % m_txBuffSize;
+    while ( next == m_txStart ) {
+        if ( m_txOverflow == TxDrop ) {
+            m_txDropped++;
+            return;
+        }
+        // With interrupts enabled this waits for handleTxInterrupt(), otherwise it sends the bytes itself.
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        txFill();
+        __set_PRIMASK(primask);
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    m_txBuff[ m_txEnd ] = c;
+    m_txEnd = next;
+    // The transmit interrupt only comes when the FIFO runs empty, so an idle UART has to be started here.
+    txFill();
+    if ( primask ) {
+        while ( m_txStart != m_txEnd )
+            txFill();
+    }
+    __set_PRIMASK(primask);
+}
+
+int SerialBuffered::_putc(int c) {
+    write((char)c);
+    return c;
+}
+
+// Called with the transmit interrupt masked or from it
+void SerialBuffered::txFill() {
+    if ( !(m_uart->LSR & UART_LSR_THRE) )
+        return;
+    for ( int n = 0; n < UART_TX_FIFO_SIZE && m_txStart != m_txEnd; n++ ) {
+        m_uart->THR = m_txBuff[ m_txStart ];
+        m_txStart = (m_txStart + 1) % m_txBuffSize;
+    }
+}
+
+void SerialBuffered::handleTxInterrupt() {
+    txFill();
+}
+
+#define IS_LINE_END(c) ((c) == '\n' || (c) == '\r')
+
 void SerialBuffered::flush( ) {
+    updateRx();
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
     m_contentStart = m_contentEnd;
+    m_linesOut = m_linesIn;
+    __set_PRIMASK(primask);
 }
 
 size_t SerialBuffered::readBytes( uint8_t *bytes, size_t requested ) {
@@ -40,37 +146,144 @@ size_t SerialBuffered::readBytes( uint8_t *bytes, size_t requested ) {
 }
 
 int SerialBuffered::getc() {
-	int waiting = 0;
-    while ( m_contentStart == m_contentEnd ) {
-        wait_ms(1);
-	waiting ++;
-	if(waiting >= 900) {
-		print("wait\n");	
-		waiting = 0;
-	}
-    }
+    updateRx();
+    if ( m_contentStart == m_contentEnd )
+        return -1;
 
-    uint8_t result = m_buff[m_contentStart++];
-    m_contentStart =  m_contentStart % m_buffSize;
+    uint8_t result = m_buff[m_contentStart];
+    m_contentStart = (m_contentStart + 1) % m_buffSize;
+    if ( IS_LINE_END(result) )
+        m_linesOut++;
 
     return result;
 }
 
 int SerialBuffered::readable() {
+    updateRx();
     return m_contentStart != m_contentEnd ;
 }
 
+int SerialBuffered::linesReadable() {
+    updateRx();
+    return (uint16_t)(m_linesIn - m_linesOut);
+}
+
+size_t SerialBuffered::readLines( uint8_t *bytes, size_t requested, size_t maxLines ) {
+    updateRx();
+    uint16_t lines = m_linesIn - m_linesOut;
+    uint16_t start = m_contentStart;
+    uint16_t end = m_contentEnd;
+    size_t i = 0;
+
+    if ( lines == 0 ) {
+        // Only a line that doesn't fit into the buffer is handed out before its end has arrived
+        if ( start != (end + 1) % m_buffSize )
+            return 0;
+        lines = 1;
+    }
+    if ( lines > maxLines )
+        lines = maxLines;
+
+    while ( i < requested && lines && start != end ) {
+        uint8_t c = m_buff[start];
+        start = (start + 1) % m_buffSize;
+        bytes[i++] = c;
+        if ( IS_LINE_END(c) ) {
+            lines--;
+            m_linesOut++;
+        }
+    }
+    m_contentStart = start;
+    return i;
+}
+
+bool SerialBuffered::enableRxDma( int channel ) {
+    uint32_t request;       // GPDMA request line of the UART receiver
+    switch ( _uart ) {
+        case UART_0: request = 9; break;
+        case UART_1: request = 11; break;
+        case UART_2: request = 13; break;
+        case UART_3: request = 15; break;
+        default: return false;
+    }
+    uint32_t half = m_buffSize / 2;
+    if ( channel < 0 || channel > 7 || half == 0 || (m_buffSize & 1) || half > GPDMA_MAX_TRANSFER )
+        return false;
+
+    remove_interrupt( RxIrq );
+
+    LPC_SC->PCONP |= PCONP_PCGPDMA;
+    LPC_SC->DMAREQSEL &= ~(1UL << (request - 8));  // the request line is the UART's, not a timer match
+    LPC_GPDMA->DMACConfig = 1;                      // enable, little endian
+    while ( !(LPC_GPDMA->DMACConfig & 1) ) ;
+
+    LPC_GPDMACH_TypeDef *ch = (LPC_GPDMACH_TypeDef *)(LPC_GPDMACH0_BASE + channel * 0x20);
+    ch->DMACCConfig = 0;
+    LPC_GPDMA->DMACIntTCClear = 1UL << channel;
+    LPC_GPDMA->DMACIntErrClr = 1UL << channel;
+
+    uint32_t control = half | GPDMA_CONTROL_DI;     // byte transfers, bursts of 1
+    m_rxLli[0].src = (uintptr_t)&m_uart->RBR;
+    m_rxLli[0].dst = (uintptr_t)m_buff;
+    m_rxLli[0].next = (uintptr_t)&m_rxLli[1];
+    m_rxLli[0].control = control;
+    m_rxLli[1].src = (uintptr_t)&m_uart->RBR;
+    m_rxLli[1].dst = (uintptr_t)(m_buff + half);
+    m_rxLli[1].next = (uintptr_t)&m_rxLli[0];
+    m_rxLli[1].control = control;
+
+    m_contentStart = 0;
+    m_contentEnd = 0;
+    m_rxScan = 0;
+    m_linesOut = m_linesIn;
+    m_uart->FCR = UART_FCR_FIFO_ENABLE | UART_FCR_RX_RESET | UART_FCR_DMA_MODE;
+
+    ch->DMACCSrcAddr = m_rxLli[0].src;
+    ch->DMACCDestAddr = m_rxLli[0].dst;
+    ch->DMACCLLI = m_rxLli[0].next;
+    ch->DMACCControl = control;
+    m_rxDma = ch;
+    ch->DMACCConfig = GPDMA_CONFIG_E | GPDMA_CONFIG_SRC_PERIPHERAL(request) | GPDMA_CONFIG_PERIPHERAL_TO_MEMORY;
+    return true;
+}
+
+// With DMA reception, publish what the DMA has written and count the line ends in it
+void SerialBuffered::updateRx() {
+    if ( m_rxDma == NULL )
+        return;
+
+    uint16_t end = ((uint8_t *)(uintptr_t)m_rxDma->DMACCDestAddr - m_buff) % m_buffSize;
+    uint16_t i = m_rxScan;
+    while ( i != end ) {
+        if ( IS_LINE_END(m_buff[i]) ) {
+            m_linesIn++;
+            m_lineIrq.call();
+        }
+        if ( ++i == m_buffSize )
+            i = 0;
+    }
+    m_rxScan = end;
+    m_contentEnd = end;
+}
+
 void SerialBuffered::handleInterrupt() {
+    PROFILE_START();
 
     while ( Serial::readable()) {
         if ( m_contentStart == (m_contentEnd +1) % m_buffSize) {
             //loggerSerial.printf("SerialBuffered - buffer overrun, data lost!\r\n" );
             Serial::getc();
         } else {
-            m_buff[ m_contentEnd ++ ] = Serial::getc();
-            m_contentEnd = m_contentEnd % m_buffSize;
+            uint8_t c = Serial::getc();
+            m_buff[ m_contentEnd ] = c;
+            m_contentEnd = (m_contentEnd + 1) % m_buffSize;
+            if ( IS_LINE_END(c) ) {
+                m_linesIn++;
+                m_lineIrq.call();
+            }
         }
     }
+    PROFILE_END(PROFILE_SERIAL_RX);
 }
 
 /// imports from print.h
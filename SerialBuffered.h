@@ -15,13 +15,22 @@
 
 // In the simplest case, construct it with a buffer size at least equal to the largest message you
 // expect your program to receive in one go.
+// With a txBufferSize, output is queued and sent by the transmit interrupt, so printing only waits
+// for the UART when the transmit buffer is full. What happens then is set by txOverflow. Output
+// written with interrupts disabled is sent before write() returns, so messages printed right
+// before a halt still go out.
 
 class SerialBuffered : public Serial {
 public:
-    SerialBuffered( size_t bufferSize, PinName tx, PinName rx );
+    enum TxOverflow {
+        TxBlock      // wait until the interrupt made room
+        , TxDrop     // drop the characters that don't fit
+    };
+
+    SerialBuffered( size_t bufferSize, PinName tx, PinName rx, size_t txBufferSize = 0, TxOverflow txOverflow = TxBlock );
     virtual ~SerialBuffered();
 
-    int getc();     // will block till the next character turns up, or return -1 if there is a timeout
+    int getc();     // returns the next character, or -1 if none has been received
 
     void flush();     //
 
@@ -29,7 +38,30 @@ public:
 
     size_t readBytes( uint8_t *bytes, size_t requested );    // read requested bytes into a buffer,
     // return number actually read,
-    // which may be less than requested if there has been a timeout
+    // which may be less than requested if fewer have been received
+
+    size_t readLines( uint8_t *bytes, size_t requested, size_t maxLines = 0xFFFF );
+    // read up to maxLines complete lines, including their '\n' or '\r', without waiting.
+    // Returns 0 until a line is complete. A line longer than requested is returned in parts, and
+    // when the receive buffer is full without a line end, its content is returned as it is.
+
+    int linesReadable(); // number of complete lines in the receive buffer
+
+    bool enableRxDma( int channel );
+    // receive through GPDMA channel 0-7 instead of the receive interrupt. The DMA writes into the
+    // receive buffer as a ring, and the readers take the write position from the DMA channel, so
+    // no interrupt is taken for received bytes. attachLine() functions are then called from the
+    // reading functions. The buffer size has to be even and at most 8190 bytes. There is no
+    // overrun detection: the DMA overwrites unread data once the buffer is full.
+
+    // Attach a function to call from the receive interrupt whenever a line is complete
+    void attachLine( void (*fptr)(void) ) {
+        m_lineIrq.attach( fptr );
+    }
+    template<typename T>
+    void attachLine( T *tptr, void (T::*mptr)(void) ) {
+        m_lineIrq.attach( tptr, mptr );
+    }
 
 
     private:
@@ -40,10 +72,7 @@ public:
 
   public:
 
-     void write(const char c)
-    {
-	putc(c);
-    }
+    void write(const char c);
      void write(const char *str)
     {
       while (*str)
@@ -89,12 +118,40 @@ public:
 private:
 
     void handleInterrupt();
+    void handleTxInterrupt();
+    void txFill();                  // move queued bytes into the empty UART FIFO
+
+    virtual int _putc(int c);       // printf() and putc() output goes through the transmit buffer too
 
 
     uint8_t *m_buff;            // points at a circular buffer, containing data from m_contentStart, for m_contentSize bytes, wrapping when you get to the end
     volatile uint16_t  m_contentStart;   // index of first bytes of content
     volatile uint16_t  m_contentEnd;     // index of bytes after last byte of content
     volatile uint16_t m_buffSize;
+    volatile uint16_t m_linesIn;       // line ends received by handleInterrupt()
+    volatile uint16_t m_linesOut;      // line ends taken out of the buffer
+    FunctionPointer m_lineIrq;
+
+    struct DmaLli {                    // GPDMA linked list item, the addresses are 32 bit on the target
+        uintptr_t src;
+        uintptr_t dst;
+        uintptr_t next;
+        uint32_t control;
+    };
+    DmaLli m_rxLli[2];                 // each half of the receive buffer, linked into a ring
+    LPC_GPDMACH_TypeDef *m_rxDma;      // DMA channel when receiving with enableRxDma(), else NULL
+    uint16_t m_rxScan;                 // received bytes before this index have been checked for line ends
+    void updateRx();
+
+    uint8_t *m_txBuff;                    // circular transmit buffer, bytes from m_txStart to m_txEnd are waiting to be sent
+    volatile uint16_t m_txStart;
+    volatile uint16_t m_txEnd;
+    uint16_t m_txBuffSize;
+    TxOverflow m_txOverflow;
+    LPC_UART_TypeDef *m_uart;
+
+public:
+    volatile unsigned long m_txDropped;   // characters lost with TxDrop
 };
 
 #endif
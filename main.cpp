@@ -2,54 +2,94 @@
 #include "marlin/pins.h"
 #include "math.h"
 #include "marlin/Marlin.h"
+#include "marlin/stepper.h"
 
 DigitalOut p_heater0_led(LED1);//x
 DigitalOut p_heat_bed_led(LED2);//y
 //DigitalOut led3(LED3);//z
 DigitalOut p_led(LED_PIN);//e
 
-DigitalOut p_fan(FAN_PIN);
+#ifdef FAN_SOFT_PWM
+PowerOut p_fan(FAN_PIN, 0);
+#else
+PowerOut p_fan(FAN_PIN, HEATER_PWM_FREQUENCY);
+#endif
 
 //DigitalOut p_x_enable(X_ENABLE_PIN);
-DigitalOut p_x_dir(X_DIR_PIN);
-DigitalOut p_x_step(X_STEP_PIN);
 //DigitalIn p_x_min(X_MIN_PIN);
 //DigitalIn p_x_max(X_MAX_PIN);
 
 //DigitalOut p_y_enable(Y_ENABLE_PIN);
-DigitalOut p_y_dir(Y_DIR_PIN);
-DigitalOut p_y_step(Y_STEP_PIN);
 //DigitalIn p_y_min(Y_MIN_PIN);
 //DigitalIn p_y_max(Y_MAX_PIN);
 
 //DigitalOut p_z_enable(Z_ENABLE_PIN);
-DigitalOut p_z_dir(Z_DIR_PIN);
-DigitalOut p_z_step(Z_STEP_PIN);
 //DigitalIn p_z_min(Z_MIN_PIN);
 //DigitalIn p_z_max(Z_MAX_PIN);
 
 //DigitalOut p_e_enable(E_ENABLE_PIN);
-DigitalOut p_e_dir(E_DIR_PIN);
-DigitalOut p_e_step(E_STEP_PIN);
 
-DigitalOut p_heater0(HEATER_0_PIN);
-DigitalOut p_heater_bed(HEATER_BED_PIN);//heated-build-platform
+PortOut p_stepper_port((PortName)PIN_PORT(X_STEP_PIN), STEP_PINS_MASK | DIR_PINS_MASK); //step and dir pins of all axes, written by the stepper interrupt
 
+PowerOut p_heater0(HEATER_0_PIN, HEATER_PWM_FREQUENCY);
+PowerOut p_heater_bed(HEATER_BED_PIN, HEATER_PWM_FREQUENCY);//heated-build-platform
+
+// Set up the thermistor pins for the ADC, which is then run in burst mode by temperature.cpp
 AnalogIn p_temp0(TEMP_0_PIN);
 AnalogIn p_temp_bed(TEMP_BED_PIN);//heated-build-platform thermistor
 
-SerialBuffered serial_buffered( 4096, USBTX, USBRX);
+#ifdef TX_BUFFER_DROP_ON_OVERFLOW
+SerialBuffered serial_buffered( 4096, USBTX, USBRX, TX_BUFFER_SIZE, SerialBuffered::TxDrop);
+#else
+SerialBuffered serial_buffered( 4096, USBTX, USBRX, TX_BUFFER_SIZE, SerialBuffered::TxBlock);
+#endif
 
-Timer timer;
+// Free running microsecond clock on TIMER1. The TC counts at 1 MHz and wraps every 71.6 minutes, the MR0
+// match at 0 counts the wraps in clock_high. All readers are safe in any context.
+static volatile uint32_t clock_high = 0;
 
-unsigned int millis()
+static void clock_timer_isr()
 {
-	static long long current_ms = 0;
-	if(timer.read_ms() > 10000*60) { /*reset every 10 minutes*/
-		current_ms += timer.read_ms();
-		timer.reset();
-	}
-	return current_ms + timer.read_ms();
+	LPC_TIM1->IR = 1; // MR0
+	clock_high++;
+}
+
+static void clock_init()
+{
+	LPC_SC->PCONP |= 1 << 2; // PCTIM1
+	LPC_SC->PCLKSEL0 = (LPC_SC->PCLKSEL0 & ~(3UL << 4)) | (1UL << 4); // PCLK = CCLK
+	LPC_TIM1->TCR = 2; // reset
+	LPC_TIM1->PR = F_CPU / 1000000 - 1;
+	LPC_TIM1->MR0 = 0;
+	LPC_TIM1->MCR = 1; // interrupt on MR0, keep counting
+	LPC_TIM1->TCR = 1;
+	while(LPC_TIM1->TC < 2); // don't count the start at 0 as a wrap
+	LPC_TIM1->IR = 1;
+	NVIC_SetVector(TIMER1_IRQn, (uintptr_t)&clock_timer_isr);
+	NVIC_SetPriority(TIMER1_IRQn, 1);
+	NVIC_EnableIRQ(TIMER1_IRQn);
+}
+
+unsigned long micros()
+{
+	return LPC_TIM1->TC;
+}
+
+unsigned long long micros64()
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint32_t high = clock_high;
+	uint32_t low = LPC_TIM1->TC;
+	if((LPC_TIM1->IR & 1) && low < 0x80000000UL)
+		high++; // wrapped, but the interrupt hasn't run yet
+	__set_PRIMASK(primask);
+	return ((unsigned long long)high << 32) | low;
+}
+
+unsigned long millis()
+{
+	return (unsigned long)(micros64() / 1000);
 }
 
 void delay_ms(int ms)
@@ -57,13 +97,16 @@ void delay_ms(int ms)
 	wait_ms(ms);
 }
 
-void cli(){}
-void sei(){}
+void cli(){ __disable_irq(); }
+void sei(){ __enable_irq(); }
 
 int main() {
 	mbed_interface_disconnect(); //disable debug interface. and acces to MAC and local FS. ADC will work better!
-	timer.start();
+	clock_init();
 	serial_buffered.baud(BAUDRATE);
+#ifdef SERIAL_RX_DMA_CHANNEL
+	serial_buffered.enableRxDma(SERIAL_RX_DMA_CHANNEL);
+#endif
 	setup();
 	while (1) {
 		loop();
@@ -3,6 +3,7 @@
 
 #include "mbed.h"
 #include "SerialBuffered.h"
+#include "PowerOut.h"
 
 extern SerialBuffered serial_buffered;
 
@@ -10,39 +11,39 @@ extern DigitalOut p_heater0_led;
 extern DigitalOut p_heat_bed_led;
 //DigitalOut led3(LED3);//z
 extern DigitalOut p_led;
-extern DigitalOut p_fan;
+extern PowerOut p_fan;
 
 //DigitalOut p_x_enable(X_ENABLE_PIN);
-extern DigitalOut p_x_dir;
-extern DigitalOut p_x_step;
 //DigitalIn p_x_min(X_MIN_PIN);
 //DigitalIn p_x_max(X_MAX_PIN);
 
 //DigitalOut p_y_enable(Y_ENABLE_PIN);
-extern DigitalOut p_y_dir;
-extern DigitalOut p_y_step;
 //DigitalIn p_y_min(Y_MIN_PIN);
 //DigitalIn p_y_max(Y_MAX_PIN);
 
 //DigitalOut p_z_enable(Z_ENABLE_PIN);
-extern DigitalOut p_z_dir;
-extern DigitalOut p_z_step;
 //DigitalIn p_z_min(Z_MIN_PIN);
 //DigitalIn p_z_max(Z_MAX_PIN);
 
 //DigitalOut p_e_enable(E_ENABLE_PIN);
-extern DigitalOut p_e_dir;
-extern DigitalOut p_e_step;
 
-extern DigitalOut p_heater0;
-extern DigitalOut p_heater_bed;;
+extern PortOut p_stepper_port;
+
+extern PowerOut p_heater0;
+extern PowerOut p_heater_bed;
 
 extern AnalogIn p_temp0;
 extern AnalogIn p_temp_bed;
 
-int micros();
+// Microseconds and milliseconds since start, from one free running clock. micros() wraps every 71.6 minutes,
+// millis() every 49.7 days. Compare timestamps with ELAPSED/PENDING or by subtracting them, never with <.
+unsigned long micros();
+unsigned long long micros64();
+unsigned long millis();
 
-unsigned int millis();
+// True once the time now has reached soon, wrap-safe for intervals up to half the range
+#define ELAPSED(now, soon) ((long)((now) - (soon)) >= 0)
+#define PENDING(now, soon) ((long)((now) - (soon)) < 0)
 
 void cli();
 void sei();
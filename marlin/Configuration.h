@@ -311,6 +311,12 @@ const bool Z_MAX_ENDSTOP_INVERTING = true; // set to true to invert the logic of
 #define DEFAULT_ZJERK                 0.3     // (mm/sec)
 #define DEFAULT_EJERK                 5.0    // (mm/sec)
 
+// Corner speeds from the angle between two moves instead of the XY jerk: the speed at which the acceleration
+// takes the tool around a circle that touches both moves and passes DEFAULT_JUNCTION_DEVIATION from the corner.
+// Slower on sharp corners and faster along finely segmented curves than the jerk limits. 0 keeps the jerk
+// limits, M205 J changes it. Values around 0.02 to 0.05 mm are common.
+#define DEFAULT_JUNCTION_DEVIATION    0.0    // (mm)
+
 //===========================================================================
 //=============================Additional Features===========================
 //===========================================================================
@@ -327,17 +333,25 @@ const bool Z_MAX_ENDSTOP_INVERTING = true; // set to true to invert the logic of
 // Increase the FAN pwm frequency. Removes the PWM noise but increases heating in the FET/Arduino
 //#define FAST_PWM_FAN
 
-// Use software PWM to drive the fan, as for the heaters. This uses a very low frequency
+// Use software PWM to drive the fan, as for heaters on pins without hardware PWM. This uses a very low frequency
 // which is not as annoying as with the hardware PWM. On the other hand, if this frequency
 // is too low, you should also increment SOFT_PWM_SCALE.
 //#define FAN_SOFT_PWM
 
+// Frequency of the hardware PWM of the heaters and the fan (pins p21-p26 and LED1-LED4). The duty cycle
+// has 1000000/HEATER_PWM_FREQUENCY steps, 10 bit or more up to 976 Hz.
+#define HEATER_PWM_FREQUENCY 500
+
 // Incrementing this by 1 will double the software PWM frequency,
-// affecting heaters, and the fan if FAN_SOFT_PWM is enabled.
+// affecting heaters on pins without hardware PWM, and the fan if FAN_SOFT_PWM is enabled.
 // However, control resolution will be halved for each increment;
 // at zero value, there are 128 effective control positions.
 #define SOFT_PWM_SCALE 0
 
+// M500 stores the settings in the last two flash sectors, M501 and the reset load them from there. Without it
+// M500 does nothing and the reset loads the defaults. The linker script keeps the firmware out of those sectors.
+#define FLASH_SETTINGS
+
 // SF send wrong arc g-codes when using Arc Point as fillet procedure
 //#define SF_ARC_FIX
 
@@ -1,8 +1,302 @@
+#include <stddef.h>
 #include "Marlin.h"
 #include "planner.h"
+#include "stepper.h"
 #include "temperature.h"
 #include "ConfigurationStore.h"
 
+#ifdef FLASH_SETTINGS
+// The settings are kept in the last two 32K sectors of the flash, which the linker script leaves out of the
+// firmware. M500 appends a record behind the ones already there in the sector of the newest record. When that
+// one is full, the other sector is erased and the records continue there, so the newest record is never
+// erased: a reset during the erase or the write still finds it. Each sector is erased once in 256 M500, of the
+// 10000 erase cycles the flash is good for. Records are written from the start of a sector on: the written ones
+// come first, and the last one is found by a binary search for the first blank one. The sequence number of the
+// records tells which sector has the newest.
+#define SETTINGS_SECTOR 28 // and 29
+#define SETTINGS_SECTORS 2
+#define SETTINGS_ADDRESS 0x70000
+#define SETTINGS_SECTOR_SIZE 0x8000
+#define SETTINGS_RECORD_SIZE 256 // the smallest IAP write
+#define SETTINGS_RECORDS (SETTINGS_SECTOR_SIZE / SETTINGS_RECORD_SIZE)
+
+#define SETTINGS_MAGIC 0x53474643 // "CFGS"
+// Increment when settings_t or the record changes, records of other versions are ignored
+#define SETTINGS_VERSION 2
+
+// IAP entry in the boot ROM (thumb code) and the flash as seen by the CPU. The simulator has its own.
+#ifndef IAP_ENTRY
+#define IAP_ENTRY ((void (*)(uintptr_t *, uintptr_t *))0x1FFF1FF1)
+#define FLASH_ADDRESS(address) ((const uint32_t *)(address))
+#endif
+#define IAP_PREPARE 50
+#define IAP_COPY 51
+#define IAP_ERASE 52
+#define IAP_SUCCESS 0
+
+// All settings, with the same layout whatever the configuration, and in the simulator
+struct settings_t {
+    float axis_steps_per_unit[4];
+    float max_feedrate[4];
+    uint32_t max_acceleration_units_per_sq_second[4];
+    float acceleration;
+    float retract_acceleration;
+    float minimumfeedrate;
+    float mintravelfeedrate;
+    uint32_t minsegmenttime;
+    float max_xy_jerk;
+    float max_z_jerk;
+    float max_e_jerk;
+    float junction_deviation;
+    float add_homeing[3];
+    float extruder_advance_k;
+    float Kp, Ki, Kd, Kc;
+};
+
+struct settings_record_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;      // sizeof(settings_t)
+    uint32_t sequence;  // one more than the record before
+    settings_t settings;
+    uint32_t crc;       // CRC-32 of everything before
+};
+
+typedef char settings_record_size_check[sizeof(settings_record_t) <= SETTINGS_RECORD_SIZE ? 1 : -1];
+
+// Source of the IAP writes, which must be word aligned. The rest of the record stays blank.
+static union {
+    settings_record_t record;
+    uint32_t words[SETTINGS_RECORD_SIZE / 4];
+} settings_buffer;
+
+static uint32_t crc32(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t crc = 0xFFFFFFFF;
+    while (size--)
+    {
+        crc ^= *p++;
+        for (int8_t bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static uint32_t settings_slot_address(int sector, int slot)
+{
+    return SETTINGS_ADDRESS + sector * SETTINGS_SECTOR_SIZE + slot * SETTINGS_RECORD_SIZE;
+}
+
+static const uint32_t *settings_slot(int sector, int slot)
+{
+    return FLASH_ADDRESS(settings_slot_address(sector, slot));
+}
+
+static bool settings_slot_blank(int sector, int slot)
+{
+    const uint32_t *words = settings_slot(sector, slot);
+    for (int i = 0; i < SETTINGS_RECORD_SIZE / 4; i++)
+    {
+        if (words[i] != 0xFFFFFFFF)
+            return false;
+    }
+    return true;
+}
+
+// Slot of the first blank record of a sector, SETTINGS_RECORDS if it is full. A record that was cut short by
+// a reset isn't blank, so the written slots always come first.
+static int settings_first_blank(int sector)
+{
+    int low = 0, high = SETTINGS_RECORDS;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (settings_slot_blank(sector, middle))
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    return low;
+}
+
+static bool settings_valid(const settings_record_t *record)
+{
+    return record->magic == SETTINGS_MAGIC && record->version == SETTINGS_VERSION &&
+        record->size == sizeof(settings_t) && record->crc == crc32(record, offsetof(settings_record_t, crc));
+}
+
+// The newest valid record of both sectors and its sector, NULL if there is none. Only a record cut short by a
+// reset is invalid, the one before it is the newest of the sector then. A sector whose erase was cut short
+// holds older records than the other one, if any are left.
+static const settings_record_t *settings_newest(int *newest_sector)
+{
+    const settings_record_t *newest = NULL;
+    for (int sector = 0; sector < SETTINGS_SECTORS; sector++)
+    {
+        for (int slot = settings_first_blank(sector) - 1; slot >= 0; slot--)
+        {
+            const settings_record_t *record = (const settings_record_t *)settings_slot(sector, slot);
+            if (settings_valid(record))
+            {
+                if (newest == NULL || (int32_t)(record->sequence - newest->sequence) > 0)
+                {
+                    newest = record;
+                    *newest_sector = sector;
+                }
+                break;
+            }
+        }
+    }
+    return newest;
+}
+
+// The CPU can't read the flash while the IAP writes it, so no interrupt handler may run meanwhile. The
+// parameters are words of the target, and pointer-wide in the simulator for the RAM address of a write.
+static uint32_t iap(uint32_t command, uintptr_t p0, uintptr_t p1, uintptr_t p2, uintptr_t p3)
+{
+    uintptr_t parameters[5] = { command, p0, p1, p2, p3 };
+    uintptr_t result[5];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    IAP_ENTRY(parameters, result);
+    __set_PRIMASK(primask);
+    return result[0];
+}
+
+// Erasing a sector takes 100 ms, writing a record 1 ms, both with the interrupts disabled. The moves are
+// finished first, the heaters keep their PWM meanwhile.
+void Config_StoreSettings()
+{
+    settings_t *s = &settings_buffer.record.settings;
+    memset(&settings_buffer, 0xFF, sizeof(settings_buffer));
+    memset(s, 0, sizeof(settings_t));
+    for (short i=0;i<4;i++)
+    {
+        s->axis_steps_per_unit[i]=axis_steps_per_unit[i];
+        s->max_feedrate[i]=max_feedrate[i];
+        s->max_acceleration_units_per_sq_second[i]=max_acceleration_units_per_sq_second[i];
+    }
+    s->acceleration=acceleration;
+    s->retract_acceleration=retract_acceleration;
+    s->minimumfeedrate=minimumfeedrate;
+    s->mintravelfeedrate=mintravelfeedrate;
+    s->minsegmenttime=minsegmenttime;
+    s->max_xy_jerk=max_xy_jerk;
+    s->max_z_jerk=max_z_jerk;
+    s->max_e_jerk=max_e_jerk;
+    s->junction_deviation=junction_deviation;
+    for (short i=0;i<3;i++)
+        s->add_homeing[i]=add_homeing[i];
+#ifdef ADVANCE
+    s->extruder_advance_k=extruder_advance_k;
+#endif
+#ifdef PIDTEMP
+    s->Kp=Kp;
+    s->Ki=Ki;
+    s->Kd=Kd;
+#ifdef PID_ADD_EXTRUSION_RATE
+    s->Kc=Kc;
+#endif
+#endif
+    settings_buffer.record.magic = SETTINGS_MAGIC;
+    settings_buffer.record.version = SETTINGS_VERSION;
+    settings_buffer.record.size = sizeof(settings_t);
+
+    // Behind the newest record, or at the start of the other sector once its sector is full. Without a valid
+    // record there is nothing to lose, and the first sector is erased in case it holds something else.
+    int sector = 0;
+    const settings_record_t *newest = settings_newest(&sector);
+    int slot = newest != NULL ? settings_first_blank(sector) : SETTINGS_RECORDS;
+    bool erase = slot == SETTINGS_RECORDS;
+    if (erase)
+    {
+        if (newest != NULL)
+            sector = (sector + 1) % SETTINGS_SECTORS;
+        slot = 0;
+    }
+    settings_buffer.record.sequence = newest != NULL ? newest->sequence + 1 : 0;
+    settings_buffer.record.crc = crc32(&settings_buffer.record, offsetof(settings_record_t, crc));
+
+    st_synchronize();
+
+    uint32_t cclk_khz = SystemCoreClock / 1000;
+    uint32_t status = IAP_SUCCESS;
+    if (erase)
+    {
+        status = iap(IAP_PREPARE, SETTINGS_SECTOR + sector, SETTINGS_SECTOR + sector, 0, 0);
+        if (status == IAP_SUCCESS)
+            status = iap(IAP_ERASE, SETTINGS_SECTOR + sector, SETTINGS_SECTOR + sector, cclk_khz, 0);
+    }
+    if (status == IAP_SUCCESS)
+        status = iap(IAP_PREPARE, SETTINGS_SECTOR + sector, SETTINGS_SECTOR + sector, 0, 0);
+    if (status == IAP_SUCCESS)
+        status = iap(IAP_COPY, settings_slot_address(sector, slot),
+            (uintptr_t)settings_buffer.words, SETTINGS_RECORD_SIZE, cclk_khz);
+    if (status != IAP_SUCCESS || memcmp(settings_slot(sector, slot), settings_buffer.words, SETTINGS_RECORD_SIZE) != 0)
+    {
+        SERIAL_ERROR_START;
+        SERIAL_ERRORPGM("Settings not stored, IAP status ");
+        SERIAL_ERRORLN(status);
+        return;
+    }
+    SERIAL_ECHO_START;
+    SERIAL_ECHOLNPGM("Settings Stored");
+}
+
+// Loads the newest valid record, or the defaults if there is none
+void Config_RetrieveSettings()
+{
+    int sector;
+    const settings_record_t *record = settings_newest(&sector);
+    if (record == NULL)
+    {
+        Config_ResetDefault();
+        Config_PrintSettings();
+        return;
+    }
+
+    const settings_t *s = &record->settings;
+    for (short i=0;i<4;i++)
+    {
+        axis_steps_per_unit[i]=s->axis_steps_per_unit[i];
+        max_feedrate[i]=s->max_feedrate[i];
+        max_acceleration_units_per_sq_second[i]=s->max_acceleration_units_per_sq_second[i];
+    }
+
+    // steps per sq second need to be updated to agree with the units per sq second
+    reset_acceleration_rates();
+
+    acceleration=s->acceleration;
+    retract_acceleration=s->retract_acceleration;
+    minimumfeedrate=s->minimumfeedrate;
+    mintravelfeedrate=s->mintravelfeedrate;
+    minsegmenttime=s->minsegmenttime;
+    max_xy_jerk=s->max_xy_jerk;
+    max_z_jerk=s->max_z_jerk;
+    max_e_jerk=s->max_e_jerk;
+    junction_deviation=s->junction_deviation;
+    for (short i=0;i<3;i++)
+        add_homeing[i]=s->add_homeing[i];
+#ifdef ADVANCE
+    extruder_advance_k=s->extruder_advance_k;
+#endif
+#ifdef PIDTEMP
+    Kp=s->Kp;
+    Ki=s->Ki;
+    Kd=s->Kd;
+    updatePID();
+#ifdef PID_ADD_EXTRUSION_RATE
+    Kc=s->Kc;
+#endif
+#endif
+
+    SERIAL_ECHO_START;
+    SERIAL_ECHOLNPGM("Stored settings retrieved");
+    Config_PrintSettings();
+}
+#endif
+
 #ifndef DISABLE_M503
 void Config_PrintSettings()
 {  // Always have this function, even with EEPROM_SETTINGS disabled, the current values will be shown
@@ -40,7 +334,7 @@ void Config_PrintSettings()
     SERIAL_ECHOLN("");
 
     SERIAL_ECHO_START;
-    SERIAL_ECHOLNPGM("Advanced variables: S=Min feedrate (mm/s), T=Min travel feedrate (mm/s), B=minimum segment time (ms), X=maximum XY jerk (mm/s),  Z=maximum Z jerk (mm/s),  E=maximum E jerk (mm/s)");
+    SERIAL_ECHOLNPGM("Advanced variables: S=Min feedrate (mm/s), T=Min travel feedrate (mm/s), B=minimum segment time (ms), X=maximum XY jerk (mm/s),  Z=maximum Z jerk (mm/s),  E=maximum E jerk (mm/s),  J=junction deviation (mm), 0 for the jerk limits");
     SERIAL_ECHO_START;
     SERIAL_ECHOPAIR("  M205 S",minimumfeedrate );
     SERIAL_ECHOPAIR(" T" ,mintravelfeedrate );
@@ -48,6 +342,7 @@ void Config_PrintSettings()
     SERIAL_ECHOPAIR(" X" ,max_xy_jerk );
     SERIAL_ECHOPAIR(" Z" ,max_z_jerk);
     SERIAL_ECHOPAIR(" E" ,max_e_jerk);
+    SERIAL_ECHOPAIR(" J" ,junction_deviation);
     SERIAL_ECHOLN("");
 
     SERIAL_ECHO_START;
@@ -57,6 +352,13 @@ void Config_PrintSettings()
     SERIAL_ECHOPAIR(" Y" ,add_homeing[1] );
     SERIAL_ECHOPAIR(" Z" ,add_homeing[2] );
     SERIAL_ECHOLN("");
+#ifdef ADVANCE
+    SERIAL_ECHO_START;
+    SERIAL_ECHOLNPGM("Extruder advance (s):");
+    SERIAL_ECHO_START;
+    SERIAL_ECHOPAIR("  M900 K",extruder_advance_k);
+    SERIAL_ECHOLN("");
+#endif
 #ifdef PIDTEMP
     SERIAL_ECHO_START;
     SERIAL_ECHOLNPGM("PID settings:");
@@ -93,7 +395,11 @@ void Config_ResetDefault()
     max_xy_jerk=DEFAULT_XYJERK;
     max_z_jerk=DEFAULT_ZJERK;
     max_e_jerk=DEFAULT_EJERK;
+    junction_deviation=DEFAULT_JUNCTION_DEVIATION;
     add_homeing[0] = add_homeing[1] = add_homeing[2] = 0;
+#ifdef ADVANCE
+    extruder_advance_k = EXTRUDER_ADVANCE_K;
+#endif
 #ifdef PIDTEMP
     Kp = DEFAULT_Kp;
     Ki = scalePID_i(DEFAULT_Ki);
@@ -11,7 +11,12 @@ void Config_PrintSettings();
 FORCE_INLINE void Config_PrintSettings() {}
 #endif
 
+#ifdef FLASH_SETTINGS
+void Config_StoreSettings();
+void Config_RetrieveSettings();
+#else
 FORCE_INLINE void Config_StoreSettings() {}
 FORCE_INLINE void Config_RetrieveSettings() { Config_ResetDefault(); Config_PrintSettings(); }
+#endif
 
 #endif//CONFIG_STORE_H
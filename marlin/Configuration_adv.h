@@ -10,6 +10,10 @@
 #endif
 #define BED_CHECK_INTERVAL 5000 //ms between checks in bang-bang control
 
+// Number of 12 bit ADC samples summed into one raw temperature reading. The samples of all thermistor
+// inputs are taken by the ADC in burst mode. The sum has to fit into an int: at most 16.
+#define OVERSAMPLENR 16
+
 #ifdef PIDTEMP
   // this adds an experimental additional term to the heatingpower, proportional to the extrusion speed.
   // if Kc is choosen well, the additional required power due to increased melting should be compensated.
@@ -134,6 +138,9 @@
 #define INVERT_Z_STEP_PIN false
 #define INVERT_E_STEP_PIN false
 
+// Minimum width of the step pulse and setup time of the direction pins in microseconds, check the datasheet of your stepper drivers.
+#define MINIMUM_STEPPER_PULSE 1
+
 //default stepper release if idle
 #define DEFAULT_STEPPER_DEACTIVE_TIME 60
 
@@ -165,29 +172,33 @@
 //=============================Additional Features===========================
 //===========================================================================
 
-// extruder advance constant (s2/mm3)
+// Extruder advance (linear advance, pressure advance)
+//
+// The pressure in the nozzle lags behind the extruder, the melt flows late when the head speeds up and
+// keeps flowing when it slows down. The extruder is pushed ahead of the planned E position by
 //
-// advance (steps) = STEPS_PER_CUBIC_MM_E * EXTUDER_ADVANCE_K * cubic mm per second ^ 2
+// advance (steps) = EXTRUDER_ADVANCE_K * E speed (steps/s)
 //
-// hooke's law says:		force = k * distance
-// bernoulli's priniciple says:	v ^ 2 / 2 + g . h + pressure / density = constant
-// so: v ^ 2 is proportional to number of steps we advance the extruder
+// so the filament spring is preloaded in proportion to the flow. The advance follows the trapezoid of
+// each extruding block and is released on travel and retract moves. The E steps are sent by their own
+// interrupt on TIMER2. EXTRUDER_ADVANCE_K is the default, M900 K sets it in seconds.
 //#define ADVANCE
 
 #ifdef ADVANCE
-  #define EXTRUDER_ADVANCE_K .0
-
-  #define D_FILAMENT 2.85
-  #define STEPS_MM_E 836
-  #define EXTRUTION_AREA (0.25 * D_FILAMENT * D_FILAMENT * 3.14159)
-  #define STEPS_PER_CUBIC_MM_E (axis_steps_per_unit[E_AXIS]/ EXTRUTION_AREA)
-
+  #define EXTRUDER_ADVANCE_K .0          // (s)
+  #define ADVANCE_STEP_FREQUENCY 20000   // Maximum E step rate of the advance interrupt (steps/s)
 #endif // ADVANCE
 
 // Arc interpretation settings:
-#define MM_PER_ARC_SEGMENT 1
+#define ARC_TOLERANCE 0.01          // (mm) Maximum distance between an arc and the segments it is cut into
+#define MIN_MM_PER_ARC_SEGMENT 0.1  // (mm) Shortest segment, also limited by minsegmenttime (see mc_arc())
 #define N_ARC_CORRECTION 25
 
+// G2/G3 in the XY plane become a single block instead of segments. The stepper follows the circle and the
+// look ahead plans the arc as a whole, its speed limited by the acceleration around it (v^2/r). Arcs that
+// could cross the software endstops are still cut into segments. Not with COREXY.
+//#define NATIVE_ARCS
+
 const unsigned int dropsegments=5; //everything with less than this number of steps will be ignored as move and joined with the next movement
 
 // Power Signal Control Definitions
@@ -214,11 +225,41 @@ const unsigned int dropsegments=5; //everything with less than this number of st
 // THE BLOCK_BUFFER_SIZE NEEDS TO BE A POWER OF 2, i.g. 8,16,32 because shifts and ors are used to do the ringbuffering.
   #define BLOCK_BUFFER_SIZE 32 // maximize block buffer
 
+// The stepper interrupt executes the blocks as short segments with a constant step rate, which are
+// prepared in PendSV, the interrupt with the lowest priority. The segment buffer covers
+// SEGMENT_BUFFER_SIZE*STEP_SEGMENT_TIME of motion, which must be longer than the longest time PendSV can be
+// held off: the stepper interrupt together with the interrupts above PendSV (temperature, serial, Ticker,
+// advance) and the critical sections of the main loop. A slow main loop doesn't starve the stepper anymore.
+// THE SEGMENT_BUFFER_SIZE NEEDS TO BE A POWER OF 2, i.g. 8,16,32 because shifts and ors are used to do the ringbuffering.
+#define SEGMENT_BUFFER_SIZE 32
+#define STEP_SEGMENT_TIME 2500 // (us) duration of one segment
+
+// S-curve acceleration: the step rate follows a quintic Bezier curve from the start to the end rate of each
+// acceleration and deceleration instead of a straight line, so the acceleration rises from and falls back
+// to 0 instead of jumping, which excites less ringing. A ramp takes as long and covers as many steps as with
+// constant acceleration, but the acceleration peaks at 1.875 times the configured one halfway through.
+//#define S_CURVE_ACCELERATION
+
 
 //The ASCII buffer for recieving from the serial:
 #define MAX_CMD_SIZE 2000
 #define BUFSIZE 4
 
+// Output to the serial port is queued in this buffer and sent by the UART interrupt, so printing doesn't
+// stall the main loop. When the buffer is full, printing waits for room, or with TX_BUFFER_DROP_ON_OVERFLOW
+// the characters that don't fit are dropped.
+#define TX_BUFFER_SIZE 1024
+//#define TX_BUFFER_DROP_ON_OVERFLOW
+
+// Receive the serial port through this GPDMA channel (0-7) instead of one interrupt per byte.
+// Makes baud rates above 250000 practical. The receive buffer size in main.cpp has to be even and at most 8190.
+//#define SERIAL_RX_DMA_CHANNEL 0
+
+// Measure how many CPU cycles the stepper, segment preparation, temperature and serial interrupts, the planner
+// and the command processing take. M850 prints the statistics and starts over. Comment out to remove the
+// measurements, they cost a few cycles per interrupt.
+#define PROFILING
+
 
 // Firmware based and LCD controled retract
 // M207 and M208 can be used to define parameters for the retraction.
@@ -11,8 +11,6 @@
 #define PROGMEM
 #define PSTR
 #define F_CPU 96000000
-#define p_e0_dir p_e_dir
-#define p_e0_step p_e_step
 #define LOW 0
 #define HIGH 1
 
@@ -25,6 +23,7 @@
 #include "Configuration.h"
 #include "ConfigurationStore.h"
 #include "pins.h"
+#include "fastio.h"
 
 #include "main.h"
 
@@ -140,15 +139,21 @@ bool IsStopped();
 void enquecommand(const char *cmd); //put an ascii command at the end of the current buffer.
 void enquecommand_P(const char *cmd); //put an ascii command at the end of the current buffer, read from flash
 void prepare_arc_move(char isclockwise);
+void prepare_bezier_move();
 void clamp_to_software_endstops(float target[3]);
 
 #ifdef FAST_PWM_FAN
 void setPwmFrequency(uint8_t pin, int val);
 #endif
 
+// Orders memory accesses to data shared with interrupts, both in the compiler and in the CPU
+#define MEMORY_BARRIER() do { __asm__ __volatile__ ("" ::: "memory"); __DMB(); } while(0)
+
+// Keep critical sections short, they delay the stepper interrupt. They restore the previous
+// interrupt state, so they can be nested and used with interrupts already disabled.
 #ifndef CRITICAL_SECTION_START
-  #define CRITICAL_SECTION_START  cli();
-  #define CRITICAL_SECTION_END   sei();
+  #define CRITICAL_SECTION_START  uint32_t _primask = __get_PRIMASK(); __disable_irq(); MEMORY_BARRIER();
+  #define CRITICAL_SECTION_END    MEMORY_BARRIER(); __set_PRIMASK(_primask);
 #endif //CRITICAL_SECTION_START
 
 extern float homing_feedrate[];
@@ -161,10 +166,6 @@ extern float min_pos[3];
 extern float max_pos[3];
 extern int fanSpeed;
 
-#ifdef FAN_SOFT_PWM
-extern unsigned char fanSpeedSoftPwm;
-#endif
-
 #ifdef FWRETRACT
 extern bool autoretract_enabled;
 extern bool retracted;
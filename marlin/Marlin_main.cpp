@@ -33,6 +33,8 @@ http://reprap.org/pipermail/reprap-dev/2011-May/003323.html
 #include "stepper.h"
 #include "temperature.h"
 #include "motion_control.h"
+#include "gcode.h"
+#include "profile.h"
 #include "language.h"
 
 #if defined(DIGIPOTSS_PIN) && DIGIPOTSS_PIN > -1
@@ -84,6 +86,7 @@ float retract_recover_length=0, retract_recover_feedrate=8*60;
 const char axis_codes[NUM_AXIS] = {'X', 'Y', 'Z', 'E'};
 static float destination[NUM_AXIS] = {  0.0, 0.0, 0.0, 0.0};
 static float offset[3] = {0.0, 0.0, 0.0};
+static float bezier_offset[4] = {0.0, 0.0, 0.0, 0.0}; // I J P Q of G5
 static bool home_all_axis = true;
 static float feedrate = 1500.0, next_feedrate, saved_feedrate;
 static long gcode_N, gcode_LastN, Stopped_gcode_LastN = 0;
@@ -91,6 +94,7 @@ static long gcode_N, gcode_LastN, Stopped_gcode_LastN = 0;
 static bool relative_mode = false;  //Determines Absolute or Relative Coordinates
 
 static char cmdbuffer[BUFSIZE][MAX_CMD_SIZE];
+static gcode_t cmdparsed[BUFSIZE]; // the words of each line in cmdbuffer, parsed when it was queued
 static bool fromsd[BUFSIZE];
 static int bufindr = 0;
 static int bufindw = 0;
@@ -98,8 +102,12 @@ static int buflen = 0;
 //static int i = 0;
 static char serial_char;
 static int serial_count = 0;
+static char serial_line[128]; // lines taken from the serial receive buffer, consumed by get_command()
+static int serial_line_len = 0;
+static int serial_line_pos = 0;
 static bool comment_mode = false;
-static char *strchr_pointer; // just a pointer to find chars in the cmd string like X, Y, Z, E, etc
+static char *strchr_pointer; // points to the letter found by the last code_seen() in the cmd string
+static int code_index; // letter of the last code_seen(), as index into the cmdparsed fields
 
 const int sensitive_pins[] = SENSITIVE_PINS; // Sensitive pin list for M42
 
@@ -127,6 +135,7 @@ bool target_direction;
 //===========================================================================
 
 void get_arc_coordinates();
+void get_bezier_coordinates();
 bool setTargetedHotend(int code);
 
 void serial_echopair_P(const char *s_P, float v)
@@ -163,6 +172,7 @@ void enquecommand(const char *cmd)
 	{
 		//this is dangerous if a mixing of serial and this happsens
 		strcpy(&(cmdbuffer[bufindw][0]),cmd);
+		gcode_parse(&cmdparsed[bufindw], cmdbuffer[bufindw]);
 		SERIAL_ECHO_START;
 		SERIAL_ECHOPGM("enqueing \"");
 		SERIAL_ECHO(cmdbuffer[bufindw]);
@@ -178,6 +188,7 @@ void enquecommand_P(const char *cmd)
 	{
 		//this is dangerous if a mixing of serial and this happsens
 		strcpy(&(cmdbuffer[bufindw][0]),cmd);
+		gcode_parse(&cmdparsed[bufindw], cmdbuffer[bufindw]);
 		SERIAL_ECHO_START;
 		SERIAL_ECHOPGM("enqueing \"");
 		SERIAL_ECHO(cmdbuffer[bufindw]);
@@ -245,11 +256,12 @@ void setup()
 		fromsd[i] = false;
 	}
 
-	// loads data from EEPROM if available else uses defaults (and resets step acceleration rate)
+	// loads the settings from flash if available else uses defaults (and resets step acceleration rate)
 	Config_RetrieveSettings();
 
 	tp_init();    // Initialize temperature loop
 	plan_init();  // Initialize planner;
+	profile_init();
 	st_init();    // Initialize stepper, this enables interrupts!
 
 #if defined(CONTROLLERFAN_PIN) && CONTROLLERFAN_PIN > -1
@@ -264,7 +276,9 @@ void loop()
 		get_command();
 	if(buflen)
 	{
+		PROFILE_START();
 		process_commands();
+		PROFILE_END(PROFILE_COMMANDS);
 		buflen = (buflen-1);
 		bufindr = (bufindr + 1)%BUFSIZE;
 	}
@@ -276,8 +290,15 @@ void loop()
 
 void get_command()
 {
-	while( MYSERIAL.readable() && buflen < BUFSIZE) {
-		serial_char = MYSERIAL.getc();
+	while(buflen < BUFSIZE) {
+		if(serial_line_pos == serial_line_len) {
+			// Take the next complete line, never wait for one
+			serial_line_len = MYSERIAL.readLines((uint8_t *)serial_line, sizeof(serial_line), 1);
+			serial_line_pos = 0;
+			if(!serial_line_len)
+				return;
+		}
+		serial_char = serial_line[serial_line_pos++];
 		if(serial_char == '\n' ||
 				serial_char == '\r' ||
 				(serial_char == ':' && comment_mode == false) ||
@@ -291,11 +312,12 @@ void get_command()
 			if(!comment_mode){
 				comment_mode = false; //for new command
 				fromsd[bufindw] = false;
-				if(strchr(cmdbuffer[bufindw], 'N') != NULL)
+				gcode_t *cmd = &cmdparsed[bufindw];
+				gcode_parse(cmd, cmdbuffer[bufindw]);
+				if(gcode_seen(cmd, 'N'))
 				{
-					strchr_pointer = strchr(cmdbuffer[bufindw], 'N');
-					gcode_N = (strtol(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL, 10));
-					if(gcode_N != gcode_LastN+1 && (strstr(cmdbuffer[bufindw], PSTR("M110")) == NULL) ) {
+					gcode_N = cmd->value_long['N' - 'A'];
+					if(gcode_N != gcode_LastN+1 && !(gcode_seen(cmd, 'M') && cmd->value_long['M' - 'A'] == 110) ) {
 						SERIAL_ERROR_START;
 						SERIAL_ERRORPGM(MSG_ERR_LINE_NO);
 						SERIAL_ERRORLN(gcode_LastN);
@@ -305,14 +327,9 @@ void get_command()
 						return;
 					}
 
-					if(strchr(cmdbuffer[bufindw], '*') != NULL)
+					if(cmd->has_checksum)
 					{
-						char checksum = 0;
-						int count = 0;
-						while(cmdbuffer[bufindw][count] != '*') checksum = checksum^cmdbuffer[bufindw][count++];
-						strchr_pointer = strchr(cmdbuffer[bufindw], '*');
-
-						if( (int)(strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL)) != checksum) {
+						if(cmd->line_checksum != cmd->checksum) {
 							SERIAL_ERROR_START;
 							SERIAL_ERRORPGM(MSG_ERR_CHECKSUM_MISMATCH);
 							SERIAL_ERRORLN(gcode_LastN);
@@ -337,7 +354,7 @@ void get_command()
 				}
 				else  // if we don't receive 'N' but still see '*'
 				{
-					if((strchr(cmdbuffer[bufindw], '*') != NULL))
+					if(cmd->has_checksum)
 					{
 						SERIAL_ERROR_START;
 						SERIAL_ERRORPGM(MSG_ERR_NO_LINENUMBER_WITH_CHECKSUM);
@@ -346,14 +363,14 @@ void get_command()
 						return;
 					}
 				}
-				if((strchr(cmdbuffer[bufindw], 'G') != NULL)){
-					strchr_pointer = strchr(cmdbuffer[bufindw], 'G');
-					switch((int)((strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL)))){
+				if(gcode_seen(cmd, 'G')){
+					switch((int)cmd->value['G' - 'A']){
 						case 0:
 						case 1:
 						case 2:
 						case 3:
-							if(Stopped == false) { // If printer is stopped by an error the G[0-3] codes are ignored.
+						case 5:
+							if(Stopped == false) { // If printer is stopped by an error the G[0-3] and G5 codes are ignored.
 								SERIAL_PROTOCOLLNPGM(MSG_OK);
 							}
 							else {
@@ -382,18 +399,21 @@ void get_command()
 
 float code_value()
 {
-	return (strtod(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL));
+	return cmdparsed[bufindr].value[code_index];
 }
 
 long code_value_long()
 {
-	return (strtol(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL, 10));
+	return cmdparsed[bufindr].value_long[code_index];
 }
 
 bool code_seen(char code)
 {
-	strchr_pointer = strchr(cmdbuffer[bufindr], code);
-	return (strchr_pointer != NULL);  //Return True if a character was found
+	if(!gcode_seen(&cmdparsed[bufindr], code))
+		return false;
+	code_index = code - 'A';
+	strchr_pointer = &cmdbuffer[bufindr][cmdparsed[bufindr].offset[code_index]];
+	return true;  //Return True if a character was found
 }
 
 static void axis_is_at_home(int axis) {
@@ -491,11 +511,18 @@ void process_commands()
 				st_synchronize();
 				codenum += millis();  // keep track of when we started waiting
 				previous_millis_cmd = millis();
-				while(millis()  < codenum ){
+				while(PENDING(millis(), codenum)){
 					manage_heater();
 					manage_inactivity();
 				}
 				break;
+			case 5: // G5 - cubic bezier, I J is the first control point relative to the start, P Q the second one relative to the end
+				if(Stopped == false) {
+					get_bezier_coordinates();
+					prepare_bezier_move();
+					return;
+				}
+				break;
 #ifdef FWRETRACT
 			case 10: // G10 retract
 				if(!retracted)
@@ -1057,7 +1084,7 @@ void process_commands()
 						if(code_seen('T')) retract_acceleration = code_value() ;
 					}
 					break;
-					case 205: //M205 advanced settings:  minimum travel speed S=while printing T=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk
+					case 205: //M205 advanced settings:  minimum travel speed S=while printing T=travel only,  B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk, E=maximum E jerk, J=junction deviation
 					{
 						if(code_seen('S')) minimumfeedrate = code_value();
 						if(code_seen('T')) mintravelfeedrate = code_value();
@@ -1065,6 +1092,7 @@ void process_commands()
 						if(code_seen('X')) max_xy_jerk = code_value() ;
 						if(code_seen('Z')) max_z_jerk = code_value() ;
 						if(code_seen('E')) max_e_jerk = code_value() ;
+						if(code_seen('J')) junction_deviation = code_value() ;
 					}
 					break;
 					case 206: // M206 additional homeing offset
@@ -1275,12 +1303,12 @@ void process_commands()
 						st_synchronize();
 					}
 					break;
-					case 500: // M500 Store settings in EEPROM
+					case 500: // M500 Store settings in flash
 					{
 						Config_StoreSettings();
 					}
 					break;
-					case 501: // M501 Read settings from EEPROM
+					case 501: // M501 Read settings from flash
 					{
 						Config_RetrieveSettings();
 					}
@@ -1408,6 +1436,23 @@ void process_commands()
 					}
 					break;
 #endif //FILAMENTCHANGEENABLE
+#ifdef PROFILING
+					case 850: // M850 Report and reset the execution times of the interrupts and the main loop
+					{
+						profile_report();
+					}
+					break;
+#endif
+#ifdef ADVANCE
+					case 900: // M900 K<seconds> Set the extruder advance, K0 turns it off
+					{
+						if(code_seen('K')) extruder_advance_k = code_value();
+						SERIAL_ECHO_START;
+						SERIAL_ECHOPAIR("Advance K:", extruder_advance_k);
+						SERIAL_ECHOLN("");
+					}
+					break;
+#endif
 					case 907: // M907 Set digital trimpot motor current using axis codes.
 					{
 #if defined(DIGIPOTSS_PIN) && DIGIPOTSS_PIN > -1
@@ -1500,6 +1545,7 @@ void process_commands()
 	{
 	//	wait_ms(200); //dont know
 		MYSERIAL.flush();
+		serial_line_pos = serial_line_len;
 		SERIAL_PROTOCOLPGM(MSG_RESEND);
 		SERIAL_PROTOCOLLN(gcode_LastN + 1);
 		ClearToSend();
@@ -1598,6 +1644,15 @@ void process_commands()
 		}
 	}
 
+	void get_bezier_coordinates()
+	{
+		get_coordinates();
+		bezier_offset[0] = code_seen('I') ? code_value() : 0.0;
+		bezier_offset[1] = code_seen('J') ? code_value() : 0.0;
+		bezier_offset[2] = code_seen('P') ? code_value() : 0.0;
+		bezier_offset[3] = code_seen('Q') ? code_value() : 0.0;
+	}
+
 	void clamp_to_software_endstops(float target[3])
 	{
 		if (min_software_endstops) {
@@ -1647,6 +1702,19 @@ void process_commands()
 		previous_millis_cmd = millis();
 	}
 
+	void prepare_bezier_move() {
+		// Flatten the curve into the planner
+		mc_bezier(current_position, destination, bezier_offset, feedrate*feedmultiply/60/100.0, active_extruder);
+
+		// As far as the parser is concerned, the position is now == target. In reality the
+		// motion control system might still be processing the action and the real tool position
+		// in any intermediate location.
+		for(int8_t i=0; i < NUM_AXIS; i++) {
+			current_position[i] = destination[i];
+		}
+		previous_millis_cmd = millis();
+	}
+
 #if defined(CONTROLLERFAN_PIN) && CONTROLLERFAN_PIN > -1
 
 #if defined(FAN_PIN)
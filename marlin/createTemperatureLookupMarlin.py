@@ -20,6 +20,10 @@ Options:
   --t1=ttt:rrr      middle temperature temperature:resistance point (around 150C)
   --t2=ttt:rrr      high temperature temperature:resistance point (around 250C)
   --num-temps=...   the number of temperature points to calculate (default: 20)
+  --max-adc=...     highest ADC value of the table (default: 1023, the 10 bit scale of thermistortables.h)
+  --name=...        table number, the table is written as temptable_<name> (default: 1)
+
+The table is sorted by ascending ADC value, analog2temp_thermistor() looks it up by binary search.
 """
 
 from math import *
@@ -54,20 +58,20 @@ class Thermistor:
 		self.c2 = c2
 		self.c3 = c3
 
-	def temp(self,adc):
+	def temp(self,adc,max_adc):
 		"Convert ADC reading into a temperature in Celcius"
-		v = adc * self.vadc / (1024 * 16)   # convert the 10 bit ADC value to a voltage
+		v = adc * self.vadc / (max_adc + 1)   # convert the ADC value to a voltage
 		r = self.rp * v / (self.vcc - v)    # resistance of thermistor
 		lnr = log(r)
 		Tinv = self.c1 + (self.c2*lnr) + (self.c3*pow(lnr,3))
 		return (1/Tinv) - 273.15        # temperature
 
-	def adc(self,temp):
+	def adc(self,temp,max_adc):
 		"Convert temperature into a ADC reading"
 		y = (self.c1 - (1/(temp+273.15))) / (2*self.c3)
 		x = sqrt(pow(self.c2 / (3*self.c3),3) + pow(y,2))
 		r = exp(pow(x-y,1.0/3) - pow(x+y,1.0/3)) # resistance of thermistor
-		return (r / (self.rp + r)) * (1024*16)
+		return (r / (self.rp + r)) * (max_adc + 1)
 
 def main(argv):
 	rp = 4700;
@@ -78,9 +82,11 @@ def main(argv):
 	t3 = 250;
 	r3 = 226.15;
 	num_temps = int(36);
+	max_adc = 1023
+	name = "1"
 
 	try:
-		opts, args = getopt.getopt(argv, "h", ["help", "rp=", "t1=", "t2=", "t3=", "num-temps="])
+		opts, args = getopt.getopt(argv, "h", ["help", "rp=", "t1=", "t2=", "t3=", "num-temps=", "max-adc=", "name="])
 	except getopt.GetoptError:
 		usage()
 		sys.exit(2)
@@ -105,29 +111,30 @@ def main(argv):
 			r3 = float( arg[1])
 		elif opt == "--num-temps":
 			num_temps =  int(arg)
+		elif opt == "--max-adc":
+			max_adc = int(arg)
+		elif opt == "--name":
+			name = arg
 
-	max_adc = (1024 * 16) - 1
 	min_temp = 0
 	max_temp = 350
-	increment = int(max_adc/(num_temps-1));
 
 	t = Thermistor(rp, t1, r1, t2, r2, t3, r3)
-	tmp = (min_temp - max_temp) / (num_temps-1)
-	print(tmp)
-	temps = range(max_temp, min_temp + tmp, tmp);
+	# from hot to cold, so the ADC values are ascending
+	temps = [max_temp - (max_temp - min_temp) * i // (num_temps - 1) for i in range(num_temps)]
 
 	print("// Thermistor lookup table for Marlin")
-	print("// ./createTemperatureLookup.py --rp=%s --t1=%s:%s --t2=%s:%s --t3=%s:%s --num-temps=%s" % (rp, t1, r1, t2, r2, t3, r3, num_temps))
-	print( "#define NUMTEMPS %s" % (len(temps)))
-	print("short temptable[NUMTEMPS][2] = {")
+	print("// ./createTemperatureLookupMarlin.py --rp=%s --t1=%s:%s --t2=%s:%s --t3=%s:%s --num-temps=%s --max-adc=%s --name=%s" % (rp, t1, r1, t2, r2, t3, r3, num_temps, max_adc, name))
+	print("#define NUMTEMPS_%s %s" % (name, len(temps)))
+	print("const short temptable_%s[NUMTEMPS_%s][2] = {" % (name, name))
 
 	counter = 0
 	for temp in temps:
 		counter = counter +1
 		if counter == len(temps):
-			print("   {%s, %s}" % (int(t.adc(temp)), temp))
+			print("   {%s, %s}" % (int(t.adc(temp, max_adc)), temp))
 		else:
-			print ("   {%s, %s}," % (int(t.adc(temp)), temp))
+			print ("   {%s, %s}," % (int(t.adc(temp, max_adc)), temp))
 	print("};")
 
 def usage():
@@ -0,0 +1,39 @@
+/*
+  fastio.h - direct GPIO register access for the LPC1768
+  Part of Marlin
+
+  The mbed pin names encode the GPIO port and bit of a pin: pin = LPC_GPIO0_BASE + port*32 + bit.
+  These macros turn a pin name from pins.h into the FIO registers of its port, so pins can be
+  written without going through DigitalOut, and pins of one port can be changed with a single write.
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef fastio_h
+#define fastio_h
+
+#include "mbed.h"
+
+// GPIO port number (0-4) and bit mask of a pin
+#define PIN_PORT(pin) ((((uint32_t)(pin)) - (uint32_t)P0_0) >> 5)
+#define PIN_MASK(pin) (1UL << ((((uint32_t)(pin)) - (uint32_t)P0_0) & 31))
+
+// The FIO register block of the port of a pin
+#define PIN_GPIO(pin) ((LPC_GPIO_TypeDef *)(LPC_GPIO0_BASE + PIN_PORT(pin) * 0x20))
+
+#define READ(pin) ((PIN_GPIO(pin)->FIOPIN & PIN_MASK(pin)) != 0)
+
+#define WRITE(pin, v) do { if(v) PIN_GPIO(pin)->FIOSET = PIN_MASK(pin); else PIN_GPIO(pin)->FIOCLR = PIN_MASK(pin); } while(0)
+
+#endif
@@ -0,0 +1,113 @@
+/*
+  gcode.cpp - splits a G-code line into its words
+  Part of Marlin
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <limits.h>
+#include "gcode.h"
+
+// Powers of ten that are exact in a float, and in a double
+static const float pow10f[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f };
+static const double pow10d[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+#define MAX_FRACTION_DIGITS 22
+
+// Largest mantissa that still takes another digit and stays exact in a double
+#define MAX_MANTISSA 900000000000000ULL
+
+// The digits of the number are collected into one integer m, the value is m / 10^frac.
+// For m < 2^24 both operands are exact floats and one float division gives the correctly
+// rounded result. With at most 8 fraction digits the quotient can't be close enough to a
+// float rounding boundary for strtod()'s double result to round differently, so this is
+// also what (float)strtod() returns. Other numbers take the slower double division, which
+// is exact as well. Digits beyond the 15th significant one are dropped.
+const char *gcode_number(const char *s, float *value, long *value_long)
+{
+	unsigned long long m = 0;
+	unsigned long ip = 0;
+	int frac = 0, scale = 0;
+	bool negative = false;
+	const char *start = s, *digits;
+	float v;
+
+	while(*s == ' ' || (*s >= '\t' && *s <= '\r')) s++;
+	if(*s == '-' || *s == '+') negative = (*s++ == '-');
+	digits = s;
+	for(; *s >= '0' && *s <= '9'; s++)
+	{
+		unsigned char d = *s - '0';
+		if(m < MAX_MANTISSA) m = m * 10 + d; else scale++;
+		if(ip <= ((unsigned long)LONG_MAX + 1 - d) / 10) ip = ip * 10 + d; else ip = (unsigned long)LONG_MAX + 1;
+	}
+	if(*s == '.')
+	{
+		for(s++; *s >= '0' && *s <= '9'; s++)
+		{
+			if(m < MAX_MANTISSA && frac < MAX_FRACTION_DIGITS) { m = m * 10 + (*s - '0'); frac++; }
+		}
+	}
+
+	if(scale) // more than 15 integer digits
+	{
+		double d = (double)m;
+		for(; scale > MAX_FRACTION_DIGITS; scale -= MAX_FRACTION_DIGITS) d *= pow10d[MAX_FRACTION_DIGITS];
+		v = (float)(d * pow10d[scale]);
+	}
+	else if(m < (1UL << 24) && frac <= 8)
+		v = (float)(unsigned long)m / pow10f[frac];
+	else
+		v = (float)((double)m / pow10d[frac]);
+	*value = negative ? -v : v;
+
+	if(ip > (unsigned long)LONG_MAX) // like strtol(), saturate
+		*value_long = negative ? LONG_MIN : LONG_MAX;
+	else
+		*value_long = negative ? -(long)ip : (long)ip;
+	return s == digits || (s == digits + 1 && *digits == '.') ? start : s; // no digits, no number
+}
+
+void gcode_parse(gcode_t *cmd, const char *line)
+{
+	unsigned long seen = 0;
+	unsigned char checksum = 0;
+	const char *p;
+
+	cmd->has_checksum = false;
+	cmd->line_checksum = 0;
+	for(p = line; *p; p++)
+	{
+		char c = *p;
+		if(c == '*')
+		{
+			cmd->has_checksum = true;
+			float v;
+			long l;
+			gcode_number(p + 1, &v, &l);
+			cmd->line_checksum = l;
+			break;
+		}
+		checksum ^= c;
+		if(c >= 'A' && c <= 'Z' && !(seen & GCODE_BIT(c)))
+		{
+			int i = c - 'A';
+			seen |= GCODE_BIT(c);
+			cmd->offset[i] = p - line;
+			gcode_number(p + 1, &cmd->value[i], &cmd->value_long[i]);
+		}
+	}
+	cmd->seen = seen;
+	cmd->checksum = checksum;
+}
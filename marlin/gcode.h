@@ -0,0 +1,56 @@
+/*
+  gcode.h - splits a G-code line into its words
+  Part of Marlin
+
+  A line is scanned once when it is received. The value of every letter is parsed in that
+  pass, together with the checksum, so looking up a parameter later is a table access
+  instead of a search through the line.
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef gcode_h
+#define gcode_h
+
+#define GCODE_LETTERS 26
+
+// Bit of a letter (A-Z) in gcode_t.seen
+#define GCODE_BIT(c) (1UL << ((c) - 'A'))
+
+typedef struct {
+	unsigned long seen;                       // GCODE_BIT() of every letter in the line
+	float value[GCODE_LETTERS];               // number following each letter, 0 if there is none
+	long value_long[GCODE_LETTERS];           // same number truncated to an integer, like strtol()
+	unsigned short offset[GCODE_LETTERS];     // position of each letter in the line
+	bool has_checksum;                        // the line contains '*'
+	unsigned char checksum;                   // xor of all characters before the '*'
+	int line_checksum;                        // the checksum sent after the '*'
+} gcode_t;
+
+// Parse a G-code number: optional white space and sign, digits and an optional fraction. value is
+// the number rounded to the nearest float, value_long its integer part as strtol() would return it.
+// Exponents, hex and inf/nan are not part of the grammar, so "X1E5" is X1 followed by E5.
+// Returns a pointer to the first character after the number, or s if there are no digits.
+const char *gcode_number(const char *s, float *value, long *value_long);
+
+// Tokenize a line. If a letter appears more than once, its first occurrence is used.
+// Letters after the '*' are not looked at.
+void gcode_parse(gcode_t *cmd, const char *line);
+
+static inline bool gcode_seen(const gcode_t *cmd, char c)
+{
+	return c >= 'A' && c <= 'Z' && (cmd->seen & GCODE_BIT(c));
+}
+
+#endif
@@ -23,8 +23,31 @@
 #include "stepper.h"
 #include "planner.h"
 
-// The arc is approximated by generating a huge number of tiny, linear segments. The length of each 
-// segment is configured in settings.mm_per_arc_segment.  
+#define ARC_FIXED_SHIFT 16 // The radius vector of mc_arc() is rotated in 1/65536 mm
+
+// Shortest segment for curves at the feed rate. The number of segments per second is limited so that
+// half the block buffer still holds minsegmenttime of moves, the planner slows down below that (SLOWDOWN).
+// No segment is shorter than MIN_MM_PER_ARC_SEGMENT.
+static float min_mm_per_segment(float feed_rate)
+{
+  float mm = feed_rate*minsegmenttime/(1000000.0*(BLOCK_BUFFER_SIZE/2));
+  if (mm < MIN_MM_PER_ARC_SEGMENT) { mm = MIN_MM_PER_ARC_SEGMENT; }
+  return mm;
+}
+
+#ifdef NATIVE_ARCS
+// True if the whole circle is within the software endstops in X and Y
+static bool arc_within_software_endstops(float center_x, float center_y, float radius)
+{
+  if (min_software_endstops && (center_x - radius < min_pos[X_AXIS] || center_y - radius < min_pos[Y_AXIS])) { return false; }
+  if (max_software_endstops && (center_x + radius > max_pos[X_AXIS] || center_y + radius > max_pos[Y_AXIS])) { return false; }
+  return true;
+}
+#endif
+
+// The arc is approximated by a number of short, linear segments. They are chords of the arc, as long as
+// they can be while their middle stays within ARC_TOLERANCE of the arc, so a large arc doesn't flood the
+// planner and a small one still keeps its shape. The segments are no shorter than min_mm_per_segment().
 void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8_t axis_1, 
   uint8_t axis_linear, float feed_rate, float radius, uint8_t isclockwise, uint8_t extruder)
 {      
@@ -46,7 +69,27 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
   
   float millimeters_of_travel = hypot(angular_travel*radius, fabs(linear_travel));
   if (millimeters_of_travel < 0.001) { return; }
-  uint16_t segments = floor(millimeters_of_travel/MM_PER_ARC_SEGMENT);
+
+#ifdef NATIVE_ARCS
+  // The arc is one block that the stepper follows, unless it could leave the software endstops which
+  // only the segments can be clamped to
+  if (axis_0 == X_AXIS && axis_1 == Y_AXIS && arc_within_software_endstops(center_axis0, center_axis1, radius)) {
+    plan_buffer_arc(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], center_axis0, center_axis1,
+      angular_travel, feed_rate, extruder);
+    return;
+  }
+#endif
+
+  // The chord of angle theta is radius*(1-cos(theta/2)) away from the arc in its middle
+  float tolerance_segments = 1;
+  if (radius > ARC_TOLERANCE) {
+    float theta_max = 2*acos(1-ARC_TOLERANCE/radius);
+    tolerance_segments = ceil(fabs(angular_travel)/theta_max);
+  }
+  float max_segments = floor(millimeters_of_travel/min_mm_per_segment(feed_rate));
+  if (tolerance_segments > max_segments) { tolerance_segments = max_segments; }
+  if (tolerance_segments > 65535) { tolerance_segments = 65535; }
+  uint16_t segments = tolerance_segments;
   if(segments == 0) segments = 1;
   
   /*  
@@ -67,31 +110,25 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
      For arc generation, the center of the circle is the axis of rotation and the radius vector is 
      defined from the circle center to the initial position. Each line segment is formed by successive
      vector rotations. This requires only two cos() and sin() computations to form the rotation
-     matrix for the duration of the entire arc. Error may accumulate from numerical round-off, since
-     all double numbers are single precision on the Arduino. (True double precision will not have
-     round off issues for CNC applications.) Single precision error can accumulate to be greater than
-     tool precision in some cases. Therefore, arc path correction is implemented. 
-
-     Small angle approximation may be used to reduce computation overhead further. This approximation
-     holds for everything, but very small circles and large mm_per_arc_segment values. In other words,
-     theta_per_segment would need to be greater than 0.1 rad and N_ARC_CORRECTION would need to be large
-     to cause an appreciable drift error. N_ARC_CORRECTION~=25 is more than small enough to correct for 
-     numerical drift error. N_ARC_CORRECTION may be on the order a hundred(s) before error becomes an
-     issue for CNC machines with the single precision Arduino calculations.
-     
-     This approximation also allows mc_arc to immediately insert a line segment into the planner 
-     without the initial overhead of computing cos() or sin(). By the time the arc needs to be applied
-     a correction, the planner should have caught up to the lag caused by the initial mc_arc overhead. 
-     This is important when there are successive arc motions. 
+     matrix for the duration of the entire arc.
+
+     The rotation runs in fixed point: the radius vector in 1/65536 mm (ARC_FIXED_SHIFT) and the matrix
+     in 2.30 format. The Cortex-M3 multiplies 32x32 to 64 bits in one instruction, while every float
+     operation is a library call. The segments can be long enough that the small angle approximation
+     of the matrix would be off, so it is computed with cos() and sin() once per arc. Error may still
+     accumulate from round-off, therefore arc path correction is implemented: every N_ARC_CORRECTION
+     segments the exact location is computed from the initial radius vector.
   */
   // Vector rotation matrix values
-  float cos_T = 1-0.5*theta_per_segment*theta_per_segment; // Small angle approximation
-  float sin_T = theta_per_segment;
+  long cos_T = lround(cos(theta_per_segment)*(1L<<30));
+  long sin_T = lround(sin(theta_per_segment)*(1L<<30));
+  long r_fixed0 = lround(r_axis0*(1L<<ARC_FIXED_SHIFT));
+  long r_fixed1 = lround(r_axis1*(1L<<ARC_FIXED_SHIFT));
   
   float arc_target[4];
   float sin_Ti;
   float cos_Ti;
-  float r_axisi;
+  long r_fixedi;
   uint16_t i;
   int8_t count = 0;
 
@@ -105,23 +142,23 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
     
     if (count < N_ARC_CORRECTION) {
       // Apply vector rotation matrix 
-      r_axisi = r_axis0*sin_T + r_axis1*cos_T;
-      r_axis0 = r_axis0*cos_T - r_axis1*sin_T;
-      r_axis1 = r_axisi;
+      r_fixedi = ((int64_t)r_fixed0*sin_T + (int64_t)r_fixed1*cos_T + (1L<<29)) >> 30;
+      r_fixed0 = ((int64_t)r_fixed0*cos_T - (int64_t)r_fixed1*sin_T + (1L<<29)) >> 30;
+      r_fixed1 = r_fixedi;
       count++;
     } else {
       // Arc correction to radius vector. Computed only every N_ARC_CORRECTION increments.
       // Compute exact location by applying transformation matrix from initial radius vector(=-offset).
       cos_Ti = cos(i*theta_per_segment);
       sin_Ti = sin(i*theta_per_segment);
-      r_axis0 = -offset[axis_0]*cos_Ti + offset[axis_1]*sin_Ti;
-      r_axis1 = -offset[axis_0]*sin_Ti - offset[axis_1]*cos_Ti;
+      r_fixed0 = lround((-offset[axis_0]*cos_Ti + offset[axis_1]*sin_Ti)*(1L<<ARC_FIXED_SHIFT));
+      r_fixed1 = lround((-offset[axis_0]*sin_Ti - offset[axis_1]*cos_Ti)*(1L<<ARC_FIXED_SHIFT));
       count = 0;
     }
 
     // Update arc_target location
-    arc_target[axis_0] = center_axis0 + r_axis0;
-    arc_target[axis_1] = center_axis1 + r_axis1;
+    arc_target[axis_0] = center_axis0 + r_fixed0*(1.0f/(1L<<ARC_FIXED_SHIFT));
+    arc_target[axis_1] = center_axis1 + r_fixed1*(1.0f/(1L<<ARC_FIXED_SHIFT));
     arc_target[axis_linear] += linear_per_segment;
     arc_target[E_AXIS] += extruder_per_segment;
 
@@ -135,3 +172,61 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
   //   plan_set_acceleration_manager_enabled(acceleration_manager_was_enabled);
 }
 
+// Point of the cubic Bezier curve p0, p1, p2, p3 at t
+static float bezier_point(float p0, float p1, float p2, float p3, float t)
+{
+  float u = 1-t;
+  return u*u*u*p0 + 3*u*u*t*p1 + 3*u*t*t*p2 + t*t*t*p3;
+}
+
+// The curve is flattened while it is planned. Every step of the curve parameter makes a segment whose
+// middle is within ARC_TOLERANCE of the curve: the step is halved as long as the point of the curve
+// halfway between its ends is further from the middle of the chord, and doubled after a segment that was
+// well within. plan_buffer_line() waits for a free block for every segment, so a long curve never needs
+// more memory than the next segment. Segments are no shorter than min_mm_per_segment(), like the arcs.
+void mc_bezier(float *position, float *target, float *offset, float feed_rate, uint8_t extruder)
+{
+  float px[4] = { position[X_AXIS], position[X_AXIS] + offset[0], target[X_AXIS] + offset[2], target[X_AXIS] };
+  float py[4] = { position[Y_AXIS], position[Y_AXIS] + offset[1], target[Y_AXIS] + offset[3], target[Y_AXIS] };
+  float min_mm = min_mm_per_segment(feed_rate);
+  float segment_target[4];
+  float t = 0;
+  float step = 0.1;
+  float last_x = px[0], last_y = py[0];
+  bool halved = false; // the step was too long for the deviation at this t
+
+  while (t < 1) {
+    float t1 = t + step;
+    if (t1 > 1) { t1 = 1; }
+    float x = bezier_point(px[0], px[1], px[2], px[3], t1);
+    float y = bezier_point(py[0], py[1], py[2], py[3], t1);
+    float deviation = hypot(bezier_point(px[0], px[1], px[2], px[3], (t+t1)/2) - (last_x+x)/2,
+                            bezier_point(py[0], py[1], py[2], py[3], (t+t1)/2) - (last_y+y)/2);
+    float chord = hypot(x-last_x, y-last_y);
+    if (deviation > ARC_TOLERANCE && chord > 2*min_mm && step > 0.0001) {
+      step /= 2;
+      halved = true;
+      continue;
+    }
+    if (t1 >= 1) { break; }
+    // Doubling a step that was just halved would alternate forever, take the short segment instead
+    if (chord < min_mm && deviation < ARC_TOLERANCE && !halved) {
+      step *= 2;
+      continue;
+    }
+
+    t = t1;
+    segment_target[X_AXIS] = x;
+    segment_target[Y_AXIS] = y;
+    segment_target[Z_AXIS] = position[Z_AXIS] + (target[Z_AXIS]-position[Z_AXIS])*t;
+    segment_target[E_AXIS] = position[E_AXIS] + (target[E_AXIS]-position[E_AXIS])*t;
+    clamp_to_software_endstops(segment_target);
+    plan_buffer_line(segment_target[X_AXIS], segment_target[Y_AXIS], segment_target[Z_AXIS], segment_target[E_AXIS], feed_rate, extruder);
+    last_x = x;
+    last_y = y;
+    halved = false;
+    if (deviation < ARC_TOLERANCE/4 && step < 0.5) { step *= 2; }
+  }
+  // Ensure last segment arrives at target location.
+  plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feed_rate, extruder);
+}
@@ -28,5 +28,9 @@
 // for vector transformation direction.
 void mc_arc(float *position, float *target, float *offset, unsigned char axis_0, unsigned char axis_1,
   unsigned char axis_linear, float feed_rate, float radius, unsigned char isclockwise, uint8_t extruder);
+
+// Execute a cubic Bezier curve in the XY plane from position to target. The control points are
+// position + offset[0..1] and target + offset[2..3]. Z and E move along with the curve parameter.
+void mc_bezier(float *position, float *target, float *offset, float feed_rate, uint8_t extruder);
   
 #endif
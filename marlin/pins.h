@@ -21,6 +21,7 @@
 
 #define E_STEP_PIN         p11
 #define E_DIR_PIN          p12
+#define E0_STEP_PIN         p11
 #define E0_DIR_PIN          p12
 #define E_ENABLE_PIN       NOT_USED // not used. For me --> ALWAYS ON!
 
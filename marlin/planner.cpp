@@ -56,6 +56,7 @@
 #include "stepper.h"
 #include "temperature.h"
 #include "language.h"
+#include "profile.h"
 
 
 double min(float& a, double& b)
@@ -68,7 +69,7 @@ int max(int a, int b)
 	if(a > b) return a;
 	return b;
 }
-int square(int b)
+float square(float b)
 {
 	return b*b;
 }
@@ -86,13 +87,18 @@ float retract_acceleration; //  mm/s^2   filament pull-pack and push-forward  wh
 float max_xy_jerk; //speed than can be stopped at once, if i understand correctly.
 float max_z_jerk;
 float max_e_jerk;
+float junction_deviation; // mm, 0 for the jerk limits. M205 J
 float mintravelfeedrate;
 unsigned long axis_steps_per_sqr_second[NUM_AXIS];
+#ifdef ADVANCE
+float extruder_advance_k; // s. M900 K
+#endif
 
 // The current position of the tool in absolute steps
 long position[4];   //rescaled from extern when axis_steps_per_unit are changed by gcode
 static float previous_speed[4]; // Speed of previous path line segment
 static float previous_nominal_speed; // Nominal speed of previous path line segment
+static float previous_unit_vec[3]; // Direction of previous path line segment in XYZ, 0 if it only moved E
 
 #ifdef AUTOTEMP
 float autotemp_max=250;
@@ -107,6 +113,7 @@ bool autotemp_enabled=false;
 block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 volatile unsigned char block_buffer_tail;           // Index of the block to process now
+unsigned char block_buffer_planned;                 // Index of the oldest block whose entry speed can still change
 
 //===========================================================================
 //=============================private variables ============================
@@ -176,8 +183,8 @@ FORCE_INLINE float intersection_distance(float initial_rate, float final_rate, f
 }
 
 // Calculates trapezoid parameters so that the entry- and exit-speed is compensated by the provided factors.
-
-void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exit_factor) {
+// Returns false if the block has been taken by st_prep_buffer() and keeps the trapezoid it had.
+bool calculate_trapezoid_for_block(block_t *block, float entry_factor, float exit_factor) {
   unsigned long initial_rate = ceil(block->nominal_rate*entry_factor); // (step/min)
   unsigned long final_rate = ceil(block->nominal_rate*exit_factor); // (step/min)
 
@@ -191,9 +198,9 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
 
   long acceleration = block->acceleration_st;
   int32_t accelerate_steps =
-    ceil(estimate_acceleration_distance(block->initial_rate, block->nominal_rate, acceleration));
+    ceil(estimate_acceleration_distance(initial_rate, block->nominal_rate, acceleration));
   int32_t decelerate_steps =
-    floor(estimate_acceleration_distance(block->nominal_rate, block->final_rate, -acceleration));
+    floor(estimate_acceleration_distance(block->nominal_rate, final_rate, -acceleration));
 
   // Calculate the size of Plateau of Nominal Rate.
   int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
@@ -202,31 +209,49 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
   // have to use intersection_distance() to calculate when to abort acceleration and start braking
   // in order to reach the final_rate exactly at the end of this block.
   if (plateau_steps < 0) {
-    accelerate_steps = ceil(intersection_distance(block->initial_rate, block->final_rate, acceleration, block->step_event_count));
+    accelerate_steps = ceil(intersection_distance(initial_rate, final_rate, acceleration, block->step_event_count));
     accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
-    accelerate_steps = min((uint32_t)accelerate_steps,block->step_event_count);//(We can cast here to unsigned, because the above line ensures that we are above zero)
+    if((uint32_t)accelerate_steps > block->step_event_count) {//(We can cast here to unsigned, because the above line ensures that we are above zero)
+      accelerate_steps = block->step_event_count;
+    }
     plateau_steps = 0;
   }
 
 #ifdef ADVANCE
-  volatile long initial_advance = block->advance*entry_factor*entry_factor;
-  volatile long final_advance = block->advance*exit_factor*exit_factor;
+  // The advance is proportional to the E speed, so it scales with the step rate
+  long initial_advance = ((long long)block->advance*initial_rate)/block->nominal_rate;
+  long final_advance = ((long long)block->advance*final_rate)/block->nominal_rate;
+  if(initial_advance > block->advance) {
+    initial_advance = block->advance;
+  }
+  if(final_advance > block->advance) {
+    final_advance = block->advance;
+  }
 #endif // ADVANCE
 
-  // block->accelerate_until = accelerate_steps;
-  // block->decelerate_after = accelerate_steps+plateau_steps;
-  CRITICAL_SECTION_START;  // Fill variables used by the stepper in a critical section
+  // The trapezoid is published to st_prep_buffer() with a sequence counter instead of a critical section.
+  // The counter is odd while the variables are written, and the segment preparation (an interrupt, it never
+  // sees a half written trapezoid) only starts on a block while it is even. Once the block is busy it is not
+  // touched anymore.
+  bool published = false;
   if(block->busy == false) { // Don't update variables if block is busy.
-    block->accelerate_until = accelerate_steps;
-    block->decelerate_after = accelerate_steps+plateau_steps;
-    block->initial_rate = initial_rate;
-    block->final_rate = final_rate;
+    block->trapezoid_seq++;
+    MEMORY_BARRIER();
+    if(block->busy == false) { // The block can have been taken before the counter became odd
+      block->accelerate_until = accelerate_steps;
+      block->decelerate_after = accelerate_steps+plateau_steps;
+      block->initial_rate = initial_rate;
+      block->final_rate = final_rate;
 #ifdef ADVANCE
-    block->initial_advance = initial_advance;
-    block->final_advance = final_advance;
+      block->initial_advance = initial_advance;
+      block->final_advance = final_advance;
 #endif //ADVANCE
+      published = true;
+    }
+    MEMORY_BARRIER();
+    block->trapezoid_seq++;
   }
-  CRITICAL_SECTION_END;
+  return published;
 }
 
 // Calculates the maximum allowable speed at this point when you must be able to reach target_velocity using the
@@ -249,6 +274,10 @@ void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *n
   if(!current) {
     return;
   }
+  // The exit speed of a block that is already cut into step segments can't change anymore.
+  if(previous && previous->busy) {
+    return;
+  }
 
   if (next) {
     // If entry speed is already at the maximum entry speed, no need to recheck. Block is cruising.
@@ -272,33 +301,39 @@ void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *n
 }
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This
-// implements the reverse pass.
+// implements the reverse pass. It stops at block_buffer_planned, the blocks before it can't get faster anymore.
 void planner_reverse_pass() {
-  uint8_t block_index = block_buffer_head;
-
   //Make a local copy of block_buffer_tail, because the interrupt can alter it
   CRITICAL_SECTION_START;
   unsigned char tail = block_buffer_tail;
   CRITICAL_SECTION_END
 
-  if(((block_buffer_head-tail + BLOCK_BUFFER_SIZE) & (BLOCK_BUFFER_SIZE - 1)) > 3) {
-    block_index = (block_buffer_head - 3) & (BLOCK_BUFFER_SIZE - 1);
-    block_t *block[3] = {
-      NULL, NULL, NULL         };
-    while(block_index != tail) {
-      block_index = prev_block_index(block_index);
-      block[2]= block[1];
-      block[1]= block[0];
-      block[0] = &block_buffer[block_index];
-      planner_reverse_pass_kernel(block[0], block[1], block[2]);
-    }
+  if(block_buffer_head == tail) {
+    return;
+  }
+  // The blocks up to block_buffer_planned may have been executed in the meantime
+  if(((block_buffer_planned - tail) & (BLOCK_BUFFER_SIZE - 1)) >= ((block_buffer_head - tail) & (BLOCK_BUFFER_SIZE - 1))) {
+    block_buffer_planned = tail;
+  }
+
+  uint8_t block_index = block_buffer_head;
+  block_t *block[3] = {
+    NULL, NULL, NULL         };
+  while(block_index != block_buffer_planned) {
+    block_index = prev_block_index(block_index);
+    block[2]= block[1];
+    block[1]= block[0];
+    block[0] = &block_buffer[block_index];
+    planner_reverse_pass_kernel(block[0], block[1], block[2]);
   }
 }
 
 // The kernel called by planner_recalculate() when scanning the plan from first to last entry.
-void planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *next) {
-  if(!previous) {
-    return;
+// Returns true when the entry speed of current can't be raised by any later block anymore, because it
+// is at the junction limit or at the highest speed the previous block can accelerate to.
+bool planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *next) {
+  if(!previous || previous->busy) {
+    return false;
   }
 
   // If the previous block is an acceleration block, but it is not long enough to complete the
@@ -314,45 +349,70 @@ void planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *n
       if (current->entry_speed != entry_speed) {
         current->entry_speed = entry_speed;
         current->recalculate_flag = true;
+        return true;
       }
     }
   }
+  return current->entry_speed == current->max_entry_speed;
 }
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This
-// implements the forward pass.
+// implements the forward pass. New blocks can only raise entry speeds, so once a block is at its highest
+// possible entry speed, it and every block before it are final. block_buffer_planned is moved there so
+// the next recalculation doesn't walk those blocks again.
 void planner_forward_pass() {
-  uint8_t block_index = block_buffer_tail;
-  block_t *block[3] = {
-    NULL, NULL, NULL   };
+  uint8_t block_index = block_buffer_planned;
+  block_t *previous;
+  block_t *current = NULL;
 
   while(block_index != block_buffer_head) {
-    block[0] = block[1];
-    block[1] = block[2];
-    block[2] = &block_buffer[block_index];
-    planner_forward_pass_kernel(block[0],block[1],block[2]);
+    previous = current;
+    current = &block_buffer[block_index];
+    if(planner_forward_pass_kernel(previous, current, NULL)) {
+      block_buffer_planned = block_index;
+    }
     block_index = next_block_index(block_index);
   }
-  planner_forward_pass_kernel(block[1], block[2], NULL);
 }
 
-// Recalculates the trapezoid speed profiles for all blocks in the plan according to the
+// Recalculates the trapezoid speed profiles for the blocks from block_index on according to the
 // entry_factor for each junction. Must be called by planner_recalculate() after
 // updating the blocks.
-void planner_recalculate_trapezoids() {
-  int8_t block_index = block_buffer_tail;
+// The passes leave the entry speed of a block alone while the block before it is busy, but st_prep_buffer()
+// can take a block after the passes are done with it. Its trapezoid then keeps the old exit speed, and the
+// next block is brought back down to it, along with the blocks after it that can't be reached from there.
+void planner_recalculate_trapezoids(int8_t block_index) {
   block_t *current;
   block_t *next = NULL;
+  bool lowered = false; // the entry speed of next has been lowered to what current still reaches
 
   while(block_index != block_buffer_head) {
     current = next;
     next = &block_buffer[block_index];
     if (current) {
+      if (lowered) {
+        lowered = false;
+        if (!current->nominal_length_flag) {
+          float reachable = max_allowable_speed(-current->acceleration, current->entry_speed, current->millimeters);
+          if (next->entry_speed > reachable) {
+            next->entry_speed = reachable;
+            next->recalculate_flag = true;
+            lowered = true;
+          }
+        }
+      }
       // Recalculate if current block entry or exit junction speed has changed.
       if (current->recalculate_flag || next->recalculate_flag) {
         // NOTE: Entry and exit factors always > 0 by all previous logic operations.
-        calculate_trapezoid_for_block(current, current->entry_speed/current->nominal_speed,
-        next->entry_speed/current->nominal_speed);
+        if (!calculate_trapezoid_for_block(current, current->entry_speed/current->nominal_speed,
+        next->entry_speed/current->nominal_speed)) {
+          float exit_speed = current->nominal_speed*current->final_rate/current->nominal_rate;
+          if (next->entry_speed > exit_speed) {
+            next->entry_speed = exit_speed;
+            next->recalculate_flag = true;
+            lowered = true;
+          }
+        }
         current->recalculate_flag = false; // Reset current only to ensure next trapezoid is computed
       }
     }
@@ -382,16 +442,22 @@ void planner_recalculate_trapezoids() {
 // the set limit. Finally it will:
 //
 //   3. Recalculate trapezoids for all blocks.
+//
+// Only the blocks from block_buffer_planned on are visited, the ones before it are already optimal.
 
 void planner_recalculate() {
+	PROFILE_START();
 	planner_reverse_pass();
+	uint8_t first = block_buffer_planned; // The oldest block whose exit speed may change
 	planner_forward_pass();
-	planner_recalculate_trapezoids();
+	planner_recalculate_trapezoids(first);
+	PROFILE_END(PROFILE_PLANNER);
 }
 
 void plan_init() {
 	block_buffer_head = 0;
 	block_buffer_tail = 0;
+	block_buffer_planned = 0;
 	memset(position, 0, sizeof(position)); // clear position
 	previous_speed[0] = 0.0;
 	previous_speed[1] = 0.0;
@@ -483,29 +549,56 @@ void check_axes_activity()
         // Just starting up fan - run at full power.
         fan_kick_end = millis() + FAN_KICKSTART_TIME;
         tail_fan_speed = 255;
-      } else if (fan_kick_end > millis())
+      } else if (PENDING(millis(), fan_kick_end))
         // Fan still spinning up.
         tail_fan_speed = 255;
     } else {
       fan_kick_end = 0;
     }
   #endif//FAN_KICKSTART_TIME
-  #ifdef FAN_SOFT_PWM
-  fanSpeedSoftPwm = tail_fan_speed;
-  #else
- // analogWrite(FAN_PIN,tail_fan_speed);
-  #endif//!FAN_SOFT_PWM
+  p_fan.write(tail_fan_speed * POWER_OUT_MAX / 255);
 #endif//FAN_PIN > -1
 #ifdef AUTOTEMP
   getHighESpeed();
 #endif
 }
 
-float junction_deviation = 0.1;
+#if defined(NATIVE_ARCS) && defined(COREXY)
+#error "NATIVE_ARCS needs the X and Y motors to move along X and Y, it doesn't work with COREXY"
+#endif
+
+// A circular arc in the XY plane, for plan_buffer_move()
+typedef struct {
+  float center[2];      // mm
+  float angular_travel; // rad, positive counter clockwise
+} plan_arc_t;
+
+static void plan_buffer_move(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder, const plan_arc_t *arc);
+
 // Add a new linear movement to the buffer. steps_x, _y and _z is the absolute position in
 // mm. Microseconds specify how many microseconds the move should take to perform. To aid acceleration
 // calculation the caller must also provide the physical length of the line in millimeters.
 void plan_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder)
+{
+  plan_buffer_move(x, y, z, e, feed_rate, extruder, NULL);
+}
+
+#ifdef NATIVE_ARCS
+// Add an arc around the center in the XY plane to the buffer, as one block. Z and E move linearly
+// along it. The stepper follows the circle, and the look ahead sees the tangents at the ends.
+void plan_buffer_arc(const float &x, const float &y, const float &z, const float &e, float center_x, float center_y,
+  float angular_travel, float feed_rate, const uint8_t &extruder)
+{
+  plan_arc_t arc;
+  arc.center[X_AXIS] = center_x;
+  arc.center[Y_AXIS] = center_y;
+  arc.angular_travel = angular_travel;
+  plan_buffer_move(x, y, z, e, feed_rate, extruder, &arc);
+}
+#endif
+
+// A line if arc is NULL (always without NATIVE_ARCS)
+static void plan_buffer_move(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder, const plan_arc_t *arc)
 {
   // Calculate the buffer head after we push this byte
   int next_buffer_head = next_block_index(block_buffer_head);
@@ -569,6 +662,29 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
   block->steps_e = labs(target[E_AXIS]-position[E_AXIS]);
   block->steps_e *= extrudemultiply;
   block->steps_e /= 100;
+
+#ifdef NATIVE_ARCS
+  // The arc starts where the steppers are, and the stepper ends it exactly at the target. steps_x and
+  // steps_y are the lengths of the arc in steps of each axis, no axis makes more steps than that.
+  float arc_length = 0;
+  float arc_end_angle = 0;
+  block->arc = (arc != NULL);
+  if (arc) {
+    float start_x = position[X_AXIS]/axis_steps_per_unit[X_AXIS] - arc->center[X_AXIS];
+    float start_y = position[Y_AXIS]/axis_steps_per_unit[Y_AXIS] - arc->center[Y_AXIS];
+    float radius = sqrt(square(start_x) + square(start_y));
+    block->arc_radius[X_AXIS] = radius*axis_steps_per_unit[X_AXIS];
+    block->arc_radius[Y_AXIS] = radius*axis_steps_per_unit[Y_AXIS];
+    block->arc_start_angle = atan2(start_y, start_x);
+    block->arc_angle = arc->angular_travel;
+    block->arc_delta[X_AXIS] = target[X_AXIS]-position[X_AXIS];
+    block->arc_delta[Y_AXIS] = target[Y_AXIS]-position[Y_AXIS];
+    arc_length = fabs(arc->angular_travel)*radius;
+    arc_end_angle = block->arc_start_angle + arc->angular_travel;
+    block->steps_x = ceil(fabs(arc->angular_travel)*block->arc_radius[X_AXIS]);
+    block->steps_y = ceil(fabs(arc->angular_travel)*block->arc_radius[Y_AXIS]);
+  }
+#endif
   block->step_event_count = max(block->steps_x, max(block->steps_y, max(block->steps_z, block->steps_e)));
 
   // Bail if this is a zero-length block
@@ -638,6 +754,16 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
     delta_mm[Y_AXIS] = (target[Y_AXIS]-position[Y_AXIS])/axis_steps_per_unit[Y_AXIS];
   delta_mm[Z_AXIS] = (target[Z_AXIS]-position[Z_AXIS])/axis_steps_per_unit[Z_AXIS];
   delta_mm[E_AXIS] = ((target[E_AXIS]-position[E_AXIS])/axis_steps_per_unit[E_AXIS])*extrudemultiply/100.0;
+#ifdef NATIVE_ARCS
+  // For an arc, X and Y are its length along the tangent at the start. The speeds and the direction
+  // of the move are the ones the junction with the previous move sees.
+  float arc_direction = 0;
+  if (arc) {
+    arc_direction = arc->angular_travel > 0 ? 1 : -1;
+    delta_mm[X_AXIS] = -arc_direction*sin(block->arc_start_angle)*arc_length;
+    delta_mm[Y_AXIS] = arc_direction*cos(block->arc_start_angle)*arc_length;
+  }
+#endif
   if ( (unsigned long) block->steps_x <=dropsegments && (unsigned long) block->steps_y <=dropsegments && (unsigned long)block->steps_z <=dropsegments )
   {
     block->millimeters = fabs(delta_mm[E_AXIS]);
@@ -687,6 +813,20 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
     if(fabs(current_speed[i]) > max_feedrate[i])
       speed_factor = min(speed_factor, max_feedrate[i] / fabs(current_speed[i]));
   }
+#ifdef NATIVE_ARCS
+  if (arc) {
+    // Somewhere along the arc the whole speed in the plane can be on either axis, and going around the
+    // arc takes v^2/r of acceleration
+    float plane_speed = arc_length * inverse_second;
+    float radius = block->arc_radius[X_AXIS]/axis_steps_per_unit[X_AXIS];
+    if(plane_speed > max_feedrate[X_AXIS])
+      speed_factor = min(speed_factor, max_feedrate[X_AXIS] / plane_speed);
+    if(plane_speed > max_feedrate[Y_AXIS])
+      speed_factor = min(speed_factor, max_feedrate[Y_AXIS] / plane_speed);
+    if(plane_speed*plane_speed > acceleration*radius)
+      speed_factor = min(speed_factor, (float)sqrt(acceleration*radius) / plane_speed);
+  }
+#endif
 
   // Max segement time in us.
 #ifdef XY_FREQUENCY_LIMIT
@@ -754,48 +894,16 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
       block->acceleration_st = axis_steps_per_sqr_second[Z_AXIS];
   }
   block->acceleration = block->acceleration_st / steps_per_mm;
-  block->acceleration_rate = (long)((float)block->acceleration_st * (16777216.0 / (F_CPU / 8.0)));
-
-#if 0  // Use old jerk for now
-  // Compute path unit vector
-  double unit_vec[3];
-
-  unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
-  unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
-  unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;
-
-  // Compute maximum allowable entry speed at junction by centripetal acceleration approximation.
-  // Let a circle be tangent to both previous and current path line segments, where the junction
-  // deviation is defined as the distance from the junction to the closest edge of the circle,
-  // colinear with the circle center. The circular segment joining the two paths represents the
-  // path of centripetal acceleration. Solve for max velocity based on max acceleration about the
-  // radius of the circle, defined indirectly by junction deviation. This may be also viewed as
-  // path width or max_jerk in the previous grbl version. This approach does not actually deviate
-  // from path, but used as a robust way to compute cornering speeds, as it takes into account the
-  // nonlinearities of both the junction angle and junction velocity.
-  double vmax_junction = MINIMUM_PLANNER_SPEED; // Set default max junction speed
-
-  // Skip first block or when previous_nominal_speed is used as a flag for homing and offset cycles.
-  if ((block_buffer_head != block_buffer_tail) && (previous_nominal_speed > 0.0)) {
-    // Compute cosine of angle between previous and current path. (prev_unit_vec is negative)
-    // NOTE: Max junction velocity is computed without sin() or acos() by trig half angle identity.
-    double cos_theta = - previous_unit_vec[X_AXIS] * unit_vec[X_AXIS]
-      - previous_unit_vec[Y_AXIS] * unit_vec[Y_AXIS]
-      - previous_unit_vec[Z_AXIS] * unit_vec[Z_AXIS] ;
-
-    // Skip and use default max junction speed for 0 degree acute junction.
-    if (cos_theta < 0.95) {
-      vmax_junction = min(previous_nominal_speed,block->nominal_speed);
-      // Skip and avoid divide by zero for straight junctions at 180 degrees. Limit to min() of nominal speeds.
-      if (cos_theta > -0.95) {
-        // Compute maximum junction velocity based on maximum acceleration and junction deviation
-        double sin_theta_d2 = sqrt(0.5*(1.0-cos_theta)); // Trig half angle identity. Always positive.
-        vmax_junction = min(vmax_junction,
-        sqrt(block->acceleration * junction_deviation * sin_theta_d2/(1.0-sin_theta_d2)) );
-      }
-    }
+  block->acceleration_rate = (long)((float)block->acceleration_st * (16777216.0 / STEPPER_TIMER_RATE));
+
+  // Direction of the move in XYZ, left at 0 for a move of E alone
+  float unit_vec[3] = { 0, 0, 0 };
+  if (block->steps_x > dropsegments || block->steps_y > dropsegments || block->steps_z > dropsegments) {
+    unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
+    unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
+    unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;
   }
-#endif
+
   // Start with a safe speed
   float vmax_junction = max_xy_jerk/2;
   float vmax_junction_factor = 1.0;
@@ -806,7 +914,31 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
   vmax_junction = min(vmax_junction, block->nominal_speed);
   float safe_speed = vmax_junction;
 
-  if ((moves_queued > 1) && (previous_nominal_speed > 0.0001)) {
+  // Cosine of the angle between the previous and the current move, -1 going straight on, 0 if either
+  // moved E alone
+  float cos_theta = - previous_unit_vec[X_AXIS] * unit_vec[X_AXIS]
+    - previous_unit_vec[Y_AXIS] * unit_vec[Y_AXIS]
+    - previous_unit_vec[Z_AXIS] * unit_vec[Z_AXIS];
+  bool both_move_xyz = (previous_unit_vec[X_AXIS] != 0 || previous_unit_vec[Y_AXIS] != 0 || previous_unit_vec[Z_AXIS] != 0) &&
+    (unit_vec[X_AXIS] != 0 || unit_vec[Y_AXIS] != 0 || unit_vec[Z_AXIS] != 0);
+
+  if ((moves_queued > 1) && (previous_nominal_speed > 0.0001) && (junction_deviation > 0) && both_move_xyz) {
+    // Junction deviation: let a circle be tangent to both moves, with the junction deviation as the distance
+    // from the corner to the closest point of the circle. The junction speed is the one at which the
+    // acceleration takes the tool around that circle, v^2 = a * r. With the half angle identity the radius
+    // follows from cos_theta without any trig call.
+    vmax_junction = min(previous_nominal_speed, block->nominal_speed);
+    if (cos_theta > -0.999999) {
+      float sin_theta_d2 = sqrt(0.5*(1.0-cos_theta)); // sin(theta/2), always positive
+      float v_circle = MINIMUM_PLANNER_SPEED; // reversal
+      if (sin_theta_d2 < 0.999999)
+        v_circle = sqrt(block->acceleration * junction_deviation * sin_theta_d2/(1.0-sin_theta_d2));
+      if (v_circle < MINIMUM_PLANNER_SPEED)
+        v_circle = MINIMUM_PLANNER_SPEED;
+      vmax_junction = min(vmax_junction, v_circle);
+    }
+  }
+  else if ((moves_queued > 1) && (previous_nominal_speed > 0.0001)) {
     float jerk = sqrt(pow((current_speed[X_AXIS]-previous_speed[X_AXIS]), 2)+pow((current_speed[Y_AXIS]-previous_speed[Y_AXIS]), 2));
     //    if((fabs(previous_speed[X_AXIS]) > 0.0001) || (fabs(previous_speed[Y_AXIS]) > 0.0001)) {
     vmax_junction = block->nominal_speed;
@@ -846,40 +978,44 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
 
   // Update previous path unit_vector and nominal speed
   memcpy(previous_speed, current_speed, sizeof(previous_speed)); // previous_speed[] = current_speed[]
+  memcpy(previous_unit_vec, unit_vec, sizeof(previous_unit_vec)); // previous_unit_vec[] = unit_vec[]
+#ifdef NATIVE_ARCS
+  if (arc) {
+    // The next move joins the tangent at the end of the arc
+    float plane_speed = sqrt(square(current_speed[X_AXIS]) + square(current_speed[Y_AXIS]));
+    float plane_unit = sqrt(square(unit_vec[X_AXIS]) + square(unit_vec[Y_AXIS]));
+    previous_speed[X_AXIS] = -arc_direction*sin(arc_end_angle)*plane_speed;
+    previous_speed[Y_AXIS] = arc_direction*cos(arc_end_angle)*plane_speed;
+    previous_unit_vec[X_AXIS] = -arc_direction*sin(arc_end_angle)*plane_unit;
+    previous_unit_vec[Y_AXIS] = arc_direction*cos(arc_end_angle)*plane_unit;
+  }
+#endif
   previous_nominal_speed = block->nominal_speed;
 
 
 #ifdef ADVANCE
-  // Calculate advance rate
-  if((block->steps_e == 0) || (block->steps_x == 0 && block->steps_y == 0 && block->steps_z == 0)) {
-    block->advance_rate = 0;
+  // Calculate the advance at nominal speed. Travel and retract moves get none, the stepper lets the
+  // pressure of the previous block go on them.
+  if((block->steps_e == 0) || (block->steps_x == 0 && block->steps_y == 0 && block->steps_z == 0) ||
+     (block->direction_bits & (1<<E_AXIS))) {
     block->advance = 0;
   }
   else {
-    long acc_dist = estimate_acceleration_distance(0, block->nominal_rate, block->acceleration_st);
-    float advance = (STEPS_PER_CUBIC_MM_E * EXTRUDER_ADVANCE_K) *
-      (current_speed[E_AXIS] * current_speed[E_AXIS] * EXTRUTION_AREA * EXTRUTION_AREA)*256;
-    block->advance = advance;
-    if(acc_dist == 0) {
-      block->advance_rate = 0;
-    }
-    else {
-      block->advance_rate = advance / (float)acc_dist;
-    }
+    float e_rate = (float)block->nominal_rate * block->steps_e / block->step_event_count; // steps/s
+    block->advance = extruder_advance_k * e_rate * 256;
   }
   /*
     SERIAL_ECHO_START;
    SERIAL_ECHOPGM("advance :");
-   SERIAL_ECHO(block->advance/256.0);
-   SERIAL_ECHOPGM("advance rate :");
-   SERIAL_ECHOLN(block->advance_rate/256.0);
+   SERIAL_ECHOLN(block->advance/256.0);
    */
 #endif // ADVANCE
 
   calculate_trapezoid_for_block(block, block->entry_speed/block->nominal_speed,
   safe_speed/block->nominal_speed);
 
-  // Move buffer head
+  // Move buffer head, the block is complete before the stepper can see it
+  MEMORY_BARRIER();
   block_buffer_head = next_buffer_head;
 
   // Update position
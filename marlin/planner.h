@@ -38,10 +38,16 @@ typedef struct {
   unsigned char direction_bits;             // The direction bit set for this block (refers to *_DIRECTION_BIT in config.h)
   unsigned char active_extruder;            // Selects the active extruder
   #ifdef ADVANCE
-    long advance_rate;
-    volatile long initial_advance;
-    volatile long final_advance;
-    float advance;
+    long advance;                           // E steps ahead of the plan at nominal_rate, in 1/256 steps
+    volatile long initial_advance;          // The same at initial_rate
+    volatile long final_advance;            // The same at final_rate
+  #endif
+  #ifdef NATIVE_ARCS
+    unsigned char arc;                      // X and Y follow an arc, steps_x and steps_y are its length in steps
+    float arc_radius[2];                    // Radius of the arc in X and Y steps
+    float arc_start_angle;                  // Angle of the start point seen from the center (rad)
+    float arc_angle;                        // Angular travel, positive counter clockwise (rad)
+    long arc_delta[2];                      // X and Y steps from the start to the end point
   #endif
 
   // Fields used by the motion planner to manage acceleration
@@ -60,7 +66,8 @@ typedef struct {
   unsigned long final_rate;                          // The minimal rate at exit
   unsigned long acceleration_st;                     // acceleration steps/sec^2
   unsigned long fan_speed;
-  volatile char busy;
+  volatile char busy;                                // Set when st_prep_buffer() starts on the block, the trapezoid is frozen from then on
+  volatile unsigned char trapezoid_seq;              // Odd while the planner writes the trapezoid (see calculate_trapezoid_for_block())
 } block_t;
 
 // Initialize the motion plan subsystem
@@ -70,6 +77,13 @@ void plan_init();
 // millimaters. Feed rate specifies the speed of the motion.
 void plan_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder);
 
+#ifdef NATIVE_ARCS
+// Add an arc in the XY plane from the current position to x and y, around the center by angular_travel
+// (rad, positive counter clockwise), as a single block. Z and E move linearly along it.
+void plan_buffer_arc(const float &x, const float &y, const float &z, const float &e, float center_x, float center_y,
+  float angular_travel, float feed_rate, const uint8_t &extruder);
+#endif
+
 // Set position. Used for G92 instructions.
 void plan_set_position(const float &x, const float &y, const float &z, const float &e);
 void plan_set_e_position(const float &e);
@@ -89,8 +103,12 @@ extern float retract_acceleration; //  mm/s^2   filament pull-pack and push-forw
 extern float max_xy_jerk; //speed than can be stopped at once, if i understand correctly.
 extern float max_z_jerk;
 extern float max_e_jerk;
+extern float junction_deviation; // mm, cornering by junction deviation instead of the jerk limits if > 0
 extern float mintravelfeedrate;
 extern unsigned long axis_steps_per_sqr_second[NUM_AXIS];
+#ifdef ADVANCE
+extern float extruder_advance_k; // s, E steps of advance per E step/s
+#endif
 
 #ifdef AUTOTEMP
     extern bool autotemp_enabled;
@@ -105,11 +123,13 @@ extern unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 extern block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 extern volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 extern volatile unsigned char block_buffer_tail;
+extern unsigned char block_buffer_planned;                 // Index of the oldest block whose entry speed can still change
 // Called when the current block is no longer needed. Discards the block and makes the memory
 // availible for new blocks.
 FORCE_INLINE void plan_discard_current_block()
 {
   if (block_buffer_head != block_buffer_tail) {
+    MEMORY_BARRIER(); // Done with the block before the planner may reuse it
     block_buffer_tail = (block_buffer_tail + 1) & (BLOCK_BUFFER_SIZE - 1);
   }
 }
@@ -0,0 +1,100 @@
+/*
+  profile.cpp - execution time statistics of the interrupts and the main loop
+  Part of Marlin
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Marlin.h"
+#include "profile.h"
+
+#ifdef PROFILING
+
+typedef struct {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	unsigned long long sum;
+	uint32_t histogram[PROFILE_BUCKETS];
+} profile_stats_t;
+
+static profile_stats_t stats[PROFILE_REGIONS];
+
+static const char * const region_names[PROFILE_REGIONS] = {
+	"stepper", "segment prep", "temperature", "serial rx", "planner", "commands"
+};
+
+void profile_init()
+{
+	memset(stats, 0, sizeof(stats));
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+}
+
+void profile_record(profile_region_t region, uint32_t cycles)
+{
+	profile_stats_t *s = &stats[region];
+	// Index of the highest set bit, durations of 0 and 1 cycles go to bucket 0
+	int bucket = cycles ? 31 - __CLZ(cycles) : 0;
+	if(bucket >= PROFILE_BUCKETS) bucket = PROFILE_BUCKETS - 1;
+
+	if(s->count == 0 || cycles < s->min) s->min = cycles;
+	if(cycles > s->max) s->max = cycles;
+	s->sum += cycles;
+	s->count++;
+	s->histogram[bucket]++;
+}
+
+void profile_report()
+{
+	static profile_stats_t copy[PROFILE_REGIONS];
+
+	// Take the statistics and start over, interrupts would change them while they are printed
+	CRITICAL_SECTION_START;
+	memcpy(copy, stats, sizeof(copy));
+	memset(stats, 0, sizeof(stats));
+	CRITICAL_SECTION_END;
+
+	SERIAL_ECHO_START;
+	SERIAL_ECHOPAIR("Cycles at ", (unsigned long)(F_CPU / 1000000));
+	SERIAL_ECHOLNPGM(" MHz, histogram buckets are >= cycles:count");
+	for(int r = 0; r < PROFILE_REGIONS; r++)
+	{
+		const profile_stats_t *s = &copy[r];
+		SERIAL_ECHO_START;
+		SERIAL_ECHO(region_names[r]);
+		SERIAL_ECHOPAIR(" n:", (unsigned long)s->count);
+		if(s->count)
+		{
+			SERIAL_ECHOPAIR(" min:", (unsigned long)s->min);
+			SERIAL_ECHOPAIR(" max:", (unsigned long)s->max);
+			SERIAL_ECHOPAIR(" mean:", (unsigned long)(s->sum / s->count));
+		}
+		SERIAL_ECHOLN("");
+		if(s->count == 0)
+			continue;
+		SERIAL_ECHO_START;
+		for(int b = 0; b < PROFILE_BUCKETS; b++)
+		{
+			if(s->histogram[b] == 0)
+				continue;
+			SERIAL_ECHOPAIR(" ", (unsigned long)(b ? 1UL << b : 0));
+			SERIAL_ECHOPAIR(":", (unsigned long)s->histogram[b]);
+		}
+		SERIAL_ECHOLN("");
+	}
+}
+
+#endif
@@ -0,0 +1,77 @@
+/*
+  profile.h - execution time statistics of the interrupts and the main loop
+  Part of Marlin
+
+  The time spent in a region of code is measured with the cycle counter of the Cortex-M3 DWT unit.
+  Every region keeps the shortest, longest and mean duration and a histogram with one bucket per
+  power of two cycles. M850 prints and clears them.
+
+  A measured time includes any interrupt that preempted the region, so the main loop regions also
+  contain the stepper and temperature interrupts that ran meanwhile.
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef profile_h
+#define profile_h
+
+#include "mbed.h"
+#include "Configuration.h"
+
+enum profile_region_t {
+	PROFILE_STEPPER,       // stepper_int_handler()
+	PROFILE_SEGMENT_PREP,  // st_prep_buffer()
+	PROFILE_TEMPERATURE,   // temp_int()
+	PROFILE_SERIAL_RX,     // SerialBuffered::handleInterrupt()
+	PROFILE_PLANNER,       // planner_recalculate()
+	PROFILE_COMMANDS,      // process_commands()
+	PROFILE_REGIONS
+};
+
+// Bucket i of the histogram counts durations of 2^i up to 2^(i+1)-1 cycles, the last one
+// everything longer (2^23 cycles are 87 ms at 96 MHz)
+#define PROFILE_BUCKETS 24
+
+#ifdef PROFILING
+
+// DWT registers, not in the CMSIS headers of this mbed version. The simulator has its own.
+#ifndef DWT_CTRL
+#define DWT_CTRL (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+#endif
+#define DWT_CTRL_CYCCNTENA (1UL << 0)
+
+// Start the cycle counter
+void profile_init();
+
+// Add a duration to the statistics of a region. Each region must only be measured from one
+// interrupt priority, the statistics aren't protected against concurrent updates.
+void profile_record(profile_region_t region, uint32_t cycles);
+
+// Print the statistics of all regions and clear them (M850)
+void profile_report();
+
+// PROFILE_START() and PROFILE_END() enclose the measured code, within one block
+#define PROFILE_START() uint32_t profile_start_cycles = DWT_CYCCNT
+#define PROFILE_END(region) profile_record(region, DWT_CYCCNT - profile_start_cycles)
+
+#else
+
+#define profile_init()
+#define PROFILE_START()
+#define PROFILE_END(region)
+
+#endif
+
+#endif
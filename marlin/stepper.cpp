@@ -26,11 +26,28 @@
 #include "planner.h"
 #include "temperature.h"
 #include "language.h"
+#include "profile.h"
 #include "mbed.h"
-#include "speed_lookuptable.h"
 
-Ticker stepper_timer;
 void stepper_int_handler();
+
+// A piece of a block with a constant step rate, prepared by st_prep_buffer() for the interrupt
+typedef struct {
+	unsigned short n_events;        // The number of step events in this segment
+	unsigned short steps[NUM_AXIS]; // Step count along each axis within this segment
+	unsigned long interval;         // Timer ticks between two interrupts
+	unsigned char step_loops;       // Step events taken per interrupt
+	unsigned char direction_bits;   // The direction bit set for this segment (refers to *_DIRECTION_BIT in config.h)
+	unsigned char flags;
+#ifdef ADVANCE
+	long advance;                   // E steps of advance during this segment, in 1/256 steps
+#endif
+} segment_t;
+
+#define SEGMENT_END_OF_BLOCK 1 // The last segment of a block, discard the block after it
+
+// Segment duration in timer ticks
+#define STEP_SEGMENT_TICKS ((unsigned long)STEP_SEGMENT_TIME * (STEPPER_TIMER_RATE / 1000000))
 //===========================================================================
 //=============================public variables  ============================
 //===========================================================================
@@ -48,18 +65,35 @@ static long counter_x,       // Counter variables for the bresenham line tracer
 	    counter_y,
 	    counter_z,
 	    counter_e;
-volatile static unsigned long step_events_completed; // The number of step events executed in the current block
+static segment_t *current_segment;  // The segment currently being traced
+static unsigned short segment_events_completed; // The number of step events executed in the current segment
+static volatile bool endstop_abort = false; // Drop the remaining segments of the current block
 #ifdef ADVANCE
-static long advance_rate, advance, final_advance = 0;
-static long old_advance = 0;
-static long e_steps[3];
+static long old_advance;              // The advance of the current segment in whole steps
+static volatile long e_steps;         // E steps the advance interrupt still has to send, negative backwards
+static bool e_pulse;                  // The E step pin is active
+static bool e_backwards;              // Level of the E direction pin
 #endif
-static long acceleration_time, deceleration_time;
-//static unsigned long accelerate_until, decelerate_after, acceleration_rate, initial_rate, final_rate, nominal_rate;
-static unsigned short acc_step_rate; // needed for deccelaration start point
 static char step_loops;
-static unsigned short OCR1A_nominal;
-static unsigned short step_loops_nominal;
+static unsigned long dir_pins_high[16]; // Direction pins to drive high for each combination of direction_bits
+
+// Variables used by the segment preparation in st_prep_buffer()
+static segment_t segment_buffer[SEGMENT_BUFFER_SIZE]; // A ring buffer of segments for the interrupt
+static volatile unsigned char segment_buffer_head;    // Index of the next segment to be pushed
+static volatile unsigned char segment_buffer_tail;    // Index of the segment to trace now
+static block_t *prep_block;          // The block being cut into segments
+static unsigned char prep_block_index; // Index of the next block to cut into segments
+static unsigned long prep_events;    // The number of step events of prep_block already in segments
+static unsigned long prep_steps[NUM_AXIS]; // The number of steps per axis of prep_block already in segments
+#ifdef NATIVE_ARCS
+static long prep_arc_position[2];    // X and Y position on the arc of prep_block, in steps from its start
+#endif
+static unsigned long acceleration_time, deceleration_time;
+static unsigned long acc_step_rate; // needed for deccelaration start point
+#ifdef S_CURVE_ACCELERATION
+static unsigned long acc_peak_rate, dec_start_rate; // Step rates at the end of the acceleration and the start of the deceleration
+static unsigned long acc_ticks, dec_ticks;          // Durations of the acceleration and the deceleration
+#endif
 
 volatile long endstops_trigsteps[3]={0,0,0};
 volatile long endstops_stepsTotal,endstops_stepsDone;
@@ -83,20 +117,38 @@ static bool check_endstops = true;
 
 volatile long count_position[NUM_AXIS] = { 0, 0, 0, 0};
 volatile signed char count_direction[NUM_AXIS] = { 1, 1, 1, 1};
-volatile int do_int = 0;
 
 //===========================================================================
 //=============================functions         ============================
 //===========================================================================
-// intRes = intIn1 * intIn2 >> 16
-#define MultiU16X8toH16(intRes, charIn1, intIn2)  intRes = charIn1 * (intIn2 >> 16);
-
 // intRes = longIn1 * longIn2 >> 24
-#define MultiU24X24toH16(intRes, longIn1, longIn2) intRes = longIn1 * (longIn2 >> 24);
+#define MultiU24X24toH16(intRes, longIn1, longIn2) intRes = (unsigned long)(((unsigned long long)(longIn1) * (longIn2)) >> 24);
 
 // Some useful constants
-#define ENABLE_STEPPER_DRIVER_INTERRUPT() do_int = 1;
-#define DISABLE_STEPPER_DRIVER_INTERRUPT() do_int = 0;
+#define ENABLE_STEPPER_DRIVER_INTERRUPT() NVIC_EnableIRQ(TIMER0_IRQn);
+#define DISABLE_STEPPER_DRIVER_INTERRUPT() NVIC_DisableIRQ(TIMER0_IRQn);
+
+// st_prep_buffer() runs in PendSV, the interrupt with the lowest priority. The stepper interrupt requests
+// it whenever a segment is used up and the planner whenever a block is added, so the segment buffer is
+// refilled however long the main loop is busy, and the stepper interrupt can always preempt it.
+#define REQUEST_SEGMENT_PREP() SCB->ICSR = SCB_ICSR_PENDSVSET_Msk
+
+// Step pins with an active low pulse
+#define STEP_PINS_INVERTED ((INVERT_X_STEP_PIN ? PIN_MASK(X_STEP_PIN) : 0) | (INVERT_Y_STEP_PIN ? PIN_MASK(Y_STEP_PIN) : 0) | \
+                            (INVERT_Z_STEP_PIN ? PIN_MASK(Z_STEP_PIN) : 0) | (INVERT_E_STEP_PIN ? PIN_MASK(E_STEP_PIN) : 0))
+
+// Step pulse width and direction setup time in timer ticks, rounded up
+#define STEP_PULSE_TICKS (MINIMUM_STEPPER_PULSE * (STEPPER_TIMER_RATE / 1000000) + 1)
+
+// All step and direction pins must be on the port of X_STEP_PIN (see STEPPER_GPIO)
+typedef char stepper_pins_on_one_port[(PIN_PORT(Y_STEP_PIN) == PIN_PORT(X_STEP_PIN) && PIN_PORT(Z_STEP_PIN) == PIN_PORT(X_STEP_PIN) &&
+                                       PIN_PORT(E_STEP_PIN) == PIN_PORT(X_STEP_PIN) && PIN_PORT(X_DIR_PIN) == PIN_PORT(X_STEP_PIN) &&
+                                       PIN_PORT(Y_DIR_PIN) == PIN_PORT(X_STEP_PIN) && PIN_PORT(Z_DIR_PIN) == PIN_PORT(X_STEP_PIN) &&
+                                       PIN_PORT(E_DIR_PIN) == PIN_PORT(X_STEP_PIN)) ? 1 : -1];
+
+// Minimum distance in timer ticks (1us) between the counter and a newly programmed match,
+// so a deadline that is already due still fires instead of waiting for a counter wrap
+#define STEPPER_TIMER_MIN_TICKS (STEPPER_TIMER_RATE / 1000000)
 
 
 void checkHitEndstops()
@@ -162,435 +214,504 @@ void enable_endstops(bool check)
 
 void st_wake_up() {
 	//  TCNT1 = 0;
+	REQUEST_SEGMENT_PREP();
 	ENABLE_STEPPER_DRIVER_INTERRUPT();
 }
 
-volatile unsigned int stepper_count = 100;
+// TIMER0 match 0 interrupt. The counter resets to 0 on the match (like CTC mode of the
+// AVR timer1), so every interval written by set_int() is measured from the last step event.
+static void stepper_timer_isr() {
+	LPC_TIM0->IR = 1; // clear the MR0 interrupt flag
+	PROFILE_START();
+	stepper_int_handler();
+	PROFILE_END(PROFILE_STEPPER);
+}
 
-void the_int(){
-	static unsigned int counter = 0;
-//	stepper_timer.detach();
-//	stepper_timer.attach_us(the_int, 10); 
-	counter ++;
-	if(counter >= stepper_count) {
-		counter = 0;
-		stepper_int_handler();
-	}
+// Busy wait until ticks of the step timer have passed since start
+FORCE_INLINE void step_timer_wait(unsigned long start, unsigned long ticks) {
+	while(LPC_TIM0->TC - start < ticks);
 }
 
+// Program the interval (in STEPPER_TIMER_RATE ticks) to the next stepper interrupt
 void set_int(unsigned int time) {
-	stepper_count = time;
+	// The handler itself may have taken longer than the new interval
+	unsigned int now = LPC_TIM0->TC + STEPPER_TIMER_MIN_TICKS;
+	if(time < now) time = now;
+	LPC_TIM0->MR0 = time;
 }
 
-unsigned int calc_timer(unsigned int step_rate) {
-	unsigned short timer;
-	if(step_rate > MAX_STEP_FREQUENCY) {step_rate = MAX_STEP_FREQUENCY;  /*MYSERIAL.print("Max STepRate triggered\n"); MYSERIAL.println(step_rate); */}
+// Converts a step rate (steps/s) into the interval between two stepper interrupts in timer ticks.
+// The Cortex-M3 divides in hardware, so the interval is exact over the whole range instead of
+// interpolated from lookup tables like on the AVR.
+unsigned long calc_timer(unsigned long step_rate) {
+	unsigned long timer;
+	if(step_rate > MAX_STEP_FREQUENCY) step_rate = MAX_STEP_FREQUENCY;
 
 	if(step_rate > 20000) { // If steprate > 20kHz >> step 4 times
-		step_rate = (step_rate >> 2)&0x3fff;
+		step_rate = step_rate >> 2;
 		step_loops = 4;
 	}
 	else if(step_rate > 10000) { // If steprate > 10kHz >> step 2 times
-		step_rate = (step_rate >> 1)&0x7fff;
+		step_rate = step_rate >> 1;
 		step_loops = 2;
 	}
 	else {
 		step_loops = 1;
 	}
 
-	if(step_rate < (16000000/500000)) step_rate = (16000000/500000);
-	step_rate -= (16000000/500000); // Correct for minimal speed
-	if(step_rate >= (8*256)){ // higher step rate
-		//unsigned short table_address = (unsigned short)&speed_lookuptable_fast[(unsigned char)(step_rate>>8)][0];
-		unsigned short * table_address = (unsigned short *) &speed_lookuptable_fast[(unsigned char)(step_rate>>8)][0];
-		unsigned char tmp_step_rate = (step_rate & 0x00ff);
-		//    unsigned short gain = (unsigned short)pgm_read_word_near(table_address+2);
-		unsigned short gain = (unsigned short)(table_address[2]);
-		MultiU16X8toH16(timer, tmp_step_rate, gain);
-		//timer = (unsigned short)pgm_read_word_near(table_address) - timer;
-		timer = (unsigned short)(table_address[0]) - timer;
-	}
-	else { // lower step rates
-		//unsigned short table_address = (unsigned short)&speed_lookuptable_slow[0][0];
-		unsigned short *table_address = (unsigned short*)&speed_lookuptable_slow[0][0];
-		table_address += ((step_rate)>>1) & 0xfffc;
-		//timer = (unsigned short)pgm_read_word_near(table_address);
-		//timer -= (((unsigned short)pgm_read_word_near(table_address+2) * (unsigned char)(step_rate & 0x0007))>>3);
-		timer = (unsigned short)(table_address[0]);
-		timer -= (((unsigned short)(table_address[2]) * (unsigned char)(step_rate & 0x0007))>>3);
-	}
-	/*
-	   unsigned int timer;
-	   if(step_rate > MAX_STEP_FREQUENCY) step_rate = MAX_STEP_FREQUENCY;
-	   if(step_rate > 20000) { // If steprate > 20kHz >> step 4 times
-	   step_rate = (step_rate >> 2)&0x3fff;
-	   step_loops = 4;
-	   }
-	   else if(step_rate > 10000) { // If steprate > 10kHz >> step 2 times
-	   step_rate = (step_rate >> 1)&0x7fff;
-	   step_loops = 2;
-	   }
-	   else {
-	   step_loops = 1;
-	   }
-	   if(step_rate < (16000000/500000)) step_rate = (16000000/500000);
-	   step_rate -= (16000000/500000); // Correct for minimal speed
-	   if(step_rate >= (8*256)){ // higher step rate
-	   unsigned short * table_address = (unsigned short *) &speed_lookuptable_fast[(unsigned char)(step_rate>>8)][0];
-	   unsigned char tmp_step_rate = (step_rate & 0x00ff);
-	   unsigned short gain = (unsigned short)(table_address[2]);
-	   MultiU16X8toH16(timer, tmp_step_rate, gain);
-	   timer = (unsigned short)(table_address[0]) - timer;
-	   }
-	   else { // lower step rates
-	   unsigned short *table_address = (unsigned short*)&speed_lookuptable_slow[0][0];
-	   table_address += ((step_rate)>>1) & 0xfffc;
-	   timer = (unsigned short)(table_address[0]);
-	   timer -= (((unsigned short)(table_address[2]) * (unsigned char)(step_rate & 0x0007))>>3);
-	   }*/
-	if(timer < 100) { timer = 100;/* MYSERIAL.print(MSG_STEPPER_TOO_HIGH); MYSERIAL.println(step_rate); */}//(20kHz this should never happen)
-	timer = timer/2;
-//	timer = timer/5; //since my timer runs at 1mhz and not 2mhz
+	if(step_rate == 0) step_rate = 1;
+	timer = (STEPPER_TIMER_RATE + (step_rate >> 1)) / step_rate;
+	if(timer < STEPPER_TIMER_RATE / 20000) { timer = STEPPER_TIMER_RATE / 20000; }//(20kHz this should never happen)
 	return timer;
 }
 
-// Initializes the trapezoid generator from the current block. Called whenever a new
-// block begins.
-void trapezoid_generator_reset() {
+// Cuts the planned blocks into segments of about STEP_SEGMENT_TIME until the segment buffer is full.
+// The trapezoid of the block is evaluated once per segment here, so the stepper interrupt only has
+// to trace the bresenham line of each segment at a constant step rate.
+// PendSV interrupt
+static void segment_prep_isr()
+{
+	PROFILE_START();
+	st_prep_buffer();
+	PROFILE_END(PROFILE_SEGMENT_PREP);
+}
+
+#ifdef S_CURVE_ACCELERATION
+// The ramps of a block with constant acceleration, which the S-curves replace
+static void s_curve_init(const block_t *block)
+{
+	// The rate that constant acceleration reaches at accelerate_until: v^2 = v0^2 + 2*a*s
+	float peak = sqrt((float)block->initial_rate * block->initial_rate + 2.0f * block->acceleration_st * block->accelerate_until);
+	acc_peak_rate = peak < block->nominal_rate ? (unsigned long)peak : block->nominal_rate;
+	if(acc_peak_rate < block->initial_rate)
+		acc_peak_rate = block->initial_rate;
+	dec_start_rate = block->decelerate_after > block->accelerate_until ? block->nominal_rate : acc_peak_rate;
+	acc_ticks = 0;
+	dec_ticks = 0;
+	if(block->acceleration_st > 0) {
+		acc_ticks = (unsigned long long)(acc_peak_rate - block->initial_rate) * STEPPER_TIMER_RATE / block->acceleration_st;
+		if(dec_start_rate > block->final_rate)
+			dec_ticks = (unsigned long long)(dec_start_rate - block->final_rate) * STEPPER_TIMER_RATE / block->acceleration_st;
+	}
+}
+
+// Step rate at time t of a ramp from rate0 to rate1 that takes ticks: rate0 + (rate1 - rate0) * (10s^3 - 15s^4 + 6s^5)
+// with s = t / ticks. The acceleration of this quintic is 0 at both ends, and its mean is (rate0 + rate1) / 2 like
+// that of the straight ramp, so both cover the same number of steps. Fixed point with s in 16 bits.
+static unsigned long s_curve_rate(unsigned long rate0, unsigned long rate1, unsigned long t, unsigned long ticks)
+{
+	if(t >= ticks)
+		return rate1;
+	unsigned long s = ((unsigned long long)t << 16) / ticks;
+	unsigned long s2 = (s * s) >> 16;
+	unsigned long s3 = (s2 * s) >> 16;
+	unsigned long poly = 6 * s2 - 15 * s + (10UL << 16); // 6s^2 - 15s + 10, at least 1 for s in [0, 1]
+	unsigned long f = ((unsigned long long)s3 * poly) >> 16;
+	if(rate1 >= rate0)
+		return rate0 + (((unsigned long long)(rate1 - rate0) * f) >> 16);
+	return rate0 - (((unsigned long long)(rate0 - rate1) * f) >> 16);
+}
+#endif
+
 #ifdef ADVANCE
-	advance = current_block->initial_advance;
-	final_advance = current_block->final_advance;
-	// Do E steps + advance steps
-	e_steps[current_block->active_extruder] += ((advance >>8) - old_advance);
-	old_advance = advance >>8;
-#endif
-	deceleration_time = 0;
-	// step_rate to timer interval
-	OCR1A_nominal = calc_timer(current_block->nominal_rate);
-	// make a note of the number of step loops required at nominal speed
-	step_loops_nominal = step_loops;
-	acc_step_rate = current_block->initial_rate;
-	acceleration_time = calc_timer(acc_step_rate);
-	set_int(acceleration_time);
-
-	//    SERIAL_ECHO_START;
-	//    SERIAL_ECHOPGM("advance :");
-	//    SERIAL_ECHO(current_block->advance/256.0);
-	//    SERIAL_ECHOPGM("advance rate :");
-	//    SERIAL_ECHO(current_block->advance_rate/256.0);
-	//    SERIAL_ECHOPGM("initial advance :");
-	//    SERIAL_ECHO(current_block->initial_advance/256.0);
-	//    SERIAL_ECHOPGM("final advance :");
-	//    SERIAL_ECHOLN(current_block->final_advance/256.0);
+// The advance at a step rate of the block. It is linear in the step rate, between the advance of the
+// trapezoid ends and that of nominal_rate.
+static long segment_advance(const block_t *block, unsigned long step_rate, unsigned long end_rate, long end_advance)
+{
+	if(step_rate >= block->nominal_rate || block->nominal_rate <= end_rate)
+		return block->advance;
+	if(step_rate <= end_rate)
+		return end_advance;
+	return end_advance + (long)(((long long)(block->advance - end_advance) * (step_rate - end_rate)) / (block->nominal_rate - end_rate));
 }
+#endif
 
-void stepper_int_handler()
+void st_prep_buffer()
 {
-	if(!do_int)
-		return;
+	unsigned char next_segment_head = (segment_buffer_head + 1) & (SEGMENT_BUFFER_SIZE - 1);
+	while(next_segment_head != segment_buffer_tail) {
+		// If there is no block being prepared, attempt to pop one from the planner
+		if(prep_block == NULL) {
+			if(prep_block_index == block_buffer_head)
+				return;
+			MEMORY_BARRIER(); // The block is complete once it is behind block_buffer_head
+			block_t *block = &block_buffer[prep_block_index];
+			// The planner is in the middle of updating the trapezoid. The main loop can't continue before
+			// this interrupt returns, so try again on the next request.
+			if(block->trapezoid_seq & 1)
+				return;
+			prep_block = block;
+			prep_block->busy = true; // The planner must not change it from now on
+			prep_events = 0;
+			prep_steps[X_AXIS] = 0;
+			prep_steps[Y_AXIS] = 0;
+			prep_steps[Z_AXIS] = 0;
+			prep_steps[E_AXIS] = 0;
+#ifdef NATIVE_ARCS
+			prep_arc_position[X_AXIS] = 0;
+			prep_arc_position[Y_AXIS] = 0;
+#endif
+			acceleration_time = 0;
+			deceleration_time = 0;
+			acc_step_rate = prep_block->initial_rate;
+#ifdef S_CURVE_ACCELERATION
+			s_curve_init(prep_block);
+#endif
+		}
+		block_t *block = prep_block;
+
+		// The step rate of the segment is taken from the trapezoid halfway through the segment
+		unsigned long end_event;
+		unsigned long step_rate;
+		if(prep_events < (unsigned long)block->accelerate_until) {
+#ifdef S_CURVE_ACCELERATION
+			acc_step_rate = s_curve_rate(block->initial_rate, acc_peak_rate, acceleration_time + STEP_SEGMENT_TICKS / 2, acc_ticks);
+#else
+			MultiU24X24toH16(acc_step_rate, acceleration_time + STEP_SEGMENT_TICKS / 2, block->acceleration_rate);
+			acc_step_rate += block->initial_rate;
+#endif
+
+			// upper limit
+			if(acc_step_rate > block->nominal_rate)
+				acc_step_rate = block->nominal_rate;
+			step_rate = acc_step_rate;
+			end_event = block->accelerate_until;
+		}
+		else if(prep_events >= (unsigned long)block->decelerate_after) {
+#ifdef S_CURVE_ACCELERATION
+			step_rate = s_curve_rate(dec_start_rate, block->final_rate, deceleration_time + STEP_SEGMENT_TICKS / 2, dec_ticks);
+#else
+			MultiU24X24toH16(step_rate, deceleration_time + STEP_SEGMENT_TICKS / 2, block->acceleration_rate);
+
+			if(step_rate > acc_step_rate) { // Check step_rate stays positive
+				step_rate = block->final_rate;
+			}
+			else {
+				step_rate = acc_step_rate - step_rate; // Decelerate from aceleration end point.
+			}
+#endif
 
-	// If there is no current block, attempt to pop one from the buffer
-	if (current_block == NULL) {
-		// Anything in the buffer?
-		current_block = plan_get_current_block();
-		if (current_block != NULL) {
-			current_block->busy = true;
-			trapezoid_generator_reset();
-			counter_x = -(current_block->step_event_count >> 1);
-			counter_y = counter_x;
-			counter_z = counter_x;
-			counter_e = counter_x;
-			step_events_completed = 0;
+			// lower limit
+			if(step_rate < block->final_rate)
+				step_rate = block->final_rate;
+			end_event = block->step_event_count;
 		}
 		else {
-			set_int(1000);
-			//stepper_timer.attach_us(stepper_int_handler, 1000); //LPC_TIM1->MR0 = 2000; //1ms wait
+			step_rate = block->nominal_rate;
+			end_event = block->decelerate_after;
+			acc_step_rate = step_rate; // the deceleration starts from the cruise rate
 		}
-	}
 
-	if (current_block != NULL) {
-		// Set directions TO DO This should be done once during init of trapezoid. Endstops -> interrupt
-		out_bits = current_block->direction_bits;
-
-		// Set the direction bits (X_AXIS=A_AXIS and Y_AXIS=B_AXIS for COREXY)
-		if((out_bits & (1<<X_AXIS))!=0){
-			p_x_dir = INVERT_X_DIR; //WRITE(X_DIR_PIN, INVERT_X_DIR);
-			count_direction[X_AXIS]=-1;
+		// step_rate to timer interval, fill the segment with whole interrupts
+		segment_t *segment = &segment_buffer[segment_buffer_head];
+		unsigned long timer = calc_timer(step_rate);
+		unsigned long ints = STEP_SEGMENT_TICKS / timer;
+		if(ints == 0)
+			ints = 1;
+		unsigned long n_events = ints * step_loops;
+		if(n_events > end_event - prep_events) {
+			n_events = end_event - prep_events;
+			ints = (n_events + step_loops - 1) / step_loops;
 		}
-		else{
-			p_x_dir = !INVERT_X_DIR; //WRITE(X_DIR_PIN, !INVERT_X_DIR);
-			count_direction[X_AXIS]=1;
+		if(prep_events < (unsigned long)block->accelerate_until) {
+			acceleration_time += ints * timer;
+#ifndef S_CURVE_ACCELERATION
+			// The deceleration starts from the rate at the end of the acceleration, not from the rate of
+			// the middle of its last segment
+			if(prep_events + n_events >= (unsigned long)block->accelerate_until) {
+				MultiU24X24toH16(acc_step_rate, acceleration_time, block->acceleration_rate);
+				acc_step_rate += block->initial_rate;
+				if(acc_step_rate > block->nominal_rate)
+					acc_step_rate = block->nominal_rate;
+			}
+#endif
+		}
+		else if(prep_events >= (unsigned long)block->decelerate_after)
+			deceleration_time += ints * timer;
+
+		// Steps per axis are taken from the whole block, so rounding never accumulates over segments
+		prep_events += n_events;
+		unsigned long half_count = block->step_event_count >> 1;
+		unsigned long steps;
+		steps = ((unsigned long long)prep_events * block->steps_x + half_count) / block->step_event_count;
+		segment->steps[X_AXIS] = steps - prep_steps[X_AXIS];
+		prep_steps[X_AXIS] = steps;
+		steps = ((unsigned long long)prep_events * block->steps_y + half_count) / block->step_event_count;
+		segment->steps[Y_AXIS] = steps - prep_steps[Y_AXIS];
+		prep_steps[Y_AXIS] = steps;
+		steps = ((unsigned long long)prep_events * block->steps_z + half_count) / block->step_event_count;
+		segment->steps[Z_AXIS] = steps - prep_steps[Z_AXIS];
+		prep_steps[Z_AXIS] = steps;
+		steps = ((unsigned long long)prep_events * block->steps_e + half_count) / block->step_event_count;
+		segment->steps[E_AXIS] = steps - prep_steps[E_AXIS];
+		prep_steps[E_AXIS] = steps;
+
+		segment->n_events = n_events;
+		segment->interval = timer;
+		segment->step_loops = step_loops;
+		segment->direction_bits = block->direction_bits;
+#ifdef NATIVE_ARCS
+		if(block->arc) {
+			// X and Y go straight to the point of the arc the segment ends on, the chord of a segment is
+			// within length^2/(8*radius) of the arc. The last segment ends exactly on the target.
+			long arc_position[2];
+			if(prep_events >= block->step_event_count) {
+				arc_position[X_AXIS] = block->arc_delta[X_AXIS];
+				arc_position[Y_AXIS] = block->arc_delta[Y_AXIS];
+			}
+			else {
+				float angle = block->arc_start_angle + block->arc_angle * prep_events / block->step_event_count;
+				arc_position[X_AXIS] = lround(block->arc_radius[X_AXIS] * (cosf(angle) - cosf(block->arc_start_angle)));
+				arc_position[Y_AXIS] = lround(block->arc_radius[Y_AXIS] * (sinf(angle) - sinf(block->arc_start_angle)));
+			}
+			segment->direction_bits &= ~((1<<X_AXIS) | (1<<Y_AXIS));
+			for(unsigned char axis = X_AXIS; axis <= Y_AXIS; axis++) {
+				long delta = arc_position[axis] - prep_arc_position[axis];
+				prep_arc_position[axis] = arc_position[axis];
+				if(delta < 0) {
+					segment->direction_bits |= (1<<axis);
+					delta = -delta;
+				}
+				segment->steps[axis] = delta;
+				// Rounding can leave a step more than the segment has events
+				if((unsigned long)delta > segment->n_events)
+					segment->n_events = delta;
+			}
+		}
+#endif
+		segment->flags = 0;
+#ifdef ADVANCE
+		if(end_event == (unsigned long)block->accelerate_until) // accelerating
+			segment->advance = segment_advance(block, step_rate, block->initial_rate, block->initial_advance);
+		else
+			segment->advance = segment_advance(block, step_rate, block->final_rate, block->final_advance);
+#endif
+		if(prep_events >= block->step_event_count) {
+			segment->flags |= SEGMENT_END_OF_BLOCK;
+			prep_block = NULL;
+			prep_block_index = (prep_block_index + 1) & (BLOCK_BUFFER_SIZE - 1);
 		}
-		if((out_bits & (1<<Y_AXIS))!=0){
-			p_y_dir = INVERT_Y_DIR;//WRITE(Y_DIR_PIN, INVERT_Y_DIR);
-			count_direction[Y_AXIS]=-1;
+
+		// Hand the segment to the interrupt
+		MEMORY_BARRIER();
+		segment_buffer_head = next_segment_head;
+		next_segment_head = (segment_buffer_head + 1) & (SEGMENT_BUFFER_SIZE - 1);
+	}
+}
+
+// "The Stepper Driver Interrupt" - This timer interrupt is the workhorse.
+// It pops the segments from the segment buffer and executes them by pulsing the stepper pins appropriately.
+void stepper_int_handler()
+{
+	// If there is no current segment, attempt to pop one from the buffer
+	if (current_segment == NULL) {
+		// Anything in the buffer?
+		if (segment_buffer_head == segment_buffer_tail) {
+			REQUEST_SEGMENT_PREP();
+			set_int(STEPPER_TIMER_RATE / 1000); //1ms wait
+			return;
 		}
-		else{
-			p_y_dir = !INVERT_Y_DIR;//WRITE(Y_DIR_PIN, INVERT_Y_DIR);
-			count_direction[Y_AXIS]=1;
+		MEMORY_BARRIER(); // The segment is complete once it is behind segment_buffer_head
+		current_segment = &segment_buffer[segment_buffer_tail];
+		if (current_block == NULL)
+			current_block = plan_get_current_block();
+		counter_x = -(current_segment->n_events >> 1);
+		counter_y = counter_x;
+		counter_z = counter_x;
+		counter_e = counter_x;
+		segment_events_completed = 0;
+
+		// Set the direction bits (X_AXIS=A_AXIS and Y_AXIS=B_AXIS for COREXY)
+		out_bits = current_segment->direction_bits;
+		unsigned long dir_high = dir_pins_high[out_bits & 0x0f];
+		if(dir_high != (STEPPER_GPIO->FIOPIN & DIR_PINS_MASK)) {
+			STEPPER_GPIO->FIOSET = dir_high;
+			STEPPER_GPIO->FIOCLR = DIR_PINS_MASK & ~dir_high;
+			step_timer_wait(LPC_TIM0->TC, STEP_PULSE_TICKS); // direction setup time of the drivers
 		}
+		count_direction[X_AXIS] = (out_bits & (1<<X_AXIS)) ? -1 : 1;
+		count_direction[Y_AXIS] = (out_bits & (1<<Y_AXIS)) ? -1 : 1;
+		count_direction[Z_AXIS] = (out_bits & (1<<Z_AXIS)) ? -1 : 1;
+		count_direction[E_AXIS] = (out_bits & (1<<E_AXIS)) ? -1 : 1;
+#ifdef ADVANCE
+		// The advance interrupt has the same priority, it can't run in between
+		long new_advance = current_segment->advance >> 8;
+		e_steps += new_advance - old_advance;
+		old_advance = new_advance;
+#endif
+	}
 
-		// Set direction en check limit switches
+	// Check limit switches
+	if(check_endstops) {
 		if ((out_bits & (1<<X_AXIS)) != 0) {   // stepping along -X axis
-				if(check_endstops)
-				{
-					{
 #if defined(X_MIN_PIN) && X_MIN_PIN > -1
-						bool x_min_endstop=(READ(X_MIN_PIN) != X_MIN_ENDSTOP_INVERTING);
-						if(x_min_endstop && old_x_min_endstop && (current_block->steps_x > 0)) {
-							endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
-							endstop_x_hit=true;
-							step_events_completed = current_block->step_event_count;
-						}
-						old_x_min_endstop = x_min_endstop;
-#endif
-					}
-				}
+			bool x_min_endstop=(READ(X_MIN_PIN) != X_MIN_ENDSTOP_INVERTING);
+			if(x_min_endstop && old_x_min_endstop && (current_block->steps_x > 0)) {
+				endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
+				endstop_x_hit=true;
+				endstop_abort=true;
 			}
-			else { // +direction
-				if(check_endstops)
-				{
+			old_x_min_endstop = x_min_endstop;
+#endif
+		}
+		else { // +direction
 #ifdef DUAL_X_CARRIAGE
-					// with 2 x-carriages, endstops are only checked in the homing direction for the active extruder
-					if ((current_block->active_extruder == 0 && X_HOME_DIR == 1)
-							|| (current_block->active_extruder != 0 && X2_HOME_DIR == 1))
+			// with 2 x-carriages, endstops are only checked in the homing direction for the active extruder
+			if ((current_block->active_extruder == 0 && X_HOME_DIR == 1)
+					|| (current_block->active_extruder != 0 && X2_HOME_DIR == 1))
 #endif
-					{
+			{
 #if defined(X_MAX_PIN) && X_MAX_PIN > -1
-						bool x_max_endstop=(READ(X_MAX_PIN) != X_MAX_ENDSTOP_INVERTING);
-						if(x_max_endstop && old_x_max_endstop && (current_block->steps_x > 0)){
-							endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
-							endstop_x_hit=true;
-							step_events_completed = current_block->step_event_count;
-						}
-						old_x_max_endstop = x_max_endstop;
-#endif
-					}
+				bool x_max_endstop=(READ(X_MAX_PIN) != X_MAX_ENDSTOP_INVERTING);
+				if(x_max_endstop && old_x_max_endstop && (current_block->steps_x > 0)){
+					endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
+					endstop_x_hit=true;
+					endstop_abort=true;
 				}
+				old_x_max_endstop = x_max_endstop;
+#endif
 			}
+		}
 
-			if ((out_bits & (1<<Y_AXIS)) != 0) {   // -direction
-					if(check_endstops)
-					{
+		if ((out_bits & (1<<Y_AXIS)) != 0) {   // -direction
 #if defined(Y_MIN_PIN) && Y_MIN_PIN > -1
-						bool y_min_endstop=(READ(Y_MIN_PIN) != Y_MIN_ENDSTOP_INVERTING);
-						if(y_min_endstop && old_y_min_endstop && (current_block->steps_y > 0)) {
-							endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
-							endstop_y_hit=true;
-							step_events_completed = current_block->step_event_count;
-						}
-						old_y_min_endstop = y_min_endstop;
-#endif
-					}
-				}
-				else { // +direction
-					if(check_endstops)
-					{
+			bool y_min_endstop=(READ(Y_MIN_PIN) != Y_MIN_ENDSTOP_INVERTING);
+			if(y_min_endstop && old_y_min_endstop && (current_block->steps_y > 0)) {
+				endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
+				endstop_y_hit=true;
+				endstop_abort=true;
+			}
+			old_y_min_endstop = y_min_endstop;
+#endif
+		}
+		else { // +direction
 #if defined(Y_MAX_PIN) && Y_MAX_PIN > -1
-						bool y_max_endstop=(READ(Y_MAX_PIN) != Y_MAX_ENDSTOP_INVERTING);
-						if(y_max_endstop && old_y_max_endstop && (current_block->steps_y > 0)){
-							endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
-							endstop_y_hit=true;
-							step_events_completed = current_block->step_event_count;
-						}
-						old_y_max_endstop = y_max_endstop;
-#endif
-					}
-				}
-
-				if ((out_bits & (1<<Z_AXIS)) != 0) {   // -direction
-					p_z_dir = INVERT_Z_DIR; //WRITE(Z_DIR_PIN,INVERT_Z_DIR);
+			bool y_max_endstop=(READ(Y_MAX_PIN) != Y_MAX_ENDSTOP_INVERTING);
+			if(y_max_endstop && old_y_max_endstop && (current_block->steps_y > 0)){
+				endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
+				endstop_y_hit=true;
+				endstop_abort=true;
+			}
+			old_y_max_endstop = y_max_endstop;
+#endif
+		}
 
-					count_direction[Z_AXIS]=-1;
-					if(check_endstops)
-					{
+		if ((out_bits & (1<<Z_AXIS)) != 0) {   // -direction
 #if defined(Z_MIN_PIN) && Z_MIN_PIN > -1
-						bool z_min_endstop=(READ(Z_MIN_PIN) != Z_MIN_ENDSTOP_INVERTING);
-						if(z_min_endstop && old_z_min_endstop && (current_block->steps_z > 0)) {
-							endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
-							endstop_z_hit=true;
-							step_events_completed = current_block->step_event_count;
-						}
-						old_z_min_endstop = z_min_endstop;
-#endif
-					}
-				}
-				else { // +direction
-					p_z_dir = !INVERT_Z_DIR; //WRITE(Z_DIR_PIN,!INVERT_Z_DIR);
-
-					count_direction[Z_AXIS]=1;
-					if(check_endstops)
-					{
+			bool z_min_endstop=(READ(Z_MIN_PIN) != Z_MIN_ENDSTOP_INVERTING);
+			if(z_min_endstop && old_z_min_endstop && (current_block->steps_z > 0)) {
+				endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
+				endstop_z_hit=true;
+				endstop_abort=true;
+			}
+			old_z_min_endstop = z_min_endstop;
+#endif
+		}
+		else { // +direction
 #if defined(Z_MAX_PIN) && Z_MAX_PIN > -1
-						bool z_max_endstop=(READ(Z_MAX_PIN) != Z_MAX_ENDSTOP_INVERTING);
-						if(z_max_endstop && old_z_max_endstop && (current_block->steps_z > 0)) {
-							endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
-							endstop_z_hit=true;
-							step_events_completed = current_block->step_event_count;
-						}
-						old_z_max_endstop = z_max_endstop;
-#endif
-					}
-				}
+			bool z_max_endstop=(READ(Z_MAX_PIN) != Z_MAX_ENDSTOP_INVERTING);
+			if(z_max_endstop && old_z_max_endstop && (current_block->steps_z > 0)) {
+				endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
+				endstop_z_hit=true;
+				endstop_abort=true;
+			}
+			old_z_max_endstop = z_max_endstop;
+#endif
+		}
+	}
 
-#ifndef ADVANCE
-				if ((out_bits & (1<<E_AXIS)) != 0) {  // -direction
-					REV_E_DIR();
-					count_direction[E_AXIS]=-1;
-				}
-				else { // +direction
-					NORM_E_DIR();
-					count_direction[E_AXIS]=1;
-				}
-#endif //!ADVANCE
+	if(endstop_abort) {
+		// The remaining segments of the block are dropped without stepping
+		segment_events_completed = current_segment->n_events;
+	}
 
-				for(int8_t i=0; i < step_loops; i++) { // Take multiple steps per interrupt (For high speed moves)
-#ifdef ADVANCE
-					counter_e += current_block->steps_e;
-					if (counter_e > 0) {
-						counter_e -= current_block->step_event_count;
-						if ((out_bits & (1<<E_AXIS)) != 0) { // - direction
-							e_steps[current_block->active_extruder]--;
-						}
-						else {
-							e_steps[current_block->active_extruder]++;
-						}
-					}
-#endif //ADVANCE
+	for(int8_t i=0; i < current_segment->step_loops; i++) { // Take multiple steps per interrupt (For high speed moves)
+		if(segment_events_completed >= current_segment->n_events) break;
 
-					counter_x += current_block->steps_x;
-					if (counter_x > 0) {
-						p_x_step = !INVERT_X_STEP_PIN; //WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);
-						counter_x -= current_block->step_event_count;
-						count_position[X_AXIS]+=count_direction[X_AXIS];
-						p_x_step = INVERT_X_STEP_PIN; //WRITE(X_STEP_PIN, INVERT_X_STEP_PIN);
-					}
-
-					counter_y += current_block->steps_y;
-					if (counter_y > 0) {
-						p_y_step = !INVERT_Y_STEP_PIN; //WRITE(Y_STEP_PIN, !INVERT_Y_STEP_PIN);
-						counter_y -= current_block->step_event_count;
-						count_position[Y_AXIS]+=count_direction[Y_AXIS];
-						p_y_step = INVERT_Y_STEP_PIN; //WRITE(Y_STEP_PIN, INVERT_Y_STEP_PIN);
-					}
-
-					counter_z += current_block->steps_z;
-					if (counter_z > 0) {
-						p_z_step = !INVERT_Z_STEP_PIN; //WRITE(Z_STEP_PIN, !INVERT_Z_STEP_PIN);
-
-						counter_z -= current_block->step_event_count;
-						count_position[Z_AXIS]+=count_direction[Z_AXIS];
-						p_z_step = INVERT_Z_STEP_PIN; //WRITE(Z_STEP_PIN, INVERT_Z_STEP_PIN);
-					}
+		unsigned long step_pins = 0;
+		counter_x += current_segment->steps[X_AXIS];
+		if (counter_x > 0) {
+			step_pins |= PIN_MASK(X_STEP_PIN);
+			counter_x -= current_segment->n_events;
+			count_position[X_AXIS]+=count_direction[X_AXIS];
+		}
 
-#ifndef ADVANCE
-					counter_e += current_block->steps_e;
-					if (counter_e > 0) {
-						p_e_step = !INVERT_E_STEP_PIN; //WRITE_E_STEP(!INVERT_E_STEP_PIN);
-						counter_e -= current_block->step_event_count;
-						count_position[E_AXIS]+=count_direction[E_AXIS];
-						p_e_step = INVERT_E_STEP_PIN; //WRITE_E_STEP(INVERT_E_STEP_PIN);
-					}
-#endif //!ADVANCE
-					step_events_completed += 1;
-					if(step_events_completed >= current_block->step_event_count) break;
-				}
-				// Calculare new timer value
-				unsigned short timer;
-				unsigned short step_rate;
-				if (step_events_completed <= (unsigned long int)current_block->accelerate_until) {
-
-					MultiU24X24toH16(acc_step_rate, acceleration_time, current_block->acceleration_rate);
-					acc_step_rate += current_block->initial_rate;
-
-					// upper limit
-					if(acc_step_rate > current_block->nominal_rate)
-						acc_step_rate = current_block->nominal_rate;
-
-					// step_rate to timer interval
-					timer = calc_timer(acc_step_rate);
-					//stepper_timer.attach_us(stepper_int_handler, timer);
-					set_int(timer);
-					acceleration_time += timer;
-#ifdef ADVANCE
-					for(int8_t i=0; i < step_loops; i++) {
-						advance += advance_rate;
-					}
-					//if(advance > current_block->advance) advance = current_block->advance;
-					// Do E steps + advance steps
-					e_steps[current_block->active_extruder] += ((advance >>8) - old_advance);
-					old_advance = advance >>8;
+		counter_y += current_segment->steps[Y_AXIS];
+		if (counter_y > 0) {
+			step_pins |= PIN_MASK(Y_STEP_PIN);
+			counter_y -= current_segment->n_events;
+			count_position[Y_AXIS]+=count_direction[Y_AXIS];
+		}
 
-#endif
-				}
-				else if (step_events_completed > (unsigned long int)current_block->decelerate_after) {
-					MultiU24X24toH16(step_rate, deceleration_time, current_block->acceleration_rate);
-
-					if(step_rate > acc_step_rate) { // Check step_rate stays positive
-						step_rate = current_block->final_rate;
-					}
-					else {
-						step_rate = acc_step_rate - step_rate; // Decelerate from aceleration end point.
-					}
-
-					// lower limit
-					if(step_rate < current_block->final_rate)
-						step_rate = current_block->final_rate;
-
-					// step_rate to timer interval
-					timer = calc_timer(step_rate);
-					set_int(timer);
-					deceleration_time += timer;
-#ifdef ADVANCE
-					for(int8_t i=0; i < step_loops; i++) {
-						advance -= advance_rate;
-					}
-					if(advance < final_advance) advance = final_advance;
-					// Do E steps + advance steps
-					e_steps[current_block->active_extruder] += ((advance >>8) - old_advance);
-					old_advance = advance >>8;
-#endif //ADVANCE
-				}
-				else {
+		counter_z += current_segment->steps[Z_AXIS];
+		if (counter_z > 0) {
+			step_pins |= PIN_MASK(Z_STEP_PIN);
+			counter_z -= current_segment->n_events;
+			count_position[Z_AXIS]+=count_direction[Z_AXIS];
+		}
 
-					set_int(OCR1A_nominal);
-					// ensure we're running at the correct step rate, even if we just came off an acceleration
-					step_loops = step_loops_nominal;
-				}
+		counter_e += current_segment->steps[E_AXIS];
+		if (counter_e > 0) {
+#ifdef ADVANCE
+			e_steps += count_direction[E_AXIS]; // stepped by the advance interrupt
+#else
+			step_pins |= PIN_MASK(E_STEP_PIN);
+#endif
+			counter_e -= current_segment->n_events;
+			count_position[E_AXIS]+=count_direction[E_AXIS];
+		}
 
-				// If current block is finished, reset pointer
-				if (step_events_completed >= current_block->step_event_count) {
-					current_block = NULL;
-					plan_discard_current_block();
-				}
-			}
+		// Pulse the step pins of all axes at the same time
+		if (step_pins) {
+			STEPPER_GPIO->FIOSET = step_pins & ~STEP_PINS_INVERTED;
+			STEPPER_GPIO->FIOCLR = step_pins & STEP_PINS_INVERTED;
+			step_timer_wait(LPC_TIM0->TC, STEP_PULSE_TICKS);
+			STEPPER_GPIO->FIOCLR = step_pins & ~STEP_PINS_INVERTED;
+			STEPPER_GPIO->FIOSET = step_pins & STEP_PINS_INVERTED;
 		}
+		segment_events_completed += 1;
+	}
+	set_int(endstop_abort ? 0 : current_segment->interval);
+
+	// If current segment is finished, reset pointer
+	if (segment_events_completed >= current_segment->n_events) {
+		if (current_segment->flags & SEGMENT_END_OF_BLOCK) {
+			current_block = NULL;
+			plan_discard_current_block();
+			endstop_abort = false;
+		}
+		current_segment = NULL;
+		MEMORY_BARRIER();
+		segment_buffer_tail = (segment_buffer_tail + 1) & (SEGMENT_BUFFER_SIZE - 1);
+		REQUEST_SEGMENT_PREP();
+	}
+}
 
 #ifdef ADVANCE
-		unsigned char old_OCR0A;
-		// Timer interrupt for E. e_steps is set in the main routine;
-		// Timer 0 is shared with millies
-		ISR(TIMER0_COMPA_vect)
-		{
-			old_OCR0A += 52; // ~10kHz interrupt (250000 / 26 = 9615kHz)
-			OCR0A = old_OCR0A;
-			// Set E direction (Depends on E direction + advance)
-			for(unsigned char i=0; i<4;i++) {
-				if (e_steps[0] != 0) {
-					p_e0_step = INVERT_E_STEP_PIN; //WRITE(E0_STEP_PIN, INVERT_E_STEP_PIN);
-					if (e_steps[0] < 0) {
-						p_e0_dir = INVERT_E0_DIR; //WRITE(E0_DIR_PIN, INVERT_E0_DIR);
-						e_steps[0]++;
-						p_e0_step = !INVERT_E_STEP_PIN; //WRITE(E0_STEP_PIN, !INVERT_E_STEP_PIN);
-					}
-					else if (e_steps[0] > 0) {
-						p_e0_dir = !INVERT_E0_DIR; //WRITE(E0_DIR_PIN, !INVERT_E0_DIR);
-						e_steps[0]--;
-						p_e0_step = !INVERT_E_STEP_PIN; //WRITE(E0_STEP_PIN, !INVERT_E_STEP_PIN);
-					}
-				}
-			}
-		}
+// TIMER2 match 0 interrupt at twice ADVANCE_STEP_FREQUENCY. The E steps of the segments and the
+// changes of the advance are added up in e_steps, and this sends them with one interrupt for the
+// pulse and one for the pause. A change of direction takes one interrupt of its own, that is the
+// direction setup time of the driver.
+static void advance_timer_isr()
+{
+	LPC_TIM2->IR = 1; // clear the MR0 interrupt flag
+	if(e_pulse) {
+		WRITE(E_STEP_PIN, INVERT_E_STEP_PIN);
+		e_pulse = false;
+		return;
+	}
+	if(e_steps == 0)
+		return;
+	bool backwards = e_steps < 0;
+	if(backwards != e_backwards) {
+		WRITE(E_DIR_PIN, backwards ? INVERT_E0_DIR : !INVERT_E0_DIR);
+		e_backwards = backwards;
+		return;
+	}
+	WRITE(E_STEP_PIN, !INVERT_E_STEP_PIN);
+	e_pulse = true;
+	e_steps += backwards ? 1 : -1;
+}
 #endif // ADVANCE
 
 void st_init()
@@ -661,7 +782,7 @@ void st_init()
 
 	//Initialize Step Pins
 #if defined(X_STEP_PIN) && (X_STEP_PIN > -1)
-	p_x_step = INVERT_X_STEP_PIN; //WRITE(X_STEP_PIN,INVERT_X_STEP_PIN);
+	WRITE(X_STEP_PIN,INVERT_X_STEP_PIN);
 	disable_x();
 #endif
 #if defined(X2_STEP_PIN) && (X2_STEP_PIN > -1)
@@ -669,18 +790,18 @@ void st_init()
 	disable_x();
 #endif
 #if defined(Y_STEP_PIN) && (Y_STEP_PIN > -1)
-	p_y_step = INVERT_Y_STEP_PIN; //WRITE(Y_STEP_PIN,INVERT_Y_STEP_PIN);
+	WRITE(Y_STEP_PIN,INVERT_Y_STEP_PIN);
 	disable_y();
 #endif
 #if defined(Z_STEP_PIN) && (Z_STEP_PIN > -1)
-	p_z_step = INVERT_Z_STEP_PIN;//WRITE(Z_STEP_PIN,INVERT_Z_STEP_PIN);
+	WRITE(Z_STEP_PIN,INVERT_Z_STEP_PIN);
 #if defined(Z_DUAL_STEPPER_DRIVERS) && defined(Z2_STEP_PIN) && (Z2_STEP_PIN > -1)
 	p_z2_step = INVERT_Z_STEP; //WRITE(Z2_STEP_PIN,INVERT_Z_STEP_PIN);
 #endif
 	disable_z();
 #endif
 #if defined(E0_STEP_PIN) && (E0_STEP_PIN > -1)
-	p_e0_step = INVERT_E_STEP_PIN; //WRITE(E0_STEP_PIN,INVERT_E_STEP_PIN);
+	WRITE(E0_STEP_PIN,INVERT_E_STEP_PIN);
 	disable_e0();
 #endif
 #if defined(E1_STEP_PIN) && (E1_STEP_PIN > -1)
@@ -692,15 +813,57 @@ void st_init()
 	disable_e2();
 #endif
 
-	stepper_timer.attach_us(the_int, 9);
+	// Direction pin levels for every combination of direction_bits
+	for(unsigned char bits = 0; bits < 16; bits++) {
+		unsigned long high = 0;
+		if(((bits & (1<<X_AXIS)) != 0) == INVERT_X_DIR) high |= PIN_MASK(X_DIR_PIN);
+		if(((bits & (1<<Y_AXIS)) != 0) == INVERT_Y_DIR) high |= PIN_MASK(Y_DIR_PIN);
+		if(((bits & (1<<Z_AXIS)) != 0) == INVERT_Z_DIR) high |= PIN_MASK(Z_DIR_PIN);
+#ifndef ADVANCE
+		if(((bits & (1<<E_AXIS)) != 0) == INVERT_E0_DIR) high |= PIN_MASK(E_DIR_PIN);
+#endif
+		dir_pins_high[bits] = high;
+	}
+
+	// TIMER0 runs from CCLK and is prescaled down to STEPPER_TIMER_RATE.
+	// MR0 holds the interval to the next step event and resets the counter on match.
+	LPC_SC->PCONP |= (1 << 1); // PCTIM0
+	LPC_SC->PCLKSEL0 = (LPC_SC->PCLKSEL0 & ~(3 << 2)) | (1 << 2); // PCLK_TIMER0 = CCLK
+	LPC_TIM0->TCR = 2; // hold the counter in reset
+	LPC_TIM0->CTCR = 0; // timer mode
+	LPC_TIM0->PR = (F_CPU / STEPPER_TIMER_RATE) - 1;
+	LPC_TIM0->MR0 = STEPPER_TIMER_RATE / 1000;
+	LPC_TIM0->MCR = 3; // interrupt and reset on MR0
+	LPC_TIM0->IR = 0x3f;
+	NVIC_SetVector(TIMER0_IRQn, (uintptr_t)&stepper_timer_isr);
+	NVIC_SetPriority(TIMER0_IRQn, 0); // highest, step timing comes first, everything else runs at 1 or lower
+
+	NVIC_SetVector(PendSV_IRQn, (uintptr_t)&segment_prep_isr);
+	NVIC_SetPriority(PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1); // lowest
+	LPC_TIM0->TCR = 1; // start counting
 
 	ENABLE_STEPPER_DRIVER_INTERRUPT();
 
 #ifdef ADVANCE
-	e_steps[0] = 0;
-	e_steps[1] = 0;
-	e_steps[2] = 0;
-	TIMSK0 |= (1<<OCIE0A);
+	// TIMER2 runs from CCLK and interrupts at twice the E step frequency. It has the priority of the
+	// stepper interrupt, so they never preempt each other while they change e_steps.
+	e_steps = 0;
+	old_advance = 0;
+	e_pulse = false;
+	e_backwards = false;
+	WRITE(E_DIR_PIN, !INVERT_E0_DIR);
+	LPC_SC->PCONP |= (1 << 22); // PCTIM2
+	LPC_SC->PCLKSEL1 = (LPC_SC->PCLKSEL1 & ~(3 << 12)) | (1 << 12); // PCLK_TIMER2 = CCLK
+	LPC_TIM2->TCR = 2; // hold the counter in reset
+	LPC_TIM2->CTCR = 0; // timer mode
+	LPC_TIM2->PR = 0;
+	LPC_TIM2->MR0 = F_CPU / (2 * ADVANCE_STEP_FREQUENCY) - 1;
+	LPC_TIM2->MCR = 3; // interrupt and reset on MR0
+	LPC_TIM2->IR = 0x3f;
+	NVIC_SetVector(TIMER2_IRQn, (uintptr_t)&advance_timer_isr);
+	NVIC_SetPriority(TIMER2_IRQn, 0);
+	LPC_TIM2->TCR = 1; // start counting
+	NVIC_EnableIRQ(TIMER2_IRQn);
 #endif //ADVANCE
 
 	enable_endstops(true); // Start with endstops active. After homing they can be disabled
@@ -755,9 +918,18 @@ void finishAndDisableSteppers()
 
 void quickStop()
 {
-	DISABLE_STEPPER_DRIVER_INTERRUPT();
+	CRITICAL_SECTION_START; // Neither the stepper interrupt nor the segment preparation may run in between
 	while(blocks_queued())
 		plan_discard_current_block();
 	current_block = NULL;
-	ENABLE_STEPPER_DRIVER_INTERRUPT();
-	}
+	current_segment = NULL;
+	segment_buffer_tail = segment_buffer_head;
+	prep_block = NULL;
+	prep_block_index = block_buffer_tail;
+	endstop_abort = false;
+#ifdef ADVANCE
+	e_steps = 0;
+	old_advance = 0;
+#endif
+	CRITICAL_SECTION_END;
+}
@@ -23,13 +23,28 @@
 
 #include "planner.h"
 
-#define WRITE_E_STEP(v) p_e0_step = v; /*WRITE(E0_STEP_PIN, v)*/
-#define NORM_E_DIR() p_e0_dir = !INVERT_E0_DIR; /*WRITE(E0_DIR_PIN, !INVERT_E0_DIR)*/
-#define REV_E_DIR() p_e0_dir = INVERT_E0_DIR; /*WRITE(E0_DIR_PIN, INVERT_E0_DIR)*/
+// Count rate of the step timer (TIMER0), a divider of F_CPU. calc_timer() intervals and the planner's
+// acceleration_rate are expressed in ticks of this clock.
+#define STEPPER_TIMER_RATE (F_CPU / 4)
+
+#define WRITE_E_STEP(v) WRITE(E_STEP_PIN, v)
+#define NORM_E_DIR() WRITE(E0_DIR_PIN, !INVERT_E0_DIR)
+#define REV_E_DIR() WRITE(E0_DIR_PIN, INVERT_E0_DIR)
+
+// Step and direction pins of all axes. They have to be on one GPIO port, so the stepper
+// interrupt changes the pins of every axis with a single FIOSET/FIOCLR write.
+#define STEPPER_GPIO PIN_GPIO(X_STEP_PIN)
+#define STEP_PINS_MASK (PIN_MASK(X_STEP_PIN) | PIN_MASK(Y_STEP_PIN) | PIN_MASK(Z_STEP_PIN) | PIN_MASK(E_STEP_PIN))
+#ifdef ADVANCE
+// The E direction pin belongs to the advance interrupt
+#define DIR_PINS_MASK (PIN_MASK(X_DIR_PIN) | PIN_MASK(Y_DIR_PIN) | PIN_MASK(Z_DIR_PIN))
+#else
+#define DIR_PINS_MASK (PIN_MASK(X_DIR_PIN) | PIN_MASK(Y_DIR_PIN) | PIN_MASK(Z_DIR_PIN) | PIN_MASK(E_DIR_PIN))
+#endif
 
-#ifdef ABORT_ON_ENDSTOP_HIT_FEATURE_ENABLED
-extern bool abort_on_endstop_hit;
-#endif
+#ifdef ABORT_ON_ENDSTOP_HIT_FEATURE_ENABLED
+extern bool abort_on_endstop_hit;
+#endif
 
 // Initialize and start the stepper motor subsystem
 void st_init();
@@ -48,6 +63,9 @@ long st_get_position(uint8_t axis);
 // to notify the subsystem that it is time to go to work.
 void st_wake_up();
 
+// Cut the planned blocks into step segments for the stepper interrupt. Runs in the PendSV interrupt,
+// requested through st_wake_up() and by the stepper interrupt.
+void st_prep_buffer();
 
 void checkHitEndstops(); //call from somwhere to create an serial error message with the locations the endstops where hit, in case they were triggered
 void endstops_hit_on_purpose(); //avoid creation of the message, i.e. after homeing and before a routine call of checkHitEndstops();
@@ -32,9 +32,32 @@ http://reprap.org/pipermail/reprap-dev/2011-May/003323.html
 #include "Marlin.h"
 #include "temperature.h"
 #include "mbed.h"
+#include "profile.h"
 
 Ticker temp_timer;
 void temp_int();
+
+// The thermistor inputs are sampled by the ADC in burst mode: temp_int() starts a burst, the ADC converts
+// all selected channels in turn, and adc_isr() sums OVERSAMPLENR rounds before it stops the burst again.
+#define ADC_CHANNEL(pin) ((pin) == p15 ? 0 : (pin) == p16 ? 1 : (pin) == p17 ? 2 : (pin) == p18 ? 3 : \
+		(pin) == p19 ? 4 : (pin) == p20 ? 5 : -1)
+#define ADC_MAX_CLOCK 12000000 // the ADC clock may not exceed 13 MHz
+#define ADCR_BURST (1UL << 16)
+#define ADCR_PDN (1UL << 21)
+#define ADC_RESULT(ch) (((&LPC_ADC->ADDR0)[ch] >> 4) & 0xfff)
+
+#if defined(TEMP_0_PIN) && (TEMP_0_PIN > -1)
+static const int adc_channel_0 = ADC_CHANNEL(TEMP_0_PIN);
+#endif
+#if defined(TEMP_BED_PIN) && (TEMP_BED_PIN > -1)
+static const int adc_channel_bed = ADC_CHANNEL(TEMP_BED_PIN);
+#endif
+static uint32_t adc_channels; // ADCR channel select bits
+static volatile unsigned long adc_sum_0, adc_sum_bed;
+static volatile unsigned char adc_rounds;
+// Temperature updates every TEMP_UPDATE_TICKS temp_int() ticks of 10 ms
+#define TEMP_UPDATE_TICKS 48
+static void adc_init();
 int constrain(int val, int min, int max)
 {
 	if(val > max) return max;
@@ -66,10 +89,6 @@ float bedKi=(DEFAULT_bedKi*PID_dT);
 float bedKd=(DEFAULT_bedKd/PID_dT);
 #endif //PIDTEMPBED
 
-#ifdef FAN_SOFT_PWM
-unsigned char fanSpeedSoftPwm;
-#endif
-
 //===========================================================================
 //=============================private variables============================
 //===========================================================================
@@ -104,11 +123,11 @@ static float temp_iState_max_bed;
 #else //PIDTEMPBED
 static unsigned long  previous_millis_bed_heater;
 #endif //PIDTEMPBED
-static unsigned char soft_pwm[EXTRUDERS];
-static unsigned char soft_pwm_bed;
-#ifdef FAN_SOFT_PWM
-static unsigned char soft_pwm_fan;
-#endif
+// Heater power 0..POWER_OUT_MAX, applied to the outputs by temp_int()
+static int soft_pwm[EXTRUDERS];
+static int soft_pwm_bed;
+// Heater power from the 0..255 scale of PID_MAX and MAX_BED_POWER
+#define POWER_FROM_255(x) ((x) * POWER_OUT_MAX / 255)
 #if (defined(EXTRUDER_0_AUTO_FAN_PIN) && EXTRUDER_0_AUTO_FAN_PIN > -1) || \
 	(defined(EXTRUDER_1_AUTO_FAN_PIN) && EXTRUDER_1_AUTO_FAN_PIN > -1) || \
 (defined(EXTRUDER_2_AUTO_FAN_PIN) && EXTRUDER_2_AUTO_FAN_PIN > -1)
@@ -169,13 +188,13 @@ void PID_autotune(float temp, int extruder, int ncycles)
 
 	if (extruder<0)
 	{
-		soft_pwm_bed = (MAX_BED_POWER)/2;
 		bias = d = (MAX_BED_POWER)/2;
+		soft_pwm_bed = POWER_FROM_255(bias + d);
 	}
 	else
 	{
-		soft_pwm[extruder] = (PID_MAX)/2;
 		bias = d = (PID_MAX)/2;
+		soft_pwm[extruder] = POWER_FROM_255(bias + d);
 	}
 
 	for(;;) {
@@ -190,9 +209,9 @@ void PID_autotune(float temp, int extruder, int ncycles)
 				if(millis() - t2 > 5000) {
 					heating=false;
 					if (extruder<0)
-						soft_pwm_bed = (bias - d) >> 1;
+						soft_pwm_bed = POWER_FROM_255(bias - d);
 					else
-						soft_pwm[extruder] = (bias - d) >> 1;
+						soft_pwm[extruder] = POWER_FROM_255(bias - d);
 					t1=millis();
 					t_high=t1 - t2;
 					max=temp;
@@ -244,9 +263,9 @@ void PID_autotune(float temp, int extruder, int ncycles)
 						}
 					}
 					if (extruder<0)
-						soft_pwm_bed = (bias + d) >> 1;
+						soft_pwm_bed = POWER_FROM_255(bias + d);
 					else
-						soft_pwm[extruder] = (bias + d) >> 1;
+						soft_pwm[extruder] = POWER_FROM_255(bias + d);
 					cycles++;
 					min=temp;
 				}
@@ -259,10 +278,10 @@ void PID_autotune(float temp, int extruder, int ncycles)
 		if(millis() - temp_millis > 2000) {
 			int p;
 			if (extruder<0){
-				p=soft_pwm_bed;
+				p=getHeaterPower(-1);
 				SERIAL_PROTOCOLPGM("ok B:");
 			}else{
-				p=soft_pwm[extruder];
+				p=getHeaterPower(extruder);
 				SERIAL_PROTOCOLPGM("ok T:");
 			}
 
@@ -295,10 +314,11 @@ void updatePID()
 #endif
 }
 
+// Heater power in the 0..127 scale that M105 has always reported
 int getHeaterPower(int heater) {
 	if (heater<0)
-		return soft_pwm_bed;
-	return soft_pwm[heater];
+		return soft_pwm_bed >> 3;
+	return soft_pwm[heater] >> 3;
 }
 
 #if (defined(EXTRUDER_0_AUTO_FAN_PIN) && EXTRUDER_0_AUTO_FAN_PIN > -1) || \
@@ -448,7 +468,7 @@ void manage_heater()
 		// Check if temperature is within the correct range
 		if((current_temperature[e] > minttemp[e]) && (current_temperature[e] < maxttemp[e]))
 		{
-			soft_pwm[e] = (int)pid_output >> 1;
+			soft_pwm[e] = (int)(pid_output * (POWER_OUT_MAX / 255.0f));
 		}
 		else {
 			soft_pwm[e] = 0;
@@ -498,7 +518,7 @@ void manage_heater()
 
 	if((current_temperature_bed > BED_MINTEMP) && (current_temperature_bed < BED_MAXTEMP))
 	{
-		soft_pwm_bed = (int)pid_output >> 1;
+		soft_pwm_bed = (int)(pid_output * (POWER_OUT_MAX / 255.0f));
 	}
 	else {
 		soft_pwm_bed = 0;
@@ -514,13 +534,13 @@ void manage_heater()
 		}
 		else
 		{
-			soft_pwm_bed = MAX_BED_POWER>>1;
+			soft_pwm_bed = POWER_FROM_255(MAX_BED_POWER);
 		}
 	}
 	else
 	{
 		soft_pwm_bed = 0;
-		p_heater_bed = 0; //WRITE(HEATER_BED_PIN,LOW);
+		p_heater_bed.write(0); //WRITE(HEATER_BED_PIN,LOW);
 		p_heat_bed_led = 0;
 	}
 #else //#ifdef BED_LIMIT_SWITCHING
@@ -533,13 +553,13 @@ void manage_heater()
 		}
 		else if(current_temperature_bed <= target_temperature_bed - BED_HYSTERESIS)
 		{
-			soft_pwm_bed = MAX_BED_POWER>>1;
+			soft_pwm_bed = POWER_FROM_255(MAX_BED_POWER);
 		}
 	}
 	else
 	{
 		soft_pwm_bed = 0;
-		p_heater_bed = 0; //WRITE(HEATER_BED_PIN,LOW);
+		p_heater_bed.write(0); //WRITE(HEATER_BED_PIN,LOW);
 		p_heat_bed_led = 0;
 	}
 #endif
@@ -551,23 +571,29 @@ void manage_heater()
 #define analog2temp( c,x ) analog2temp_thermistor(c,temptable,NUMTEMPS)
 #define analog2tempBed( c ) analog2temp_thermistor((c),bedtemptable,BNUMTEMPS)
 
+// Temperature of a raw value in 1/16 degC. The table is sorted by ADC value, so the segment around
+// the raw value is found by binary search, and interpolated in integer math.
 int analog2temp_thermistor(int raw,const short table[][2], int numtemps) {
-    int celsius = 0;
-    int i;
+    int lo = 1, hi = numtemps;
 
-    raw = 1023 - raw;
+    raw = TEMP_RAW_MAX - raw;
 
-    for (i=1; i<numtemps; i++) {
-        if (table[i][0] > raw) {
-            celsius  = table[i-1][1] + (raw - table[i-1][0]) * (table[i][1] - table[i-1][1]) / (table[i][0] - table[i-1][0]);
-            break;
-        }
+    // First entry above raw, numtemps if there is none
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (table[mid][0] * TEMP_TABLE_SCALE > raw)
+            hi = mid;
+        else
+            lo = mid + 1;
     }
 
     // Overflow: Set to last value in the table
-    if (i == numtemps) celsius = table[i-1][1];
+    if (lo == numtemps)
+        return table[numtemps-1][1] * 16;
 
-    return celsius;
+    int x0 = table[lo-1][0] * TEMP_TABLE_SCALE;
+    int t0 = table[lo-1][1];
+    return t0 * 16 + (raw - x0) * (table[lo][1] - t0) * 16 / ((table[lo][0] - table[lo-1][0]) * TEMP_TABLE_SCALE);
 }
 
 /* Called to get the raw values into the the actual temperatures. The raw values are created in interrupt context,
@@ -575,9 +601,9 @@ int analog2temp_thermistor(int raw,const short table[][2], int numtemps) {
 static void updateTemperaturesFromRawValues()
 {
 	for(uint8_t e=0; e<EXTRUDERS; e++) {
-		current_temperature[e] = analog2temp(current_temperature_raw[e], e);
+		current_temperature[e] = analog2temp(current_temperature_raw[e], e) * (1.0f / 16);
 	}
-	current_temperature_bed = analog2tempBed(current_temperature_bed_raw);
+	current_temperature_bed = analog2tempBed(current_temperature_bed_raw) * (1.0f / 16);
 
 	CRITICAL_SECTION_START;
 	temp_meas_ready = false;
@@ -604,22 +630,23 @@ void tp_init()
 #ifdef FAST_PWM_FAN
 	setPwmFrequency(FAN_PIN, 1); // No prescaling. Pwm frequency = F_CPU/256/8
 #endif
-#ifdef FAN_SOFT_PWM
-	soft_pwm_fan = fanSpeedSoftPwm / 2;
-#endif
 #endif
 
 
+	adc_init();
+
 	// Use timer0 for temperature measurement
 	// Interleave temperature interrupt with millies interrupt
 	temp_timer.attach_us(&temp_int, 10000); //every 10 ms
+	// The Ticker runs on the us_ticker (TIMER3), which starts at priority 0 and would delay the step interrupt
+	NVIC_SetPriority(TIMER3_IRQn, 1);
 
 	// Wait for temperature measurement to settle
 	delay_ms(250);
 
 #ifdef HEATER_0_MINTEMP
 	minttemp[0] = HEATER_0_MINTEMP;
-	while(analog2temp(minttemp_raw[0], 0) < HEATER_0_MINTEMP) {
+	while(analog2temp(minttemp_raw[0], 0) < HEATER_0_MINTEMP * 16) {
 #if HEATER_0_RAW_LO_TEMP < HEATER_0_RAW_HI_TEMP
 		minttemp_raw[0] += OVERSAMPLENR;
 #else
@@ -629,7 +656,7 @@ void tp_init()
 #endif //MINTEMP
 #ifdef HEATER_0_MAXTEMP
 	maxttemp[0] = HEATER_0_MAXTEMP;
-	while(analog2temp(maxttemp_raw[0], 0) > HEATER_0_MAXTEMP) {
+	while(analog2temp(maxttemp_raw[0], 0) > HEATER_0_MAXTEMP * 16) {
 #if HEATER_0_RAW_LO_TEMP < HEATER_0_RAW_HI_TEMP
 		maxttemp_raw[0] -= OVERSAMPLENR;
 #else
@@ -640,7 +667,7 @@ void tp_init()
 
 
 #ifdef BED_MAXTEMP
-	while(analog2tempBed(bed_maxttemp_raw) > BED_MAXTEMP) {
+	while(analog2tempBed(bed_maxttemp_raw) > BED_MAXTEMP * 16) {
 #if HEATER_BED_RAW_LO_TEMP < HEATER_BED_RAW_HI_TEMP
 		bed_maxttemp_raw -= OVERSAMPLENR;
 #else
@@ -659,7 +686,7 @@ void disable_heater()
 	target_temperature[0]=0;
 	soft_pwm[0]=0;
 #if defined(HEATER_0_PIN) && HEATER_0_PIN > -1
-	p_heater0 = 0; //WRITE(HEATER_0_PIN,LOW);
+	p_heater0.write(0); //WRITE(HEATER_0_PIN,LOW);
 	p_heater0_led = 0;
 #endif
 #endif
@@ -668,7 +695,7 @@ void disable_heater()
 	target_temperature[1] = 0;
 	soft_pwm[1]=0;
 #if defined(HEATER_1_PIN) && HEATER_1_PIN > -1
-	p_heater1 = 0; //WRITE(HEATER_1_PIN,LOW);
+	p_heater1.write(0); //WRITE(HEATER_1_PIN,LOW);
 #endif
 #endif
 
@@ -676,7 +703,7 @@ void disable_heater()
 	target_temperature[2]=0;
 	soft_pwm[2]=0;
 #if defined(HEATER_2_PIN) && HEATER_2_PIN > -1
-	p_heater2 = 0; //WRITE(HEATER_2_PIN,LOW);
+	p_heater2.write(0); //WRITE(HEATER_2_PIN,LOW);
 #endif
 #endif
 
@@ -684,7 +711,7 @@ void disable_heater()
 	target_temperature_bed=0;
 	soft_pwm_bed=0;
 #if defined(HEATER_BED_PIN) && HEATER_BED_PIN > -1
-	p_heater_bed = 0; //WRITE(HEATER_BED_PIN,LOW);
+	p_heater_bed.write(0); //WRITE(HEATER_BED_PIN,LOW);
 	p_heat_bed_led = 0;
 #endif
 #endif
@@ -718,76 +745,95 @@ void min_temp_error(uint8_t e) {
 
 void bed_max_temp_error(void) {}
 
-void temp_int()
+// Interrupt of the highest selected ADC channel, the end of a burst round
+static void adc_isr()
 {
-	static unsigned char temp_count = 0;
-	static unsigned long raw_temp_0_value = 0;
-	static unsigned long raw_temp_bed_value = 0;
-	static unsigned char temp_state = 0;
-	static unsigned char pwm_count = (1 << SOFT_PWM_SCALE);
-	static unsigned char soft_pwm_0;
-#if HEATER_BED_PIN > -1
-	static unsigned char soft_pwm_b;
-#endif
-
-	if(pwm_count == 0){
-		soft_pwm_0 = soft_pwm[0];
-		if(soft_pwm_0 > 0) {p_heater0 = 1; //WRITE(HEATER_0_PIN,1);
-			p_heater0_led = 1;
-		}
-#if defined(HEATER_BED_PIN) && HEATER_BED_PIN > -1
-		soft_pwm_b = soft_pwm_bed;
-		if(soft_pwm_b > 0) {p_heater_bed = 1; p_heat_bed_led = 1;} //WRITE(HEATER_BED_PIN,1);
+	if(adc_rounds >= OVERSAMPLENR) { // the conversion that was running when the burst was stopped
+#if defined(TEMP_0_PIN) && (TEMP_0_PIN > -1)
+		(void)ADC_RESULT(adc_channel_0);
 #endif
-#ifdef FAN_SOFT_PWM
-		soft_pwm_fan = fanSpeedSoftPwm / 2;
-		if(soft_pwm_fan > 0) p_fan = 1; //WRITE(FAN_PIN,1);
+#if defined(TEMP_BED_PIN) && (TEMP_BED_PIN > -1)
+		(void)ADC_RESULT(adc_channel_bed);
 #endif
+		return;
 	}
-	if(soft_pwm_0 <= pwm_count) {p_heater0_led = 0; p_heater0 = 0;} //WRITE(HEATER_0_PIN,0);
-#if defined(HEATER_BED_PIN) && HEATER_BED_PIN > -1
-	if(soft_pwm_b <= pwm_count) {p_heat_bed_led = 0; p_heater_bed  = 0;} //WRITE(HEATER_BED_PIN,0);
+#if defined(TEMP_0_PIN) && (TEMP_0_PIN > -1)
+	adc_sum_0 += ADC_RESULT(adc_channel_0);
 #endif
-#ifdef FAN_SOFT_PWM
-	if(soft_pwm_fan <= pwm_count) p_fan = 0;//WRITE(FAN_PIN,0);
+#if defined(TEMP_BED_PIN) && (TEMP_BED_PIN > -1)
+	adc_sum_bed += ADC_RESULT(adc_channel_bed);
 #endif
+	if(++adc_rounds >= OVERSAMPLENR)
+		LPC_ADC->ADCR &= ~ADCR_BURST;
+}
 
-	pwm_count += (1 << SOFT_PWM_SCALE);
-	pwm_count &= 0x7f;
+static void adc_start_burst()
+{
+	adc_sum_0 = 0;
+	adc_sum_bed = 0;
+	adc_rounds = 0;
+	LPC_ADC->ADCR |= ADCR_BURST;
+}
 
-	switch(temp_state) {
-		case 0: // Measure TEMP_0
+// The AnalogIn objects in main.cpp have powered the ADC and switched the pins to their ADC function
+static void adc_init()
+{
+	static const unsigned char pclk_div[4] = { 4, 1, 2, 8 };
+	uint32_t pclk = SystemCoreClock / pclk_div[(LPC_SC->PCLKSEL0 >> 24) & 3];
+	uint32_t clkdiv = (pclk + ADC_MAX_CLOCK - 1) / ADC_MAX_CLOCK - 1;
+	int last_channel = 0;
+
+	adc_channels = 0;
 #if defined(TEMP_0_PIN) && (TEMP_0_PIN > -1)
-			raw_temp_0_value = 1023 - (int) (p_temp0.read()*1023.0f) ;
-			raw_temp_0_value += 1023 - (int) (p_temp0.read()*1023.0f) ;
-			raw_temp_0_value /= 2;
+	adc_channels |= 1 << adc_channel_0;
+	if(adc_channel_0 > last_channel) last_channel = adc_channel_0;
 #endif
-			temp_state = 1;
-			break;
-		case 1: // Measure TEMP_BED
 #if defined(TEMP_BED_PIN) && (TEMP_BED_PIN > -1)
-			raw_temp_bed_value = 1023 - (int)(p_temp_bed.read()*1023.0f);
-			raw_temp_bed_value += 1023 - (int)(p_temp_bed.read()*1023.0f);
-			raw_temp_bed_value /= 2;
-#endif
-			temp_state = 2;
-			break;
-		case 2:
-			temp_state = 0;
-			temp_count++;
-			break;
-	}
+	adc_channels |= 1 << adc_channel_bed;
+	if(adc_channel_bed > last_channel) last_channel = adc_channel_bed;
+#endif
+	adc_rounds = OVERSAMPLENR;
+	LPC_ADC->ADCR = adc_channels | (clkdiv << 8) | ADCR_PDN;
+	// Burst mode requires the global DONE interrupt (bit 8) off. Channels are converted from the lowest up,
+	// so the interrupt of the highest one marks a complete round.
+	LPC_ADC->ADINTEN = 1UL << last_channel;
+	NVIC_SetVector(ADC_IRQn, (uintptr_t)&adc_isr);
+	NVIC_SetPriority(ADC_IRQn, 1); // below the stepper interrupt
+	NVIC_EnableIRQ(ADC_IRQn);
+}
+
+void temp_int()
+{
+	static unsigned char temp_count = 0;
+	static unsigned char pwm_count = (1 << SOFT_PWM_SCALE);
+	PROFILE_START();
 
-	if(temp_count >= 16) { // 8 ms * 16 = 128ms.
-		if (!temp_meas_ready) { //Only update the raw values if they have been read. Else we could be updating them during reading.
-			current_temperature_raw[0] = raw_temp_0_value;
-			current_temperature_bed_raw = raw_temp_bed_value;
+	// Hardware PWM outputs change their duty cycle here, only outputs on pins without PWM are switched by softTick()
+	p_heater0.write(soft_pwm[0]);
+	p_heater0_led = soft_pwm[0] > 0;
+	p_heater0.softTick(pwm_count);
+#if defined(HEATER_BED_PIN) && HEATER_BED_PIN > -1
+	p_heater_bed.write(soft_pwm_bed);
+	p_heat_bed_led = soft_pwm_bed > 0;
+	p_heater_bed.softTick(pwm_count);
+#endif
+	p_fan.softTick(pwm_count);
+
+	pwm_count += (1 << SOFT_PWM_SCALE);
+	pwm_count &= 0x7f;
+
+	temp_count++;
+	if(temp_count == TEMP_UPDATE_TICKS - 1) {
+		adc_start_burst(); // done long before the next tick
+	}
+	else if(temp_count >= TEMP_UPDATE_TICKS) {
+		if (!temp_meas_ready && adc_rounds >= OVERSAMPLENR) { //Only update the raw values if they have been read. Else we could be updating them during reading.
+			current_temperature_raw[0] = TEMP_RAW_MAX - adc_sum_0;
+			current_temperature_bed_raw = TEMP_RAW_MAX - adc_sum_bed;
 		}
 
 		temp_meas_ready = true;
 		temp_count = 0;
-		raw_temp_0_value = 0;
-		raw_temp_bed_value = 0;
 
 #if HEATER_0_RAW_LO_TEMP > HEATER_0_RAW_HI_TEMP
 		if(current_temperature_raw[0] <= maxttemp_raw[0]) {
@@ -816,6 +862,7 @@ void temp_int()
 		}
 #endif
 	}
+	PROFILE_END(PROFILE_TEMPERATURE);
 }
 
 #ifdef PIDTEMP
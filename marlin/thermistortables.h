@@ -3,7 +3,11 @@
 
 #include "Marlin.h"
 
-#define OVERSAMPLENR 1
+// The tables are in 10 bit ADC units. Raw temperatures are sums of OVERSAMPLENR 12 bit samples,
+// inverted so that a high raw value is a high temperature for a thermistor.
+#define TEMP_RAW_MAX (4095 * OVERSAMPLENR)
+#define TEMP_TABLE_SCALE (4 * OVERSAMPLENR)
+
 #if (THERMISTORHEATER == 1) || (THERMISTORBED == 1) //100k bed thermistor
 // Thermistor lookup table for RepRap Temperature Sensor Boards (http://make.rrrf.org/ts)
 // Made with createTemperatureLookup.py (http://svn.reprap.org/trunk/reprap/firmware/Arduino/utilities/createTemperatureLookup.py)
@@ -371,10 +375,10 @@ const short temptable_6[][2] = {
 //Set the high and low raw values for the heater, this indicates which raw value is a high or low temperature
 #ifndef HEATER_0_RAW_HI_TEMP
 # ifdef HEATER_0_USES_THERMISTOR   //In case of a thermistor the highest temperature results in the lowest ADC value
-#  define HEATER_0_RAW_HI_TEMP 1023
+#  define HEATER_0_RAW_HI_TEMP TEMP_RAW_MAX
 #  define HEATER_0_RAW_LO_TEMP 0
 # else                          //In case of an thermocouple the highest temperature results in the highest ADC value
-#  define HEATER_0_RAW_HI_TEMP 1023
+#  define HEATER_0_RAW_HI_TEMP TEMP_RAW_MAX
 #  define HEATER_0_RAW_LO_TEMP 0
 # endif
 #endif
@@ -437,10 +441,10 @@ const short temptable_6[][2] = {
 //Set the high and low raw values for the heater, this indicates which raw value is a high or low temperature
 #ifndef HEATER_BED_RAW_HI_TEMP
 # ifdef BED_USES_THERMISTOR   //In case of a thermistor the highest temperature results in the lowest ADC value
-#  define HEATER_BED_RAW_HI_TEMP 1023
+#  define HEATER_BED_RAW_HI_TEMP TEMP_RAW_MAX
 #  define HEATER_BED_RAW_LO_TEMP 0
 # else                          //In case of an thermocouple the highest temperature results in the highest ADC value
-#  define HEATER_BED_RAW_HI_TEMP 1023
+#  define HEATER_BED_RAW_HI_TEMP TEMP_RAW_MAX
 #  define HEATER_BED_RAW_LO_TEMP 0
 # endif
 #endif
@@ -0,0 +1,569 @@
+/*
+  bench.cpp - planner throughput benchmark on the host
+  Part of the Marlin simulator
+
+  Usage: mbed_marlin_bench [-f percent,...] [-c factor] [-j deviation] [-r] [file.gcode ...]
+
+  Plans workloads with plan_buffer_line() and mc_arc() as fast as possible and prints one JSON object per
+  workload and feedrate on stdout. The built-in workloads are generated G-code:
+
+    curves  concentric circles of 0.25 mm segments with extrusion
+    travel  long moves across the bed with Z hops
+    arcs    G2/G3 half circles of 1 to 40 mm radius with extrusion
+    infill  short extrusions, each with a retract, a travel and an unretract
+
+  G-code files given on the command line, for example recorded from a slicer, are added as workloads
+  named after the file. Only G0-G3, G5 (X Y Z E F I J P Q) and G92 are used, in absolute coordinates.
+
+  -f lists the feedrate multipliers in percent, like M220, that each workload runs at (default
+  50,100,200,400). -j sets the junction deviation in mm like M205 J, the default is
+  DEFAULT_JUNCTION_DEVIATION and 0 selects the jerk limits. -r replans the whole ring for every block, the way
+  the planner did before it kept block_buffer_planned: the same plan, only slower.
+
+  Nothing executes the blocks. The benchmark takes the oldest block out of the ring whenever it is full,
+  the way the stepper interrupt does behind a planner that keeps up, so every block is planned with a full
+  ring behind it. Its execution time follows from its final trapezoid.
+
+  The fields of a result:
+
+    revision             git describe of the tree the benchmark was built from
+    workload, feedrate   workload name, feedrate multiplier in percent
+    moves, blocks        G-code moves, planner blocks they became
+    blocks_per_s         blocks planned per second of host time, arcs included
+    line_ns_mean/p99/max host time of one plan_buffer_line() call of a G0/G1
+    arc_ns_max           host time of the longest mc_arc() or mc_bezier() call, 0 without curves
+    arc_segments         segments mc_arc() cut the arcs into
+    arc_error_max        largest distance in mm between an arc and its segments, in the plane of the arc
+    cpu_scale            the -c factor
+    junction_deviation   the -j value, 0 for the jerk limits
+    full_replan          1 with -r
+    print_s              time the moves take to execute
+    drains, stall_s      how often the ring ran empty and the moves had to wait for the planner, and the
+                         total wait
+
+  The last two come from replaying the plan: the planner takes the measured host time times -c per block
+  and has to wait for a free slot in the ring, the stepper executes the blocks one after another. A
+  drain would also make the planner stop at the end of the ring, which the replay doesn't model. -c is how
+  much slower the target plans a block than the host, M850 of the target and line_ns_mean give it.
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <time.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "mbed.h"
+#include "sim.h"
+#include "marlin/Marlin.h"
+#include "marlin/planner.h"
+#include "marlin/motion_control.h"
+#include "marlin/ConfigurationStore.h"
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+static double cpu_scale = 1;
+static bool full_replan;             // -r
+
+static bool running;                 // a workload is being planned
+static std::vector<double> plan_s;   // host time of each block
+static std::vector<double> exec_s;   // execution time of each block, in the order they left the ring
+static double retire_host_s;         // host time spent in retire_block(), not part of the planning
+
+// The arc mc_arc() is cutting into segments
+static bool in_arc;
+static double arc_center[2], arc_radius;
+static double arc_last[2];           // end of the last segment
+static long arc_segments;
+static double arc_error_max;
+
+static double host_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//===========================================================================
+//=============================block ring====================================
+//===========================================================================
+
+static int blocks_in_ring()
+{
+	return (block_buffer_head - block_buffer_tail) & (BLOCK_BUFFER_SIZE - 1);
+}
+
+static bool ring_full()
+{
+	return blocks_in_ring() == BLOCK_BUFFER_SIZE - 1;
+}
+
+// Time of the trapezoid of a block: accelerate from the entry speed, cruise, decelerate to the exit speed
+static double block_time(const block_t *block, double exit_speed)
+{
+	double v0 = block->entry_speed, v1 = exit_speed, vn = block->nominal_speed;
+	double a = block->acceleration, length = block->millimeters;
+	if(length <= 0 || vn <= 0)
+		return 0;
+	if(a <= 0)
+		return length / vn;
+	double accelerate = (vn * vn - v0 * v0) / (2 * a);
+	double decelerate = (vn * vn - v1 * v1) / (2 * a);
+	if(accelerate + decelerate <= length)
+		return (vn - v0) / a + (vn - v1) / a + (length - accelerate - decelerate) / vn;
+	// Nominal speed not reached
+	double peak = sqrt((2 * a * length + v0 * v0 + v1 * v1) / 2);
+	return std::max(peak - v0, 0.0) / a + std::max(peak - v1, 0.0) / a;
+}
+
+// What the stepper interrupt does once it is done with the oldest block
+static void retire_block()
+{
+	double start = host_time();
+	block_t *block = plan_get_current_block();
+	unsigned char next = (block_buffer_tail + 1) & (BLOCK_BUFFER_SIZE - 1);
+	exec_s.push_back(block_time(block, next != block_buffer_head ? block_buffer[next].entry_speed : 0));
+	plan_discard_current_block();
+	retire_host_s += host_time() - start;
+}
+
+// plan_buffer_line() waits here for room in the ring
+void sim_poll()
+{
+	if(running && ring_full())
+		retire_block();
+}
+
+void sim_serial_sent(char c)
+{
+	fputc(c, stderr);
+}
+
+void sim_gpio_changed(int port, uint32_t changed, uint32_t pins)
+{
+}
+
+void sim_pwm_changed(PinName pin, int pulsewidth_us, int period_us)
+{
+}
+
+void sim_flash_changed()
+{
+}
+
+int sim_adc_sample(int channel)
+{
+	return 0;
+}
+
+// mc_arc() plans its segments through here (see the Makefile). The distance to the arc is largest at the
+// ends of a segment, or where it comes closest to the center.
+void bench_plan_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder)
+{
+	if(in_arc) {
+		double error = fabs(hypot(x - arc_center[0], y - arc_center[1]) - arc_radius);
+		double dx = x - arc_last[0], dy = y - arc_last[1];
+		double length2 = dx * dx + dy * dy;
+		if(length2 > 0) {
+			double t = ((arc_center[0] - arc_last[0]) * dx + (arc_center[1] - arc_last[1]) * dy) / length2;
+			if(t > 0 && t < 1) {
+				double closest = hypot(arc_last[0] + t * dx - arc_center[0], arc_last[1] + t * dy - arc_center[1]);
+				error = std::max(error, fabs(arc_radius - closest));
+			}
+		}
+		arc_error_max = std::max(arc_error_max, error);
+		arc_last[0] = x;
+		arc_last[1] = y;
+		arc_segments++;
+	}
+	if(full_replan)
+		block_buffer_planned = block_buffer_tail;
+	plan_buffer_line(x, y, z, e, feed_rate, extruder);
+}
+
+//===========================================================================
+//=============================workloads=====================================
+//===========================================================================
+
+static unsigned long random_state;
+
+static double random_between(double lo, double hi)
+{
+	random_state = random_state * 1103515245 + 12345;
+	return lo + (hi - lo) * ((random_state >> 16) & 0x7fff) / 0x7fff;
+}
+
+static void append(std::string &gcode, const char *format, ...)
+{
+	char line[128];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	gcode += line;
+}
+
+#define BED_X_CENTER ((X_MIN_POS + X_MAX_POS) / 2.0)
+#define BED_Y_CENTER ((Y_MIN_POS + Y_MAX_POS) / 2.0)
+#define E_PER_MM 0.033
+
+static std::string curves_workload()
+{
+	std::string gcode;
+	double e = 0;
+	append(gcode, "G0 X%.3f Y%.3f Z0.2 F7800\n", BED_X_CENTER + 5, BED_Y_CENTER);
+	for(double r = 5; r <= 45; r += 2.5) {
+		int segments = (int)(2 * M_PI * r / 0.25);
+		append(gcode, "G0 X%.3f Y%.3f\n", BED_X_CENTER + r, BED_Y_CENTER);
+		for(int i = 1; i <= segments; i++) {
+			double a = 2 * M_PI * i / segments;
+			e += 2 * M_PI * r / segments * E_PER_MM;
+			append(gcode, "G1 X%.3f Y%.3f E%.5f F3600\n", BED_X_CENTER + r * cos(a), BED_Y_CENTER + r * sin(a), e);
+		}
+	}
+	return gcode;
+}
+
+static std::string travel_workload()
+{
+	std::string gcode;
+	double z = 0.2;
+	for(int i = 0; i < 400; i++) {
+		if(i % 4 == 0)
+			append(gcode, "G0 Z%.2f F600\n", z + 0.4);
+		append(gcode, "G0 X%.3f Y%.3f F7800\n", random_between(X_MIN_POS + 5, X_MAX_POS - 5), random_between(Y_MIN_POS + 5, Y_MAX_POS - 5));
+		if(i % 4 == 0)
+			append(gcode, "G0 Z%.2f F600\n", z);
+	}
+	return gcode;
+}
+
+static std::string arcs_workload()
+{
+	std::string gcode;
+	double e = 0;
+	append(gcode, "G0 Z0.2 F600\n");
+	for(int i = 0; i < 500; i++) {
+		double r = random_between(1, 40);
+		double x = random_between(X_MIN_POS + r + 1, X_MAX_POS - r - 1);
+		double y = random_between(Y_MIN_POS + r + 1, Y_MAX_POS - r - 1);
+		append(gcode, "G0 X%.3f Y%.3f F7800\n", x + r, y);
+		e += M_PI * r * E_PER_MM;
+		append(gcode, "G2 X%.3f Y%.3f I%.3f J0 E%.5f F3600\n", x - r, y, -r, e);
+		e += M_PI * r * E_PER_MM;
+		append(gcode, "G3 X%.3f Y%.3f I%.3f J0 E%.5f\n", x + r, y, r, e);
+	}
+	return gcode;
+}
+
+static std::string infill_workload()
+{
+	std::string gcode;
+	double e = 0;
+	append(gcode, "G0 Z0.2 F600\n");
+	for(int i = 0; i < 1500; i++) {
+		double x = random_between(X_MIN_POS + 20, X_MAX_POS - 20);
+		double y = random_between(Y_MIN_POS + 20, Y_MAX_POS - 20);
+		double length = random_between(5, 15);
+		append(gcode, "G0 X%.3f Y%.3f F7800\n", x, y);
+		e += 1;
+		append(gcode, "G1 E%.5f F2400\n", e);
+		e += length * E_PER_MM;
+		append(gcode, "G1 X%.3f Y%.3f E%.5f F3600\n", x + length * 0.7071, y + length * 0.7071, e);
+		e -= 1;
+		append(gcode, "G1 E%.5f F2400\n", e);
+	}
+	return gcode;
+}
+
+static bool read_file(const char *path, std::string &gcode)
+{
+	FILE *f = fopen(path, "r");
+	if(f == NULL)
+		return false;
+	char buffer[4096];
+	size_t n;
+	while((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		gcode.append(buffer, n);
+	fclose(f);
+	return true;
+}
+
+//===========================================================================
+//=============================benchmark=====================================
+//===========================================================================
+
+struct result_t {
+	long moves;
+	std::vector<double> line_s;  // host time of each plan_buffer_line() that made a block
+	double arc_max_s;
+};
+
+static long blocks_planned()
+{
+	return exec_s.size() + blocks_in_ring();
+}
+
+// Plan all moves of the G-code with the feedrates scaled by feed_percent
+static void plan_gcode(const std::string &gcode, double feed_percent, result_t &result)
+{
+	float position[NUM_AXIS] = { 0, 0, 0, 0 };
+	float feedrate = 1500; // mm/min
+	size_t pos = 0;
+
+	while(pos < gcode.size()) {
+		size_t end = gcode.find('\n', pos);
+		if(end == std::string::npos)
+			end = gcode.size();
+		std::string line = gcode.substr(pos, end - pos);
+		pos = end + 1;
+		size_t comment = line.find(';');
+		if(comment != std::string::npos)
+			line.erase(comment);
+
+		int g = -1;
+		bool seen[NUM_AXIS] = { false, false, false, false };
+		float target[NUM_AXIS];
+		float offset[NUM_AXIS] = { 0, 0, 0, 0 };
+		float control[4] = { 0, 0, 0, 0 }; // I J P Q of G5
+		std::copy(position, position + NUM_AXIS, target);
+		const char *p = line.c_str();
+		while(*p) {
+			char letter = toupper(*p++);
+			if(!isalpha(letter))
+				continue;
+			char *next;
+			double value = strtod(p, &next);
+			if(next == p)
+				continue;
+			p = next;
+			switch(letter) {
+				case 'G': g = (int)value; break;
+				case 'X': target[X_AXIS] = value; seen[X_AXIS] = true; break;
+				case 'Y': target[Y_AXIS] = value; seen[Y_AXIS] = true; break;
+				case 'Z': target[Z_AXIS] = value; seen[Z_AXIS] = true; break;
+				case 'E': target[E_AXIS] = value; seen[E_AXIS] = true; break;
+				case 'F': if(value > 0) feedrate = value; break;
+				case 'I': offset[X_AXIS] = value; control[0] = value; break;
+				case 'J': offset[Y_AXIS] = value; control[1] = value; break;
+				case 'P': control[2] = value; break;
+				case 'Q': control[3] = value; break;
+			}
+		}
+
+		float feed_rate = feedrate * feed_percent / 60 / 100.0;
+		long before = blocks_planned();
+		if(g == 0 || g == 1) {
+			while(ring_full())
+				retire_block();
+			if(full_replan)
+				block_buffer_planned = block_buffer_tail;
+			double start = host_time();
+			plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feed_rate, 0);
+			double took = host_time() - start;
+			if(blocks_planned() > before) {
+				result.line_s.push_back(took);
+				plan_s.push_back(took);
+			}
+		}
+		else if(g == 2 || g == 3) {
+			float radius = hypot(offset[X_AXIS], offset[Y_AXIS]);
+			in_arc = true;
+			arc_center[0] = position[X_AXIS] + offset[X_AXIS];
+			arc_center[1] = position[Y_AXIS] + offset[Y_AXIS];
+			arc_radius = radius;
+			arc_last[0] = position[X_AXIS];
+			arc_last[1] = position[Y_AXIS];
+			retire_host_s = 0;
+			double start = host_time();
+			mc_arc(position, target, offset, X_AXIS, Y_AXIS, Z_AXIS, feed_rate, radius, g == 2, 0);
+			double took = host_time() - start - retire_host_s;
+			in_arc = false;
+			long blocks = blocks_planned() - before;
+			for(long i = 0; i < blocks; i++)
+				plan_s.push_back(took / blocks);
+			result.arc_max_s = std::max(result.arc_max_s, took);
+		}
+		else if(g == 5) {
+			retire_host_s = 0;
+			double start = host_time();
+			mc_bezier(position, target, control, feed_rate, 0);
+			double took = host_time() - start - retire_host_s;
+			long blocks = blocks_planned() - before;
+			for(long i = 0; i < blocks; i++)
+				plan_s.push_back(took / blocks);
+			result.arc_max_s = std::max(result.arc_max_s, took);
+		}
+		else if(g == 92) {
+			for(int i = 0; i < NUM_AXIS; i++) {
+				if(seen[i])
+					position[i] = target[i];
+			}
+			plan_set_position(position[X_AXIS], position[Y_AXIS], position[Z_AXIS], position[E_AXIS]);
+			continue;
+		}
+		else
+			continue;
+		std::copy(target, target + NUM_AXIS, position);
+		result.moves++;
+	}
+	while(blocks_queued())
+		retire_block();
+}
+
+// Replay the plan with the planner cpu_scale times slower than the host: block i is planned once the
+// planner is done with block i-1 and block i-(BLOCK_BUFFER_SIZE-1) has left the ring, and executes
+// once the one before it has been executed.
+static void replay(double &print_s, long &drains, double &stall_s)
+{
+	size_t n = std::min(plan_s.size(), exec_s.size());
+	std::vector<double> done(n);
+	double planned = 0;
+	drains = 0;
+	stall_s = 0;
+	for(size_t i = 0; i < n; i++) {
+		double start = planned;
+		if(i >= BLOCK_BUFFER_SIZE - 1)
+			start = std::max(start, done[i - (BLOCK_BUFFER_SIZE - 1)]);
+		planned = start + plan_s[i] * cpu_scale;
+		double execute = i > 0 ? done[i - 1] : planned;
+		if(planned > execute) {
+			drains++;
+			stall_s += planned - execute;
+			execute = planned;
+		}
+		done[i] = execute + exec_s[i];
+	}
+	print_s = n > 0 ? done[n - 1] : 0;
+}
+
+static void run(const char *name, const std::string &gcode, double feed_percent)
+{
+	result_t result;
+	result.moves = 0;
+	result.arc_max_s = 0;
+	arc_segments = 0;
+	arc_error_max = 0;
+	plan_s.clear();
+	exec_s.clear();
+
+	plan_init();
+	running = true;
+	plan_gcode(gcode, feed_percent, result);
+	running = false;
+
+	double total_s = 0;
+	for(size_t i = 0; i < plan_s.size(); i++)
+		total_s += plan_s[i];
+	std::vector<double> &line_s = result.line_s;
+	double line_mean = 0, line_p99 = 0, line_max = 0;
+	if(!line_s.empty()) {
+		for(size_t i = 0; i < line_s.size(); i++)
+			line_mean += line_s[i];
+		line_mean /= line_s.size();
+		std::sort(line_s.begin(), line_s.end());
+		line_p99 = line_s[(line_s.size() - 1) * 99 / 100];
+		line_max = line_s.back();
+	}
+	double print_s, stall_s;
+	long drains;
+	replay(print_s, drains, stall_s);
+
+	printf("{\"revision\":\"%s\",\"workload\":\"%s\",\"feedrate\":%g,\"moves\":%ld,\"blocks\":%lu,"
+		"\"blocks_per_s\":%.0f,\"line_ns_mean\":%.0f,\"line_ns_p99\":%.0f,\"line_ns_max\":%.0f,\"arc_ns_max\":%.0f,"
+		"\"arc_segments\":%ld,\"arc_error_max\":%.4f,\"cpu_scale\":%g,\"junction_deviation\":%g,\"full_replan\":%d,\"print_s\":%.3f,\"drains\":%ld,\"stall_s\":%.6f}\n",
+		BENCH_REVISION, name, feed_percent, result.moves, (unsigned long)exec_s.size(),
+		total_s > 0 ? plan_s.size() / total_s : 0.0, line_mean * 1e9, line_p99 * 1e9, line_max * 1e9, result.arc_max_s * 1e9,
+		arc_segments, arc_error_max, cpu_scale, junction_deviation, full_replan, print_s, drains, stall_s);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<double> feedrates;
+	double deviation = -1;
+	int opt;
+	while((opt = getopt(argc, argv, "f:c:j:r")) != -1) {
+		switch(opt) {
+			case 'f':
+				for(char *p = optarg; *p; ) {
+					char *next;
+					double percent = strtod(p, &next);
+					if(next == p || percent <= 0) {
+						fprintf(stderr, "bad feedrate list: %s\n", optarg);
+						return 1;
+					}
+					feedrates.push_back(percent);
+					p = *next == ',' ? next + 1 : next;
+				}
+				break;
+			case 'c':
+				cpu_scale = atof(optarg);
+				break;
+			case 'j':
+				deviation = atof(optarg);
+				break;
+			case 'r':
+				full_replan = true;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-f percent,...] [-c factor] [-j deviation] [-r] [file.gcode ...]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(feedrates.empty()) {
+		feedrates.push_back(50);
+		feedrates.push_back(100);
+		feedrates.push_back(200);
+		feedrates.push_back(400);
+	}
+
+	std::vector<std::string> names, workloads;
+	names.push_back("curves");
+	workloads.push_back(curves_workload());
+	names.push_back("travel");
+	workloads.push_back(travel_workload());
+	names.push_back("arcs");
+	workloads.push_back(arcs_workload());
+	names.push_back("infill");
+	workloads.push_back(infill_workload());
+	for(int i = optind; i < argc; i++) {
+		std::string gcode;
+		if(!read_file(argv[i], gcode)) {
+			perror(argv[i]);
+			return 1;
+		}
+		const char *slash = strrchr(argv[i], '/');
+		names.push_back(slash ? slash + 1 : argv[i]);
+		workloads.push_back(gcode);
+	}
+
+	Config_ResetDefault();
+	if(deviation >= 0)
+		junction_deviation = deviation;
+#ifdef PREVENT_DANGEROUS_EXTRUDE
+	set_extrude_min_temp(0); // nothing heats, the hotend reads 0 degC
+#endif
+	for(size_t w = 0; w < workloads.size(); w++) {
+		for(size_t f = 0; f < feedrates.size(); f++)
+			run(names[w].c_str(), workloads[w], feedrates[f]);
+	}
+	return 0;
+}
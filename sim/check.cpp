@@ -0,0 +1,743 @@
+/*
+  check.cpp - checks of the firmware against exact references on the host
+  Part of the Marlin simulator
+
+  Usage: mbed_marlin_check [check ...]
+
+  Runs the named checks, or all of them, against the firmware built for the simulated LPC1768 and prints one
+  line per check on stdout: its name, ok or FAILED, and what it compared. The exit status is 1 if a check
+  failed. make check builds and runs it, and the intervals check once more built with S_CURVE_ACCELERATION.
+
+    intervals  the step intervals the stepper interrupt generates for a set of moves, against the speed
+               profile of the trapezoid of each block: linear ramps, or with S_CURVE_ACCELERATION the
+               quintic ramps of the S-curve, whose acceleration peaks at 1.875 times the average
+    bezier     mc_bezier() on a curve that made it halve and double its step forever, and on random curves,
+               which must return and end at the target
+    numbers    gcode_number() against (float)strtod() and strtol() for generated numbers, and floats printed
+               and parsed back
+    settings   M500 and M501 through 266 stores around both flash sectors: each must load, a reset after or
+               in the middle of any flash write or erase must load the record before or the new one, and a
+               corrupt newest record or one of another version must fall back to the one before
+    thermistor analog2temp_thermistor() for every raw value of the heater and bed tables, against the
+               linear scan it replaced interpolated in double, and the host time of both
+    timer      the intervals calc_timer() divides with the hardware divider for every step rate up to
+               MAX_STEP_FREQUENCY, against the division in double, and the host time of both
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <stdarg.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include "mbed.h"
+#include "sim.h"
+#include "marlin/Marlin.h"
+#include "marlin/planner.h"
+#include "marlin/stepper.h"
+#include "marlin/motion_control.h"
+#include "marlin/ConfigurationStore.h"
+#include "marlin/gcode.h"
+#include "marlin/thermistortables.h"
+
+// stepper.cpp
+unsigned long calc_timer(unsigned long step_rate);
+
+// temperature.cpp
+int analog2temp_thermistor(int raw, const short table[][2], int numtemps);
+
+// Times of the rising edges of the step pins, in sim_cycles
+static std::vector<unsigned long long> step_times[NUM_AXIS];
+
+static const int step_pins[NUM_AXIS] = { X_STEP_PIN, Y_STEP_PIN, Z_STEP_PIN, E_STEP_PIN };
+static const bool step_pins_inverted[NUM_AXIS] = { INVERT_X_STEP_PIN, INVERT_Y_STEP_PIN, INVERT_Z_STEP_PIN, INVERT_E_STEP_PIN };
+
+// The message of the failure of the running check
+static std::string failure;
+
+static void fail(const char *format, ...)
+{
+	if(!failure.empty())
+		return; // the first failure is the one to look at
+	char message[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	failure = message;
+}
+
+//===========================================================================
+//=============================simulator=====================================
+//===========================================================================
+
+void sim_poll()
+{
+}
+
+void sim_serial_sent(char c)
+{
+}
+
+void sim_gpio_changed(int port, uint32_t changed, uint32_t pins)
+{
+	for(int axis = 0; axis < NUM_AXIS; axis++) {
+		if(port != (int)PIN_PORT(step_pins[axis]) || !(changed & PIN_MASK(step_pins[axis])))
+			continue;
+		bool high = (pins & PIN_MASK(step_pins[axis])) != 0;
+		if(high != step_pins_inverted[axis])
+			step_times[axis].push_back(sim_cycles);
+	}
+}
+
+void sim_pwm_changed(PinName pin, int pulsewidth_us, int period_us)
+{
+}
+
+int sim_adc_sample(int channel)
+{
+	return 0;
+}
+
+// sim_flash_changed() is with the settings check
+
+static double host_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Let the stepper interrupt execute all planned blocks
+static void run_blocks()
+{
+	while(blocks_queued())
+		sim_advance(SIM_CPU_CLOCK / 1000);
+}
+
+//===========================================================================
+//=============================intervals=====================================
+//===========================================================================
+
+// Step rate in steps/s that the speed profile of a block has at time t in s after the start of its
+// acceleration (accelerating) or its deceleration. peak is the rate at the end of the acceleration.
+static double profile_rate(const block_t *block, double peak, bool accelerating, double t, double &acceleration_max)
+{
+	double a = block->acceleration_st;
+	double from = accelerating ? block->initial_rate : (block->decelerate_after > block->accelerate_until ? block->nominal_rate : peak);
+	double to = accelerating ? peak : block->final_rate;
+	acceleration_max = a;
+	if(a <= 0 || from == to)
+		return from;
+	double ramp = fabs(to - from) / a;
+	double s = std::min(t / ramp, 1.0);
+#ifdef S_CURVE_ACCELERATION
+	acceleration_max = a * 1.875;
+	return from + (to - from) * s * s * s * (10 - 15 * s + 6 * s * s);
+#else
+	return from + (to - from) * s;
+#endif
+}
+
+// The moves of one run, planned all at once so the trapezoids have their final junction speeds
+struct move_t {
+	float x, y, z;
+	float feed_rate; // mm/s
+};
+
+// Plan and execute the moves, then compare every step interval of every block with the profile. The
+// stepper interrupt holds the rate of the middle of each segment for the whole segment, so the deviation
+// is up to half a segment (or half an interval, if that is longer) times the acceleration.
+static void check_intervals_of(const move_t *moves, int count, long &intervals, double &worst)
+{
+	static float position[NUM_AXIS] = { 0, 0, 0, 0 }; // the runs continue where the last one ended
+	for(int axis = 0; axis < NUM_AXIS; axis++)
+		step_times[axis].clear();
+
+	std::vector<block_t> blocks;
+	for(int i = 0; i < count; i++) {
+		position[X_AXIS] += moves[i].x;
+		position[Y_AXIS] += moves[i].y;
+		position[Z_AXIS] += moves[i].z;
+		plan_buffer_line(position[X_AXIS], position[Y_AXIS], position[Z_AXIS], position[E_AXIS], moves[i].feed_rate, 0);
+	}
+	// No time has passed, so the blocks are all still in the ring and their trapezoids are final
+	for(unsigned char i = block_buffer_tail; i != block_buffer_head; i = (i + 1) & (BLOCK_BUFFER_SIZE - 1))
+		blocks.push_back(block_buffer[i]);
+	run_blocks();
+
+	size_t cursor[NUM_AXIS] = { 0, 0, 0, 0 };
+	for(size_t b = 0; b < blocks.size(); b++) {
+		const block_t *block = &blocks[b];
+		long steps[NUM_AXIS] = { block->steps_x, block->steps_y, block->steps_z, block->steps_e };
+		int axis = 0;
+		while(axis < NUM_AXIS && (unsigned long)steps[axis] != block->step_event_count)
+			axis++;
+		if(axis == NUM_AXIS || cursor[axis] + block->step_event_count > step_times[axis].size()) {
+			fail("block %d: %lu step events, not all executed", (int)b, block->step_event_count);
+			return;
+		}
+		// Every step event steps the axis with the most steps
+		const unsigned long long *event = &step_times[axis][cursor[axis]];
+		for(int i = 0; i < NUM_AXIS; i++)
+			cursor[i] += steps[i];
+
+		double peak = sqrt((double)block->initial_rate * block->initial_rate + 2.0 * block->acceleration_st * block->accelerate_until);
+		peak = std::max(std::min(peak, (double)block->nominal_rate), (double)block->initial_rate);
+		// The interrupt programs the interval to the next event after each event, so a segment lasts from its
+		// first event to the first event of the next one, and the interval from event i-1 to i has the rate
+		// of the segment of event i-1. The interval to the first event belongs to the block before.
+		unsigned long long start = event[0];
+		unsigned long long decelerate_start = event[std::min((unsigned long)block->decelerate_after, block->step_event_count - 1)];
+		for(unsigned long i = 1; i < block->step_event_count; i++) {
+			unsigned long long previous = event[i - 1];
+			double interval = (double)(event[i] - previous) / SIM_CPU_CLOCK;
+			double middle = (double)(event[i] + previous) / 2;
+			double expected, acceleration_max = 0;
+			if(i - 1 < (unsigned long)block->accelerate_until)
+				expected = profile_rate(block, peak, true, (middle - start) / SIM_CPU_CLOCK, acceleration_max);
+			else if(i - 1 >= (unsigned long)block->decelerate_after)
+				expected = profile_rate(block, peak, false, (middle - decelerate_start) / SIM_CPU_CLOCK, acceleration_max);
+			else
+				expected = block->nominal_rate;
+			double tolerance = acceleration_max * std::max(STEP_SEGMENT_TIME / 1e6, interval) / 2 + 2;
+			double deviation = fabs(1 / interval - expected);
+			worst = std::max(worst, deviation / tolerance);
+			intervals++;
+			if(deviation > tolerance) {
+				fail("block %d event %lu: %.1f steps/s, the profile has %.1f +- %.1f", (int)b, i, 1 / interval, expected, tolerance);
+				return;
+			}
+		}
+	}
+}
+
+static void check_intervals(char *result, size_t size)
+{
+	// Moves from rest with and without cruising, junctions between blocks, and the slow Z
+	static const move_t single[] = { { 50, 0, 0, 100 } };
+	static const move_t short_move[] = { { 2, 0, 0, 100 } };
+	static const move_t chain[] = {
+		{ 5, 0, 0, 80 }, { 5, 0, 0, 80 }, { 5, 1, 0, 80 }, { 5, 2, 0, 80 }, { 5, 3, 0, 40 },
+		{ 5, -3, 0, 40 }, { 20, 0, 0, 120 }, { 1, 0, 0, 120 }, { 10, 0, 0, 30 }, { 10, 5, 0, 60 }
+	};
+	static const move_t z[] = { { 0, 0, 2, 1.7 } };
+	static const struct {
+		const move_t *moves;
+		int count;
+	} runs[] = {
+		{ single, 1 }, { short_move, 1 }, { chain, sizeof(chain) / sizeof(chain[0]) }, { z, 1 }
+	};
+
+	long intervals = 0;
+	double worst = 0;
+	for(unsigned int i = 0; i < sizeof(runs) / sizeof(runs[0]) && failure.empty(); i++)
+		check_intervals_of(runs[i].moves, runs[i].count, intervals, worst);
+	snprintf(result, size, "%ld intervals, largest deviation %.0f%% of the tolerance", intervals, worst * 100);
+}
+
+//===========================================================================
+//=============================bezier========================================
+//===========================================================================
+
+static unsigned long random_state = 1;
+
+static unsigned long random_below(unsigned long n)
+{
+	random_state = random_state * 1103515245 + 12345;
+	return (random_state >> 8) % n;
+}
+
+// A check that doesn't return can't report itself, so the alarm does
+static const char *running_check;
+
+static void check_timed_out(int signal)
+{
+	printf("%s: FAILED, no result after 10 s\n", running_check);
+	fflush(stdout);
+	_exit(1);
+}
+
+// A curve of G5 I J P Q X Y F from X0 Y0
+struct curve_t {
+	float offset[4];
+	float x, y;
+	float feed_rate; // mm/s
+};
+
+static void check_bezier(char *result, size_t size)
+{
+	// At t = 0.2125 the step was halved for the deviation and doubled again for the short chord, without end.
+	// The random curves after it look for other ones.
+	const int count = 100;
+	std::vector<curve_t> curves;
+	curve_t hang = { { -1.977, 16.474, 33.944, -51.561 }, -9.571, 38.273, 400 };
+	curves.push_back(hang);
+	while((int)curves.size() < count) {
+		curve_t curve;
+		for(int i = 0; i < 4; i++)
+			curve.offset[i] = (float)random_below(120000) / 1000 - 60;
+		curve.x = (float)random_below(80000) / 1000 - 40;
+		curve.y = (float)random_below(80000) / 1000 - 40;
+		curve.feed_rate = 100 + random_below(301);
+		curves.push_back(curve);
+	}
+
+	run_blocks();
+	float previous[NUM_AXIS];
+	for(int axis = 0; axis < NUM_AXIS; axis++)
+		previous[axis] = st_get_position(axis) / axis_steps_per_unit[axis];
+	for(int i = 0; i < count; i++) {
+		float position[NUM_AXIS] = { 0, 0, previous[Z_AXIS], previous[E_AXIS] };
+		float target[NUM_AXIS] = { curves[i].x, curves[i].y, previous[Z_AXIS], previous[E_AXIS] };
+		float offset[4];
+		memcpy(offset, curves[i].offset, sizeof(offset));
+		plan_set_position(position[X_AXIS], position[Y_AXIS], position[Z_AXIS], position[E_AXIS]);
+		alarm(10);
+		mc_bezier(position, target, offset, curves[i].feed_rate, 0);
+		run_blocks();
+		alarm(0);
+		for(int axis = X_AXIS; axis <= Y_AXIS; axis++) {
+			if(st_get_position(axis) != lround(target[axis] * axis_steps_per_unit[axis])) {
+				fail("curve %d ends at %ld steps on %c, not at %ld", i, st_get_position(axis), "XYZE"[axis],
+					lround(target[axis] * axis_steps_per_unit[axis]));
+				return;
+			}
+		}
+	}
+	plan_set_position(previous[X_AXIS], previous[Y_AXIS], previous[Z_AXIS], previous[E_AXIS]);
+	snprintf(result, size, "%d curves", count);
+}
+
+//===========================================================================
+//=============================numbers=======================================
+//===========================================================================
+
+// Parse text with gcode_number() and with the C library, which has to agree on the value, the integer
+// part and the end of the number. Numbers without an exponent only.
+static bool check_number(const char *text)
+{
+	float value;
+	long value_long;
+	const char *end = gcode_number(text, &value, &value_long);
+	char *strtod_end;
+	float expected = (float)strtod(text, &strtod_end);
+	long expected_long = strtol(text, NULL, 10);
+	if(value != expected || value_long != expected_long || end != strtod_end) {
+		fail("\"%s\": %.9g, %ld, %d characters, strtod() %.9g, strtol() %ld, %d characters", text, value, value_long,
+			(int)(end - text), expected, expected_long, (int)(strtod_end - text));
+		return false;
+	}
+	return true;
+}
+
+static void check_numbers(char *result, size_t size)
+{
+	// What the grammar has to handle the way the C library does
+	static const char *const cases[] = {
+		"0", "-0", "+1", "  \t12.5", ".5", "-.5", "5.", "-", ".", "007.0700", "123456789", "16777216.5",
+		"0.00000001", "340282346638528859811704183484516925440", "99999999999999999999", "-99999999999999999999", "0.1234567890123",
+		"1234567.125", "8388608.5", "X", "10*", "1.5 Y2"
+	};
+	for(unsigned int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		if(!check_number(cases[i]))
+			return;
+	// No exponents: "1E5" is the number 1 followed by the word E5
+	float value;
+	long value_long;
+	if(*gcode_number("1E5", &value, &value_long) != 'E' || value != 1) {
+		fail("\"1E5\": %.9g, not 1 followed by E5", value);
+		return;
+	}
+
+	// Random numbers of 0 to 10 integer digits and 0 to 12 fraction digits, the way hosts send them
+	const long count = 1000000;
+	char text[64];
+	for(long n = 0; n < count; n++) {
+		char *p = text;
+		if(random_below(2))
+			*p++ = '-';
+		int integer_digits = random_below(11), fraction_digits = random_below(13);
+		for(int i = 0; i < integer_digits; i++)
+			*p++ = '0' + random_below(10);
+		if(fraction_digits || random_below(2))
+			*p++ = '.';
+		for(int i = 0; i < fraction_digits; i++)
+			*p++ = '0' + random_below(10);
+		*p = 0;
+		if(!check_number(text))
+			return;
+	}
+
+	// Floats in the range of coordinates printed with 1 to 9 decimals, like a host would, must parse back to
+	// the nearest float of the printed decimal
+	long round_trips = 0;
+	for(long n = 0; n < count; n++) {
+		float f = (float)((double)random_below(2000000000) / 1000000 - 1000);
+		snprintf(text, sizeof(text), "%.*f", (int)random_below(9) + 1, f);
+		if(!check_number(text))
+			return;
+		snprintf(text, sizeof(text), "%.9g", f);
+		if(!strchr(text, 'e')) {
+			gcode_number(text, &value, &value_long);
+			if(value != f) {
+				fail("%.9g printed as \"%s\" parses as %.9g", f, text, value);
+				return;
+			}
+			round_trips++;
+		}
+	}
+	snprintf(result, size, "%d cases, %ld generated numbers, %ld printed numbers, %ld exact round trips",
+		(int)(sizeof(cases) / sizeof(cases[0])), count, count, round_trips);
+}
+
+//===========================================================================
+//=============================settings======================================
+//===========================================================================
+
+// The two sectors of ConfigurationStore.cpp and the head of its records: magic, version, size, sequence
+#define SETTINGS_AREA 0x70000
+#define SETTINGS_AREA_SIZE 0x10000
+#define SETTINGS_RECORD_SIZE 256
+#define RECORD_VERSION 4
+#define RECORD_SIZE 6
+#define RECORD_SETTINGS 12 // the CRC-32 follows the settings
+
+typedef std::vector<uint8_t> flash_state_t;
+
+// The settings sectors after each change the IAP made
+static std::vector<flash_state_t> flash_states;
+
+static flash_state_t flash_state()
+{
+	return flash_state_t(sim_flash + SETTINGS_AREA, sim_flash + SETTINGS_AREA + SETTINGS_AREA_SIZE);
+}
+
+static void set_flash_state(const flash_state_t &state)
+{
+	memcpy(sim_flash + SETTINGS_AREA, &state[0], SETTINGS_AREA_SIZE);
+}
+
+void sim_flash_changed()
+{
+	flash_states.push_back(flash_state());
+}
+
+static uint32_t crc32(const uint8_t *p, size_t size)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	while(size--) {
+		crc ^= *p++;
+		for(int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+// The acceleration M501 loads from the flash as it is. The stores mark their record with the acceleration.
+static float retrieved_acceleration()
+{
+	acceleration = -1;
+	Config_RetrieveSettings();
+	return acceleration;
+}
+
+// Offset of the first byte that differs between two states, SETTINGS_AREA_SIZE if none does
+static size_t first_change(const flash_state_t &from, const flash_state_t &to)
+{
+	size_t i = 0;
+	while(i < SETTINGS_AREA_SIZE && from[i] == to[i])
+		i++;
+	return i;
+}
+
+// A reset in the middle of the change from one state to the next: the first half of the changed bytes changed
+static flash_state_t half_changed(const flash_state_t &from, const flash_state_t &to)
+{
+	std::vector<size_t> changed;
+	for(size_t i = 0; i < SETTINGS_AREA_SIZE; i++)
+		if(from[i] != to[i])
+			changed.push_back(i);
+	flash_state_t state = from;
+	for(size_t i = 0; i < changed.size() / 2; i++)
+		state[changed[i]] = to[changed[i]];
+	return state;
+}
+
+static void check_settings(char *result, size_t size)
+{
+	set_flash_state(flash_state_t(SETTINGS_AREA_SIZE, 0xFF));
+	if(retrieved_acceleration() != DEFAULT_ACCELERATION) {
+		fail("blank flash: acceleration %.0f, not the default", acceleration);
+		return;
+	}
+
+	// Around both sectors and into the first one again
+	const int stores = SETTINGS_AREA_SIZE / SETTINGS_RECORD_SIZE + 10;
+	float before = DEFAULT_ACCELERATION;
+	flash_state_t foreign; // only a record of another version
+	long resets = 0;
+	for(int i = 0; i < stores; i++) {
+		float marker = 10000 + i;
+		flash_states.clear();
+		flash_states.push_back(flash_state());
+		Config_ResetDefault();
+		acceleration = marker;
+		Config_StoreSettings();
+		flash_state_t stored = flash_state();
+		if(flash_states.size() < 2) {
+			fail("store %d: the flash didn't change", i);
+			return;
+		}
+
+		// A reset after each change of the IAP, and in the middle of each
+		for(size_t c = 1; c < flash_states.size(); c++) {
+			flash_state_t reset_states[2] = { half_changed(flash_states[c - 1], flash_states[c]), flash_states[c] };
+			for(int r = 0; r < 2; r++) {
+				bool complete = c == flash_states.size() - 1 && r == 1;
+				set_flash_state(reset_states[r]);
+				float expected = complete ? marker : before;
+				resets++;
+				if(retrieved_acceleration() != expected) {
+					fail("store %d: reset %s change %d of %d loads acceleration %.0f, not %.0f", i, r ? "after" : "in",
+						(int)c, (int)flash_states.size() - 1, acceleration, expected);
+					return;
+				}
+			}
+		}
+
+		// The newest record is the one the last change wrote
+		size_t newest = first_change(flash_states[flash_states.size() - 2], stored) / SETTINGS_RECORD_SIZE * SETTINGS_RECORD_SIZE;
+		uint16_t settings_size = stored[newest + RECORD_SIZE] | stored[newest + RECORD_SIZE + 1] << 8;
+		size_t crc_offset = newest + RECORD_SETTINGS + settings_size;
+		if(crc32(&stored[newest], crc_offset - newest) != (uint32_t)(stored[crc_offset] | stored[crc_offset + 1] << 8 |
+			stored[crc_offset + 2] << 16 | stored[crc_offset + 3] << 24)) {
+			fail("store %d: no record with the CRC-32 behind the settings at 0x%x", i, (unsigned int)(SETTINGS_AREA + newest));
+			return;
+		}
+
+		// One bit of its settings cleared
+		flash_state_t corrupt = stored;
+		size_t bit = newest + RECORD_SETTINGS;
+		while(corrupt[bit] == 0)
+			bit++;
+		corrupt[bit] &= corrupt[bit] - 1;
+		set_flash_state(corrupt);
+		if(retrieved_acceleration() != before) {
+			fail("store %d: with the newest record corrupt acceleration %.0f, not %.0f", i, acceleration, before);
+			return;
+		}
+
+		// Another version, with a valid CRC
+		flash_state_t other = stored;
+		other[newest + RECORD_VERSION]++;
+		uint32_t crc = crc32(&other[newest], crc_offset - newest);
+		for(int b = 0; b < 4; b++)
+			other[crc_offset + b] = crc >> (8 * b);
+		set_flash_state(other);
+		if(retrieved_acceleration() != before) {
+			fail("store %d: with the newest record of another version acceleration %.0f, not %.0f", i, acceleration, before);
+			return;
+		}
+		if(i == 0)
+			foreign = other;
+
+		set_flash_state(stored);
+		before = marker;
+	}
+
+	// The first store over records of another version starts anew
+	set_flash_state(foreign);
+	if(retrieved_acceleration() != DEFAULT_ACCELERATION) {
+		fail("only a record of another version: acceleration %.0f, not the default", acceleration);
+		return;
+	}
+	Config_ResetDefault();
+	acceleration = 20000;
+	Config_StoreSettings();
+	if(retrieved_acceleration() != 20000) {
+		fail("store over a record of another version: acceleration %.0f, not 20000", acceleration);
+		return;
+	}
+	Config_ResetDefault();
+	snprintf(result, size, "%d stores, %ld resets during the stores", stores, resets);
+}
+
+//===========================================================================
+//=============================thermistor====================================
+//===========================================================================
+
+// The lookup of the temperature before the binary search, on the raw values of today: the first entry
+// above raw by linear scan, interpolated in double instead of truncated to whole degrees. In 1/16 degC.
+static double analog2temp_scan(int raw, const short table[][2], int numtemps)
+{
+	int i;
+	raw = TEMP_RAW_MAX - raw;
+	for(i = 1; i < numtemps; i++) {
+		if(table[i][0] * TEMP_TABLE_SCALE > raw)
+			return 16 * (table[i - 1][1] + (double)(raw - table[i - 1][0] * TEMP_TABLE_SCALE) * (table[i][1] - table[i - 1][1]) /
+				((table[i][0] - table[i - 1][0]) * TEMP_TABLE_SCALE));
+	}
+	// Overflow: Set to last value in the table
+	return 16 * table[numtemps - 1][1];
+}
+
+static void check_table(const short table[][2], int numtemps, double &error_max, double &search_ns, double &scan_ns)
+{
+	for(int raw = 0; raw <= TEMP_RAW_MAX; raw++) {
+		int temperature = analog2temp_thermistor(raw, table, numtemps);
+		double expected = analog2temp_scan(raw, table, numtemps);
+		// The integer interpolation truncates toward zero, less than 1/16 degC
+		double error = fabs(temperature - expected);
+		error_max = std::max(error_max, error);
+		if(error >= 1) {
+			fail("raw %d: %d/16 degC, the linear scan gives %.2f/16", raw, temperature, expected);
+			return;
+		}
+	}
+
+	volatile double sink = 0;
+	double start = host_time();
+	long sum = 0;
+	for(int raw = 0; raw <= TEMP_RAW_MAX; raw++)
+		sum += analog2temp_thermistor(raw, table, numtemps);
+	search_ns = (host_time() - start) * 1e9 / (TEMP_RAW_MAX + 1);
+	start = host_time();
+	double sum_scan = 0;
+	for(int raw = 0; raw <= TEMP_RAW_MAX; raw++)
+		sum_scan += analog2temp_scan(raw, table, numtemps);
+	scan_ns = (host_time() - start) * 1e9 / (TEMP_RAW_MAX + 1);
+	sink = sink + sum + sum_scan;
+}
+
+static void check_thermistor(char *result, size_t size)
+{
+	double heater_error = 0, heater_search_ns = 0, heater_scan_ns = 0;
+	double bed_error = 0, bed_search_ns = 0, bed_scan_ns = 0;
+	check_table(temptable, NUMTEMPS, heater_error, heater_search_ns, heater_scan_ns);
+	if(failure.empty())
+		check_table(bedtemptable, BNUMTEMPS, bed_error, bed_search_ns, bed_scan_ns);
+	snprintf(result, size, "%d raw values, largest error %.3f/16 degC (heater, %d entries) and %.3f/16 degC (bed, %d entries), "
+		"%.0f and %.0f ns per lookup, %.0f and %.0f ns by linear scan", TEMP_RAW_MAX + 1, heater_error, NUMTEMPS, bed_error, BNUMTEMPS,
+		heater_search_ns, bed_search_ns, heater_scan_ns, bed_scan_ns);
+}
+
+//===========================================================================
+//=============================timer=========================================
+//===========================================================================
+
+// calc_timer() steps 2 or 4 times per interrupt above 10 and 20 kHz and divides by the shifted rate, so
+// the interval of one interrupt is compared with that division done exactly. Dropping the low bits of the
+// rate is a separate error, reported relative to the exact interval of the rate itself.
+static void check_timer(char *result, size_t size)
+{
+	double error_max = 0, shift_error_max = 0;
+	for(unsigned long rate = 1; rate <= MAX_STEP_FREQUENCY; rate++) {
+		int loops = rate > 20000 ? 4 : rate > 10000 ? 2 : 1;
+		double timer = calc_timer(rate);
+		double exact = (double)STEPPER_TIMER_RATE / (rate / loops);
+		double error = fabs(timer - exact);
+		error_max = std::max(error_max, error);
+		shift_error_max = std::max(shift_error_max, fabs(timer - (double)STEPPER_TIMER_RATE * loops / rate) * rate / loops / STEPPER_TIMER_RATE);
+		if(error > 0.5) {
+			fail("%lu steps/s: %.0f ticks, exactly %.3f", rate, timer, exact);
+			return;
+		}
+	}
+
+	// Host time of a call; the sums keep the compiler from dropping the loops
+	const int passes = 20;
+	volatile unsigned long sink_timer = 0;
+	volatile double sink_double = 0;
+	double start = host_time();
+	for(int pass = 0; pass < passes; pass++) {
+		unsigned long sum = 0;
+		for(unsigned long rate = 1; rate <= MAX_STEP_FREQUENCY; rate++)
+			sum += calc_timer(rate);
+		sink_timer = sink_timer + sum;
+	}
+	double timer_ns = (host_time() - start) * 1e9 / passes / MAX_STEP_FREQUENCY;
+	start = host_time();
+	for(int pass = 0; pass < passes; pass++) {
+		double sum = 0;
+		for(unsigned long rate = 1; rate <= MAX_STEP_FREQUENCY; rate++)
+			sum += (double)STEPPER_TIMER_RATE / rate;
+		sink_double = sink_double + sum;
+	}
+	double double_ns = (host_time() - start) * 1e9 / passes / MAX_STEP_FREQUENCY;
+
+	snprintf(result, size, "%d rates, largest error %.3f ticks, %.4f%% from the shift of the rate, %.1f ns per call, %.1f ns in double",
+		MAX_STEP_FREQUENCY, error_max, shift_error_max * 100, timer_ns, double_ns);
+}
+
+//===========================================================================
+//=============================checks========================================
+//===========================================================================
+
+static const struct {
+	const char *name;
+	void (*check)(char *result, size_t size);
+} checks[] = {
+	{ "intervals", check_intervals },
+	{ "bezier", check_bezier },
+	{ "numbers", check_numbers },
+	{ "settings", check_settings },
+	{ "thermistor", check_thermistor },
+	{ "timer", check_timer }
+};
+#define CHECKS (sizeof(checks) / sizeof(checks[0]))
+
+int main(int argc, char **argv)
+{
+	for(int i = 1; i < argc; i++) {
+		unsigned int c = 0;
+		while(c < CHECKS && strcmp(argv[i], checks[c].name) != 0)
+			c++;
+		if(c == CHECKS) {
+			fprintf(stderr, "unknown check: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	signal(SIGALRM, check_timed_out);
+	Config_ResetDefault();
+	plan_init();
+	enable_endstops(false);
+	st_init();
+
+	int failed = 0;
+	for(unsigned int c = 0; c < CHECKS; c++) {
+		bool selected = argc == 1;
+		for(int i = 1; i < argc; i++)
+			selected |= strcmp(argv[i], checks[c].name) == 0;
+		if(!selected)
+			continue;
+		char result[256] = "";
+		failure.clear();
+		running_check = checks[c].name;
+		checks[c].check(result, sizeof(result));
+		if(failure.empty())
+			printf("%s: ok, %s\n", checks[c].name, result);
+		else {
+			printf("%s: FAILED, %s\n", checks[c].name, failure.c_str());
+			failed++;
+		}
+		fflush(stdout);
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,860 @@
+/*
+  mbed.cpp - simulated LPC1768 peripherals and mbed library classes
+  Part of the Marlin simulator
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdarg.h>
+#include "mbed.h"
+#include "sim.h"
+
+// Cycles from an interrupt request to the first instruction of its handler
+#define SIM_INTERRUPT_CYCLES 12
+
+#define NEVER (~0ULL)
+
+unsigned long long sim_cycles = 0;
+
+LPC_TIM_TypeDef sim_tim[4];
+LPC_SC_TypeDef sim_sc;
+LPC_ADC_TypeDef sim_adc;
+LPC_GPIO_TypeDef sim_gpio[5];
+LPC_UART_TypeDef sim_uart[4];
+LPC_GPDMA_TypeDef sim_gpdma;
+LPC_GPDMACH_TypeDef sim_gpdmach[8];
+SCB_Type sim_scb;
+CoreDebug_Type sim_coredebug;
+volatile uint32_t sim_dwt_ctrl;
+sim_cyccnt sim_dwt_cyccnt;
+uint32_t SystemCoreClock = SIM_CPU_CLOCK;
+
+// fastio.h and SerialBuffered address the GPIO ports and DMA channels in steps of 0x20 like on the target
+typedef char sim_gpio_size_check[sizeof(LPC_GPIO_TypeDef) == 0x20 ? 1 : -1];
+typedef char sim_gpdmach_size_check[sizeof(LPC_GPDMACH_TypeDef) == 0x20 ? 1 : -1];
+
+//===========================================================================
+//=============================interrupts====================================
+//===========================================================================
+
+// Exception numbers: PendSV is 14, IRQ n is 16 + n. Of two pending interrupts with the same priority the
+// one with the lower number runs first, like in the NVIC.
+#define EXCEPTIONS 48
+#define EXCEPTION(irq) ((int)(irq) + 16)
+#define THREAD_PRIORITY 0x100 // lower than any interrupt
+
+static uintptr_t vectors[EXCEPTIONS];
+static uint8_t priorities[EXCEPTIONS];
+static unsigned long long enabled_mask = 1ULL << EXCEPTION(PendSV_IRQn); // system exceptions can't be disabled
+static unsigned long long pending_mask;
+static uint32_t primask;
+static int active_priority = THREAD_PRIORITY;
+
+static void set_pending(int exception)
+{
+	pending_mask |= 1ULL << exception;
+}
+
+// Run the pending interrupts that may preempt the running code, highest priority first
+static void dispatch()
+{
+	while(!primask) {
+		unsigned long long ready = pending_mask & enabled_mask;
+		int best = -1;
+		for(int e = 0; ready; e++, ready >>= 1) {
+			if((ready & 1) && priorities[e] < active_priority && (best < 0 || priorities[e] < priorities[best]))
+				best = e;
+		}
+		if(best < 0)
+			return;
+		pending_mask &= ~(1ULL << best);
+		int preempted = active_priority;
+		active_priority = priorities[best];
+		sim_cycles += SIM_INTERRUPT_CYCLES;
+		if(vectors[best])
+			((void (*)(void))vectors[best])();
+		active_priority = preempted;
+	}
+}
+
+bool sim_in_interrupt()
+{
+	return active_priority != THREAD_PRIORITY;
+}
+
+void NVIC_SetVector(IRQn_Type irq, uintptr_t vector)
+{
+	vectors[EXCEPTION(irq)] = vector;
+}
+
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority)
+{
+	priorities[EXCEPTION(irq)] = priority & ((1 << __NVIC_PRIO_BITS) - 1);
+}
+
+void NVIC_EnableIRQ(IRQn_Type irq)
+{
+	enabled_mask |= 1ULL << EXCEPTION(irq);
+	dispatch();
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq)
+{
+	enabled_mask &= ~(1ULL << EXCEPTION(irq));
+}
+
+uint32_t __get_PRIMASK()
+{
+	return primask;
+}
+
+void __set_PRIMASK(uint32_t value)
+{
+	primask = value & 1;
+	dispatch();
+}
+
+sim_icsr &sim_icsr::operator=(uint32_t value)
+{
+	if(value & SCB_ICSR_PENDSVSET_Msk) {
+		set_pending(EXCEPTION(PendSV_IRQn));
+		dispatch();
+	}
+	return *this;
+}
+
+sim_cyccnt &sim_cyccnt::operator=(uint32_t value)
+{
+	m_offset = value - (uint32_t)sim_cycles;
+	return *this;
+}
+
+sim_cyccnt::operator uint32_t() const
+{
+	return (uint32_t)sim_cycles + m_offset;
+}
+
+//===========================================================================
+//=============================timers========================================
+//===========================================================================
+
+// Only the MR0 match is simulated
+static struct {
+	unsigned long long last;   // sim_cycles of the last update
+	uint32_t prescale;         // cycles counted towards the next TC increment
+} timers[4];
+
+static const IRQn_Type timer_irqs[4] = { TIMER0_IRQn, TIMER1_IRQn, TIMER2_IRQn, TIMER3_IRQn };
+
+static void timer_update(int n)
+{
+	LPC_TIM_TypeDef *t = &sim_tim[n];
+	unsigned long long elapsed = sim_cycles - timers[n].last;
+	timers[n].last = sim_cycles;
+	if(t->TCR & 2) {
+		t->TC.m_value = 0;
+		timers[n].prescale = 0;
+		return;
+	}
+	if(!(t->TCR & 1))
+		return;
+
+	unsigned long long ticks = (timers[n].prescale + elapsed) / (t->PR + 1);
+	timers[n].prescale = (timers[n].prescale + elapsed) % (t->PR + 1);
+	uint32_t tc = t->TC.m_value;
+	while(ticks) {
+		if((t->MCR & 2) && tc == t->MR0) { // reset on match, one tick after the match
+			tc = 0;
+			ticks--;
+			continue;
+		}
+		unsigned long long distance = (uint32_t)(t->MR0 - tc);
+		if(distance == 0)
+			distance = 1ULL << 32;
+		if(!(t->MCR & 3) || ticks < distance) {
+			tc += (uint32_t)ticks;
+			break;
+		}
+		ticks -= distance;
+		tc = t->MR0;
+		t->IR |= 1;
+		if(t->MCR & 1)
+			set_pending(EXCEPTION(timer_irqs[n]));
+	}
+	t->TC.m_value = tc;
+}
+
+// Time of the next MR0 interrupt
+static unsigned long long timer_next(int n)
+{
+	LPC_TIM_TypeDef *t = &sim_tim[n];
+	if((t->TCR & 3) != 1 || !(t->MCR & 1))
+		return NEVER;
+	uint32_t tc = t->TC.m_value;
+	unsigned long long distance;
+	if(tc == t->MR0)
+		distance = (t->MCR & 2) ? 1ULL + t->MR0 : 1ULL << 32;
+	else
+		distance = (uint32_t)(t->MR0 - tc);
+	return timers[n].last + distance * (t->PR + 1) - timers[n].prescale;
+}
+
+sim_counter::operator uint32_t()
+{
+	sim_advance(SIM_COUNTER_READ_CYCLES);
+	return m_value;
+}
+
+//===========================================================================
+//=============================Ticker========================================
+//===========================================================================
+
+// The Tickers share the TIMER3 interrupt, like the us_ticker of the mbed library
+static Ticker *tickers;
+
+static void ticker_isr()
+{
+	for(Ticker *t = tickers; t; t = t->_link) {
+		if(t->_next <= sim_cycles) {
+			t->_next += t->_period;
+			t->_function.call();
+		}
+	}
+}
+
+static void ticker_update()
+{
+	for(Ticker *t = tickers; t; t = t->_link) {
+		if(t->_next <= sim_cycles)
+			set_pending(EXCEPTION(TIMER3_IRQn));
+	}
+}
+
+static unsigned long long ticker_next()
+{
+	unsigned long long next = NEVER;
+	for(Ticker *t = tickers; t; t = t->_link) {
+		if(t->_next > sim_cycles && t->_next < next)
+			next = t->_next;
+	}
+	return next;
+}
+
+Ticker::Ticker() : _next(NEVER), _period(0), _link(NULL)
+{
+}
+
+Ticker::~Ticker()
+{
+	detach();
+}
+
+void Ticker::setup(unsigned int t)
+{
+	detach();
+	_period = (unsigned long long)t * (SIM_CPU_CLOCK / 1000000);
+	if(_period == 0)
+		_period = 1;
+	_next = sim_cycles + _period;
+	_link = tickers;
+	tickers = this;
+	NVIC_SetVector(TIMER3_IRQn, (uintptr_t)&ticker_isr);
+	NVIC_EnableIRQ(TIMER3_IRQn);
+}
+
+void Ticker::detach()
+{
+	for(Ticker **t = &tickers; *t; t = &(*t)->_link) {
+		if(*t == this) {
+			*t = _link;
+			break;
+		}
+	}
+	_next = NEVER;
+}
+
+//===========================================================================
+//=============================ADC===========================================
+//===========================================================================
+
+// Burst mode only. Each conversion takes 65 ADC clocks, a conversion that is running when BURST is cleared
+// still completes.
+#define ADCR_BURST (1UL << 16)
+#define ADCR_PDN (1UL << 21)
+#define ADDR_DONE (1UL << 31)
+
+static unsigned long long adc_next = NEVER; // end of the running conversion
+static int adc_channel;
+
+static unsigned long adc_conversion_cycles()
+{
+	static const unsigned char pclk_div[4] = { 4, 1, 2, 8 };
+	return 65UL * (((sim_adc.ADCR >> 8) & 0xff) + 1) * pclk_div[(sim_sc.PCLKSEL0 >> 24) & 3];
+}
+
+// The next selected channel after channel, -1 if none is selected
+static int adc_next_channel(int channel)
+{
+	for(int i = 1; i <= 8; i++) {
+		int c = (channel + i) & 7;
+		if(sim_adc.ADCR & (1UL << c))
+			return c;
+	}
+	return -1;
+}
+
+static void adc_update()
+{
+	bool burst = (sim_adc.ADCR & (ADCR_BURST | ADCR_PDN)) == (ADCR_BURST | ADCR_PDN);
+	if(adc_next == NEVER) {
+		if(burst && (adc_channel = adc_next_channel(7)) >= 0)
+			adc_next = sim_cycles + adc_conversion_cycles();
+		return;
+	}
+	while(adc_next <= sim_cycles) {
+		uint32_t result = ((uint32_t)(sim_adc_sample(adc_channel) & 0xfff) << 4) | ADDR_DONE;
+		(&sim_adc.ADDR0)[adc_channel] = result;
+		sim_adc.ADGDR = result | (adc_channel << 24);
+		if(sim_adc.ADINTEN & (1UL << adc_channel))
+			set_pending(EXCEPTION(ADC_IRQn));
+		adc_channel = adc_next_channel(adc_channel);
+		if(!burst || adc_channel < 0) {
+			adc_next = NEVER;
+			break;
+		}
+		adc_next += adc_conversion_cycles();
+	}
+}
+
+static int adc_channel_of(PinName pin)
+{
+	switch(pin) {
+		case p15: return 0;
+		case p16: return 1;
+		case p17: return 2;
+		case p18: return 3;
+		case p19: return 4;
+		case p20: return 5;
+		default: return -1;
+	}
+}
+
+AnalogIn::AnalogIn(PinName pin) : _pin(pin)
+{
+	sim_sc.PCONP |= 1UL << 12;
+	sim_adc.ADCR |= ADCR_PDN;
+}
+
+unsigned short AnalogIn::read_u16()
+{
+	int channel = adc_channel_of(_pin);
+	sim_advance(adc_conversion_cycles());
+	return channel < 0 ? 0 : (unsigned short)((sim_adc_sample(channel) & 0xfff) << 4);
+}
+
+//===========================================================================
+//=============================UART==========================================
+//===========================================================================
+
+#define UART_LSR_THRE (1 << 5)
+#define UART_LSR_TEMT (1 << 6)
+
+// Only UART0 (USBTX/USBRX) is connected to the simulator
+static Serial *uart0;
+static std::string uart0_queue;      // bytes still to be sent to the firmware
+static size_t uart0_queue_pos;
+static std::string uart0_fifo;       // received bytes not read yet
+static size_t uart0_fifo_pos;
+static unsigned long long uart0_next = NEVER;
+static int uart0_baud = 9600;
+
+static unsigned long uart0_byte_cycles()
+{
+	return 10UL * SIM_CPU_CLOCK / uart0_baud; // start bit, 8 data bits, stop bit
+}
+
+static void uart0_isr()
+{
+	if(uart0)
+		uart0->_interrupt();
+}
+
+static void uart0_update()
+{
+	while(uart0_next <= sim_cycles) {
+		uart0_fifo += uart0_queue[uart0_queue_pos++];
+		set_pending(EXCEPTION(UART0_IRQn));
+		if(uart0_queue_pos == uart0_queue.size()) {
+			uart0_queue.clear();
+			uart0_queue_pos = 0;
+			uart0_next = NEVER;
+		}
+		else
+			uart0_next += uart0_byte_cycles();
+	}
+}
+
+void sim_serial_receive(const char *s, size_t n)
+{
+	if(n == 0)
+		return;
+	uart0_queue.append(s, n);
+	if(uart0_next == NEVER)
+		uart0_next = sim_cycles + uart0_byte_cycles();
+}
+
+size_t sim_serial_pending()
+{
+	return uart0_queue.size() - uart0_queue_pos;
+}
+
+sim_thr &sim_thr::operator=(uint32_t c)
+{
+	if(this == &sim_uart[UART_0].THR)
+		sim_serial_sent((char)c);
+	return *this;
+}
+
+Serial::Serial(PinName tx, PinName rx, const char *name)
+{
+	switch(tx) {
+		case p13: _uart = UART_1; break;
+		case p28: _uart = UART_2; break;
+		case p9: _uart = UART_3; break;
+		default: _uart = UART_0; break;
+	}
+	_irq_enabled[RxIrq] = 0;
+	_irq_enabled[TxIrq] = 0;
+	((LPC_UART_TypeDef *)_uart)->LSR = UART_LSR_THRE | UART_LSR_TEMT;
+	if(_uart == UART_0)
+		uart0 = this;
+}
+
+void Serial::baud(int baudrate)
+{
+	if(_uart == UART_0 && baudrate > 0)
+		uart0_baud = baudrate;
+}
+
+int Serial::readable()
+{
+	return _uart == UART_0 && uart0_fifo_pos < uart0_fifo.size();
+}
+
+int Serial::_getc()
+{
+	if(_uart != UART_0)
+		return -1;
+	while(!readable()) {
+		if(sim_serial_pending() == 0)
+			return -1; // nothing will ever come
+		sim_advance(SIM_COUNTER_READ_CYCLES);
+	}
+	int c = (unsigned char)uart0_fifo[uart0_fifo_pos++];
+	if(uart0_fifo_pos == uart0_fifo.size()) {
+		uart0_fifo.clear();
+		uart0_fifo_pos = 0;
+	}
+	return c;
+}
+
+int Serial::_putc(int c)
+{
+	((LPC_UART_TypeDef *)_uart)->THR = c;
+	return c;
+}
+
+int Serial::puts(const char *s)
+{
+	int n = 0;
+	for(; *s; s++, n++)
+		putc(*s);
+	return n;
+}
+
+int Serial::printf(const char *format, ...)
+{
+	char buffer[256];
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	puts(buffer);
+	return n;
+}
+
+void Serial::attach(void (*fptr)(void), IrqType type)
+{
+	if(fptr) {
+		_irq[type].attach(fptr);
+		setup_interrupt(type);
+	}
+}
+
+void Serial::setup_interrupt(IrqType type)
+{
+	_irq_enabled[type] = 1;
+	if(_uart == UART_0) {
+		NVIC_SetVector(UART0_IRQn, (uintptr_t)&uart0_isr);
+		NVIC_EnableIRQ(UART0_IRQn);
+	}
+}
+
+void Serial::remove_interrupt(IrqType type)
+{
+	_irq_enabled[type] = 0;
+}
+
+// The transmitter is always empty, so there is never a transmit interrupt
+void Serial::_interrupt()
+{
+	if(_irq_enabled[RxIrq] && readable())
+		_irq[RxIrq].call();
+}
+
+//===========================================================================
+//=============================GPIO==========================================
+//===========================================================================
+
+static void gpio_write(int port, uint32_t set, uint32_t clear)
+{
+	uint32_t old = sim_gpio[port].FIOPIN;
+	uint32_t pins = (old | set) & ~clear;
+	sim_gpio[port].FIOPIN = pins;
+	if(pins != old)
+		sim_gpio_changed(port, pins ^ old, pins);
+}
+
+// Port of a register, from its distance to the same register of port 0
+static int gpio_port(const void *reg, const void *reg0)
+{
+	return ((const char *)reg - (const char *)reg0) / sizeof(LPC_GPIO_TypeDef);
+}
+
+sim_fioset &sim_fioset::operator=(uint32_t mask)
+{
+	gpio_write(gpio_port(this, &sim_gpio[0].FIOSET), mask, 0);
+	return *this;
+}
+
+sim_fioclr &sim_fioclr::operator=(uint32_t mask)
+{
+	gpio_write(gpio_port(this, &sim_gpio[0].FIOCLR), 0, mask);
+	return *this;
+}
+
+DigitalOut::DigitalOut(PinName pin) : _pin(pin)
+{
+	if(pin != NC)
+		sim_gpio[pin >> 5].FIODIR |= 1UL << (pin & 31);
+}
+
+void DigitalOut::write(int value)
+{
+	if(_pin == NC)
+		return;
+	uint32_t mask = 1UL << (_pin & 31);
+	if(value)
+		gpio_write(_pin >> 5, mask, 0);
+	else
+		gpio_write(_pin >> 5, 0, mask);
+}
+
+int DigitalOut::read()
+{
+	return _pin != NC && (sim_gpio[_pin >> 5].FIOPIN & (1UL << (_pin & 31))) != 0;
+}
+
+int DigitalIn::read()
+{
+	return _pin != NC && (sim_gpio[_pin >> 5].FIOPIN & (1UL << (_pin & 31))) != 0;
+}
+
+PortOut::PortOut(PortName port, int mask) : _port(port), _mask(mask)
+{
+	sim_gpio[port].FIODIR |= _mask;
+}
+
+void PortOut::write(int value)
+{
+	gpio_write(_port, value & _mask, ~value & _mask);
+}
+
+int PortOut::read()
+{
+	return sim_gpio[_port].FIOPIN & _mask;
+}
+
+PwmOut::PwmOut(PinName pin) : _pin(pin), _period_us(20000), _pulsewidth_us(0)
+{
+}
+
+void PwmOut::period_us(int us)
+{
+	_period_us = us;
+}
+
+void PwmOut::pulsewidth_us(int us)
+{
+	if(us > _period_us)
+		us = _period_us;
+	if(us == _pulsewidth_us)
+		return;
+	_pulsewidth_us = us;
+	sim_pwm_changed(_pin, _pulsewidth_us, _period_us);
+}
+
+void PwmOut::write(float value)
+{
+	pulsewidth_us((int)(value * _period_us + 0.5f));
+}
+
+float PwmOut::read()
+{
+	return _period_us ? (float)_pulsewidth_us / _period_us : 0;
+}
+
+//===========================================================================
+//=============================flash=========================================
+//===========================================================================
+
+// Status codes of the IAP
+#define IAP_CMD_SUCCESS 0
+#define IAP_INVALID_COMMAND 1
+#define IAP_SRC_ADDR_ERROR 2
+#define IAP_DST_ADDR_ERROR 3
+#define IAP_COUNT_ERROR 6
+#define IAP_INVALID_SECTOR 7
+#define IAP_SECTOR_NOT_BLANK 8
+#define IAP_SECTOR_NOT_PREPARED 9
+
+// Sectors 0-15 have 4K, 16-29 32K
+#define FLASH_SECTORS 30
+#define FLASH_ERASE_CYCLES (SIM_CPU_CLOCK / 10)       // 100 ms per sector
+#define FLASH_WRITE_CYCLES (SIM_CPU_CLOCK / 1000)     // 1 ms per 256 bytes
+
+uint8_t sim_flash[SIM_FLASH_SIZE];
+static uint32_t flash_prepared;   // one bit per sector
+static const char *flash_path;
+
+// Blank until sim_flash_file() loads an image
+static struct flash_init {
+	flash_init() { memset(sim_flash, 0xFF, sizeof(sim_flash)); }
+} flash_init;
+
+// sector_start(FLASH_SECTORS) is the end of the flash
+static uint32_t sector_start(int sector)
+{
+	return sector < 16 ? sector * 0x1000 : 0x10000 + (sector - 16) * 0x8000;
+}
+
+static int sector_of(uint32_t address)
+{
+	return address < 0x10000 ? address / 0x1000 : 16 + (address - 0x10000) / 0x8000;
+}
+
+static void flash_save()
+{
+	if(flash_path == NULL)
+		return;
+	FILE *f = fopen(flash_path, "wb");
+	if(f == NULL || fwrite(sim_flash, 1, sizeof(sim_flash), f) != sizeof(sim_flash)) {
+		perror(flash_path);
+		exit(1);
+	}
+	fclose(f);
+}
+
+void sim_flash_file(const char *path)
+{
+	flash_path = path;
+	FILE *f = fopen(path, "rb");
+	if(f == NULL)
+		return; // blank flash, the file is created by the first write
+	if(fread(sim_flash, 1, sizeof(sim_flash), f) != sizeof(sim_flash)) {
+		fprintf(stderr, "%s: not a flash image of %d bytes\n", path, SIM_FLASH_SIZE);
+		exit(1);
+	}
+	fclose(f);
+}
+
+// The sectors from start to end, or IAP_INVALID_SECTOR
+static uint32_t sector_range(uint32_t start, uint32_t end, uint32_t *mask)
+{
+	if(start > end || end >= FLASH_SECTORS)
+		return IAP_INVALID_SECTOR;
+	*mask = (uint32_t)((2ULL << end) - (1ULL << start));
+	return IAP_CMD_SUCCESS;
+}
+
+void sim_iap(uintptr_t *command, uintptr_t *result)
+{
+	uint32_t mask = 0;
+	switch(command[0]) {
+		case 50: // prepare sectors for write
+			result[0] = sector_range(command[1], command[2], &mask);
+			flash_prepared |= mask;
+			break;
+		case 51: { // copy RAM to flash
+			uint32_t dst = command[1], count = command[3];
+			const uint8_t *src = (const uint8_t *)command[2];
+			if(dst % 256 != 0 || dst >= SIM_FLASH_SIZE)
+				result[0] = IAP_DST_ADDR_ERROR;
+			else if((uintptr_t)src % 4 != 0)
+				result[0] = IAP_SRC_ADDR_ERROR;
+			else if((count != 256 && count != 512 && count != 1024 && count != 4096) || dst + count > SIM_FLASH_SIZE)
+				result[0] = IAP_COUNT_ERROR;
+			else if(sector_range(sector_of(dst), sector_of(dst + count - 1), &mask) != IAP_CMD_SUCCESS ||
+			        (flash_prepared & mask) != mask)
+				result[0] = IAP_SECTOR_NOT_PREPARED;
+			else {
+				for(uint32_t i = 0; i < count; i++)
+					sim_flash[dst + i] &= src[i];
+				flash_prepared = 0;
+				sim_advance(count / 256 * FLASH_WRITE_CYCLES);
+				flash_save();
+				sim_flash_changed();
+				result[0] = IAP_CMD_SUCCESS;
+			}
+			break;
+		}
+		case 52: // erase sectors
+			result[0] = sector_range(command[1], command[2], &mask);
+			if(result[0] != IAP_CMD_SUCCESS)
+				break;
+			if((flash_prepared & mask) != mask) {
+				result[0] = IAP_SECTOR_NOT_PREPARED;
+				break;
+			}
+			for(uint32_t sector = command[1]; sector <= command[2]; sector++) {
+				memset(sim_flash + sector_start(sector), 0xFF, sector_start(sector + 1) - sector_start(sector));
+				sim_advance(FLASH_ERASE_CYCLES);
+			}
+			flash_prepared = 0;
+			flash_save();
+			sim_flash_changed();
+			break;
+		case 53: // blank check sectors
+			result[0] = sector_range(command[1], command[2], &mask);
+			if(result[0] != IAP_CMD_SUCCESS)
+				break;
+			for(uint32_t a = sector_start(command[1]); a < sector_start(command[2] + 1); a += 4) {
+				uint32_t word;
+				memcpy(&word, sim_flash + a, 4);
+				if(word != 0xFFFFFFFF) {
+					result[0] = IAP_SECTOR_NOT_BLANK;
+					result[1] = a;
+					result[2] = word;
+					break;
+				}
+			}
+			break;
+		default:
+			result[0] = IAP_INVALID_COMMAND;
+	}
+}
+
+//===========================================================================
+//=============================time==========================================
+//===========================================================================
+
+// Bring all peripherals to sim_cycles and raise the interrupts that became due
+static void update()
+{
+	for(int n = 0; n < 4; n++)
+		timer_update(n);
+	ticker_update();
+	adc_update();
+	uart0_update();
+}
+
+static unsigned long long next_event()
+{
+	unsigned long long next = ticker_next();
+	for(int n = 0; n < 4; n++) {
+		unsigned long long t = timer_next(n);
+		if(t < next) next = t;
+	}
+	if(adc_next < next) next = adc_next;
+	if(uart0_next < next) next = uart0_next;
+	return next;
+}
+
+void sim_advance(unsigned long cycles)
+{
+	unsigned long long target = sim_cycles + cycles;
+	for(;;) {
+		update();
+		unsigned long long updated = sim_cycles;
+		dispatch();
+		if(sim_cycles != updated)
+			continue; // the interrupts took time, catch up with it first
+		if(sim_cycles >= target)
+			break;
+		unsigned long long next = next_event();
+		sim_cycles = next < target ? next : target;
+	}
+	if(!sim_in_interrupt())
+		sim_poll();
+}
+
+void wait(float s)
+{
+	sim_advance((unsigned long)(s * SIM_CPU_CLOCK));
+}
+
+void wait_ms(int ms)
+{
+	sim_advance((unsigned long)ms * (SIM_CPU_CLOCK / 1000));
+}
+
+void wait_us(int us)
+{
+	sim_advance((unsigned long)us * (SIM_CPU_CLOCK / 1000000));
+}
+
+void mbed_interface_disconnect()
+{
+}
+
+void Timer::start()
+{
+	if(!_running) {
+		_start = sim_cycles;
+		_running = 1;
+	}
+}
+
+void Timer::stop()
+{
+	if(_running) {
+		_time += sim_cycles - _start;
+		_running = 0;
+	}
+}
+
+void Timer::reset()
+{
+	_start = sim_cycles;
+	_time = 0;
+}
+
+int Timer::read_us()
+{
+	sim_advance(SIM_COUNTER_READ_CYCLES);
+	unsigned long long t = _time;
+	if(_running)
+		t += sim_cycles - _start;
+	return (int)(t / (SIM_CPU_CLOCK / 1000000));
+}
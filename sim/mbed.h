@@ -0,0 +1,571 @@
+/*
+  mbed.h - the parts of the mbed library and the LPC1768 registers used by the firmware, simulated on the host
+  Part of the Marlin simulator
+
+  Built with the simulator instead of the mbed headers in export/. The peripherals the firmware programs
+  directly (TIMER0-1, ADC, GPIO, UART, NVIC, PendSV) are plain structs here. Simulated time passes when a
+  timer counter is read or wait() is called, see sim.h. The GPDMA registers only exist so SerialBuffered
+  compiles, nothing is transferred.
+
+  The NVIC vectors and the DMA addresses are uintptr_t instead of the uint32_t of the target, so they hold the
+  addresses of the host. The firmware casts its pointers to uintptr_t, which is uint32_t on the target.
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_MBED_H
+#define SIM_MBED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+//===========================================================================
+//=============================pins==========================================
+//===========================================================================
+
+// Numbered port * 32 + bit, unlike the target where P0_0 is the address of GPIO0. PIN_PORT() and PIN_MASK()
+// in fastio.h only use the difference to P0_0.
+enum PinName {
+	P0_0 = 0, P0_1, P0_2, P0_3, P0_4, P0_5, P0_6, P0_7
+	, P0_8, P0_9, P0_10, P0_11, P0_12, P0_13, P0_14, P0_15
+	, P0_16, P0_17, P0_18, P0_19, P0_20, P0_21, P0_22, P0_23
+	, P0_24, P0_25, P0_26, P0_27, P0_28, P0_29, P0_30, P0_31
+	, P1_0, P1_1, P1_2, P1_3, P1_4, P1_5, P1_6, P1_7
+	, P1_8, P1_9, P1_10, P1_11, P1_12, P1_13, P1_14, P1_15
+	, P1_16, P1_17, P1_18, P1_19, P1_20, P1_21, P1_22, P1_23
+	, P1_24, P1_25, P1_26, P1_27, P1_28, P1_29, P1_30, P1_31
+	, P2_0, P2_1, P2_2, P2_3, P2_4, P2_5, P2_6, P2_7
+	, P2_8, P2_9, P2_10, P2_11, P2_12, P2_13, P2_14, P2_15
+	, P2_16, P2_17, P2_18, P2_19, P2_20, P2_21, P2_22, P2_23
+	, P2_24, P2_25, P2_26, P2_27, P2_28, P2_29, P2_30, P2_31
+	, P3_0, P3_1, P3_2, P3_3, P3_4, P3_5, P3_6, P3_7
+	, P3_8, P3_9, P3_10, P3_11, P3_12, P3_13, P3_14, P3_15
+	, P3_16, P3_17, P3_18, P3_19, P3_20, P3_21, P3_22, P3_23
+	, P3_24, P3_25, P3_26, P3_27, P3_28, P3_29, P3_30, P3_31
+	, P4_0, P4_1, P4_2, P4_3, P4_4, P4_5, P4_6, P4_7
+	, P4_8, P4_9, P4_10, P4_11, P4_12, P4_13, P4_14, P4_15
+	, P4_16, P4_17, P4_18, P4_19, P4_20, P4_21, P4_22, P4_23
+	, P4_24, P4_25, P4_26, P4_27, P4_28, P4_29, P4_30, P4_31
+
+	// mbed DIP Pin Names
+	, p5 = P0_9
+	, p6 = P0_8
+	, p7 = P0_7
+	, p8 = P0_6
+	, p9 = P0_0
+	, p10 = P0_1
+	, p11 = P0_18
+	, p12 = P0_17
+	, p13 = P0_15
+	, p14 = P0_16
+	, p15 = P0_23
+	, p16 = P0_24
+	, p17 = P0_25
+	, p18 = P0_26
+	, p19 = P1_30
+	, p20 = P1_31
+	, p21 = P2_5
+	, p22 = P2_4
+	, p23 = P2_3
+	, p24 = P2_2
+	, p25 = P2_1
+	, p26 = P2_0
+	, p27 = P0_11
+	, p28 = P0_10
+	, p29 = P0_5
+	, p30 = P0_4
+
+	// Other mbed Pin Names
+	, LED1 = P1_18
+	, LED2 = P1_20
+	, LED3 = P1_21
+	, LED4 = P1_23
+	, USBTX = P0_2
+	, USBRX = P0_3
+
+	// Not connected
+	, NC = -1
+};
+
+enum PortName {
+	Port0 = 0
+	, Port1 = 1
+	, Port2 = 2
+	, Port3 = 3
+	, Port4 = 4
+};
+
+//===========================================================================
+//=============================core==========================================
+//===========================================================================
+
+typedef enum IRQn {
+	PendSV_IRQn = -2,
+	TIMER0_IRQn = 1,
+	TIMER1_IRQn = 2,
+	TIMER2_IRQn = 3,
+	TIMER3_IRQn = 4,
+	UART0_IRQn = 5,
+	UART1_IRQn = 6,
+	UART2_IRQn = 7,
+	UART3_IRQn = 8,
+	ADC_IRQn = 22,
+	DMA_IRQn = 26
+} IRQn_Type;
+
+#define __NVIC_PRIO_BITS 5
+
+void NVIC_SetVector(IRQn_Type irq, uintptr_t vector);
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority);
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+
+uint32_t __get_PRIMASK();
+void __set_PRIMASK(uint32_t primask);
+static inline void __disable_irq() { __set_PRIMASK(1); }
+static inline void __enable_irq() { __set_PRIMASK(0); }
+static inline void __DMB() { __sync_synchronize(); }
+static inline void __NOP() {}
+static inline uint8_t __CLZ(uint32_t value) { return value ? __builtin_clz(value) : 32; }
+
+// Writing PENDSVSET requests PendSV at once, like on the target
+class sim_icsr {
+public:
+	sim_icsr &operator=(uint32_t value);
+	operator uint32_t() const { return 0; }
+private:
+	uint32_t m_value;
+};
+
+typedef struct {
+	volatile uint32_t CPUID;
+	sim_icsr ICSR;
+	volatile uint32_t VTOR;
+	volatile uint32_t AIRCR;
+	volatile uint32_t SCR;
+	volatile uint32_t CCR;
+} SCB_Type;
+
+#define SCB_ICSR_PENDSVSET_Msk (1UL << 28)
+
+typedef struct {
+	volatile uint32_t DHCSR;
+	volatile uint32_t DCRSR;
+	volatile uint32_t DCRDR;
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+
+// DWT cycle counter, counts simulated CPU cycles
+class sim_cyccnt {
+public:
+	sim_cyccnt &operator=(uint32_t value);
+	operator uint32_t() const;
+private:
+	uint32_t m_offset;
+};
+
+extern SCB_Type sim_scb;
+extern CoreDebug_Type sim_coredebug;
+extern volatile uint32_t sim_dwt_ctrl;
+extern sim_cyccnt sim_dwt_cyccnt;
+
+#define SCB (&sim_scb)
+#define CoreDebug (&sim_coredebug)
+#define DWT_CTRL sim_dwt_ctrl
+#define DWT_CYCCNT sim_dwt_cyccnt
+
+extern uint32_t SystemCoreClock;
+
+//===========================================================================
+//=============================peripherals===================================
+//===========================================================================
+
+// Timer counter. Reading it lets the simulated time pass, so busy waits on it finish.
+class sim_counter {
+public:
+	operator uint32_t();
+	uint32_t m_value;
+};
+
+typedef struct {
+	volatile uint32_t IR;
+	volatile uint32_t TCR;
+	sim_counter TC;
+	volatile uint32_t PR;
+	volatile uint32_t PC;
+	volatile uint32_t MCR;
+	volatile uint32_t MR0;
+	volatile uint32_t MR1;
+	volatile uint32_t MR2;
+	volatile uint32_t MR3;
+	volatile uint32_t CCR;
+	volatile uint32_t CR0;
+	volatile uint32_t CR1;
+	volatile uint32_t EMR;
+	volatile uint32_t CTCR;
+} LPC_TIM_TypeDef;
+
+typedef struct {
+	volatile uint32_t PCONP;
+	volatile uint32_t PCLKSEL0;
+	volatile uint32_t PCLKSEL1;
+	volatile uint32_t DMAREQSEL;
+} LPC_SC_TypeDef;
+
+typedef struct {
+	volatile uint32_t ADCR;
+	volatile uint32_t ADGDR;
+	volatile uint32_t ADINTEN;
+	volatile uint32_t ADDR0;
+	volatile uint32_t ADDR1;
+	volatile uint32_t ADDR2;
+	volatile uint32_t ADDR3;
+	volatile uint32_t ADDR4;
+	volatile uint32_t ADDR5;
+	volatile uint32_t ADDR6;
+	volatile uint32_t ADDR7;
+	volatile uint32_t ADSTAT;
+	volatile uint32_t ADTRM;
+} LPC_ADC_TypeDef;
+
+// FIOSET and FIOCLR change FIOPIN of their port and report the change to the simulator
+class sim_fioset {
+public:
+	sim_fioset &operator=(uint32_t mask);
+	operator uint32_t() const { return 0; }
+private:
+	uint32_t m_value;
+};
+
+class sim_fioclr {
+public:
+	sim_fioclr &operator=(uint32_t mask);
+	operator uint32_t() const { return 0; }
+private:
+	uint32_t m_value;
+};
+
+typedef struct {
+	volatile uint32_t FIODIR;
+	uint32_t RESERVED0[3];
+	volatile uint32_t FIOMASK;
+	volatile uint32_t FIOPIN;
+	sim_fioset FIOSET;
+	sim_fioclr FIOCLR;
+} LPC_GPIO_TypeDef;
+
+// Bytes written to THR are sent at once, LSR always reports an empty transmitter
+class sim_thr {
+public:
+	sim_thr &operator=(uint32_t c);
+	operator uint32_t() const { return 0; }
+private:
+	uint32_t m_value;
+};
+
+typedef struct {
+	volatile uint8_t RBR;
+	sim_thr THR;
+	volatile uint32_t IER;
+	volatile uint32_t IIR;
+	volatile uint32_t FCR;
+	volatile uint32_t LCR;
+	volatile uint32_t LSR;
+} LPC_UART_TypeDef;
+
+typedef struct {
+	volatile uint32_t DMACIntStat;
+	volatile uint32_t DMACIntTCStat;
+	volatile uint32_t DMACIntTCClear;
+	volatile uint32_t DMACIntErrStat;
+	volatile uint32_t DMACIntErrClr;
+	volatile uint32_t DMACRawIntTCStat;
+	volatile uint32_t DMACRawIntErrStat;
+	volatile uint32_t DMACEnbldChns;
+	volatile uint32_t DMACSoftBReq;
+	volatile uint32_t DMACSoftSReq;
+	volatile uint32_t DMACSoftLBReq;
+	volatile uint32_t DMACSoftLSReq;
+	volatile uint32_t DMACConfig;
+	volatile uint32_t DMACSync;
+} LPC_GPDMA_TypeDef;
+
+// The addresses take the 0x20 bytes of a channel with the reserved words of the target on a 64 bit host
+typedef struct {
+	volatile uintptr_t DMACCSrcAddr;
+	volatile uintptr_t DMACCDestAddr;
+	volatile uintptr_t DMACCLLI;
+	volatile uint32_t DMACCControl;
+	volatile uint32_t DMACCConfig;
+} LPC_GPDMACH_TypeDef;
+
+extern LPC_TIM_TypeDef sim_tim[4];
+extern LPC_SC_TypeDef sim_sc;
+extern LPC_ADC_TypeDef sim_adc;
+extern LPC_GPIO_TypeDef sim_gpio[5];
+extern LPC_UART_TypeDef sim_uart[4];
+extern LPC_GPDMA_TypeDef sim_gpdma;
+extern LPC_GPDMACH_TypeDef sim_gpdmach[8];
+
+#define LPC_TIM0 (&sim_tim[0])
+#define LPC_TIM1 (&sim_tim[1])
+#define LPC_TIM2 (&sim_tim[2])
+#define LPC_TIM3 (&sim_tim[3])
+#define LPC_SC (&sim_sc)
+#define LPC_ADC (&sim_adc)
+#define LPC_GPDMA (&sim_gpdma)
+#define LPC_GPIO0_BASE ((uintptr_t)sim_gpio)
+#define LPC_GPDMACH0_BASE ((uintptr_t)sim_gpdmach)
+
+//===========================================================================
+//=============================flash=========================================
+//===========================================================================
+
+// The 512K of flash as the IAP sees them. Only what the firmware writes is in there, not its code. Blank flash
+// reads 0xFF, and writing can only clear bits.
+#define SIM_FLASH_SIZE (512 * 1024)
+extern uint8_t sim_flash[SIM_FLASH_SIZE];
+
+// IAP entry of the boot ROM. Prepare (50), copy RAM to flash (51), erase (52) and blank check (53) of sectors
+// are simulated with the checks and the durations of the target. The words are pointer-wide, like the vectors.
+void sim_iap(uintptr_t *command, uintptr_t *result);
+
+#define IAP_ENTRY sim_iap
+#define FLASH_ADDRESS(address) ((const uint32_t *)(sim_flash + (address)))
+
+//===========================================================================
+//=============================mbed library==================================
+//===========================================================================
+
+void wait(float s);
+void wait_ms(int ms);
+void wait_us(int us);
+void mbed_interface_disconnect();
+
+class FunctionPointer {
+public:
+	FunctionPointer(void (*function)(void) = 0) { attach(function); }
+
+	void attach(void (*function)(void) = 0) {
+		_function = function;
+		_object = 0;
+	}
+
+	template<typename T>
+	void attach(T *object, void (T::*member)(void)) {
+		_object = static_cast<void*>(object);
+		memcpy(_member, (char*)&member, sizeof(member));
+		_membercaller = &FunctionPointer::membercaller<T>;
+		_function = 0;
+	}
+
+	void call() {
+		if(_function)
+			_function();
+		else if(_object)
+			_membercaller(_object, _member);
+	}
+
+private:
+	template<typename T>
+	static void membercaller(void *object, char *member) {
+		T* o = static_cast<T*>(object);
+		void (T::*m)(void);
+		memcpy((char*)&m, member, sizeof(m));
+		(o->*m)();
+	}
+
+	void (*_function)(void);
+	void *_object;
+	char _member[16];
+	void (*_membercaller)(void*, char*);
+};
+
+class DigitalOut {
+public:
+	DigitalOut(PinName pin);
+	void write(int value);
+	int read();
+	DigitalOut &operator=(int value) { write(value); return *this; }
+	operator int() { return read(); }
+private:
+	PinName _pin;
+};
+
+class DigitalIn {
+public:
+	DigitalIn(PinName pin) : _pin(pin) {}
+	int read();
+	operator int() { return read(); }
+private:
+	PinName _pin;
+};
+
+class PortOut {
+public:
+	PortOut(PortName port, int mask = 0xFFFFFFFF);
+	void write(int value);
+	int read();
+	PortOut &operator=(int value) { write(value); return *this; }
+	operator int() { return read(); }
+private:
+	PortName _port;
+	uint32_t _mask;
+};
+
+class PwmOut {
+public:
+	PwmOut(PinName pin);
+	void write(float value);
+	float read();
+	void period(float seconds) { period_us((int)(seconds * 1000000)); }
+	void period_ms(int ms) { period_us(ms * 1000); }
+	void period_us(int us);
+	void pulsewidth(float seconds) { pulsewidth_us((int)(seconds * 1000000)); }
+	void pulsewidth_ms(int ms) { pulsewidth_us(ms * 1000); }
+	void pulsewidth_us(int us);
+	PwmOut &operator=(float value) { write(value); return *this; }
+	operator float() { return read(); }
+private:
+	PinName _pin;
+	int _period_us;
+	int _pulsewidth_us;
+};
+
+class AnalogIn {
+public:
+	AnalogIn(PinName pin);
+	float read() { return read_u16() / 65535.0f; }
+	unsigned short read_u16();
+	operator float() { return read(); }
+private:
+	PinName _pin;
+};
+
+// Calls a function periodically from the TIMER3 interrupt
+class Ticker {
+public:
+	Ticker();
+	~Ticker();
+	void attach(void (*fptr)(void), float t) { attach_us(fptr, (unsigned int)(t * 1000000.0f)); }
+	template<typename T>
+	void attach(T *tptr, void (T::*mptr)(void), float t) { attach_us(tptr, mptr, (unsigned int)(t * 1000000.0f)); }
+	void attach_us(void (*fptr)(void), unsigned int t) { _function.attach(fptr); setup(t); }
+	template<typename T>
+	void attach_us(T *tptr, void (T::*mptr)(void), unsigned int t) { _function.attach(tptr, mptr); setup(t); }
+	void detach();
+
+	// Used by the simulator
+	unsigned long long _next;
+	unsigned long long _period;
+	FunctionPointer _function;
+	Ticker *_link;
+private:
+	void setup(unsigned int t);
+};
+
+class Timer {
+public:
+	Timer() : _running(0), _start(0), _time(0) {}
+	void start();
+	void stop();
+	void reset();
+	float read() { return read_us() / 1000000.0f; }
+	int read_ms() { return read_us() / 1000; }
+	int read_us();
+	operator float() { return read(); }
+private:
+	int _running;
+	unsigned long long _start;
+	unsigned long long _time;
+};
+
+enum UARTIndex {
+	UART_0 = 0
+	, UART_1
+	, UART_2
+	, UART_3
+};
+
+// On the target the UART name is the address of its registers. Here it converts to the index for switch()
+// and to the register struct for casts.
+class UARTName {
+public:
+	UARTName(UARTIndex index = UART_0) : _index(index) {}
+	operator UARTIndex() const { return _index; }
+	operator LPC_UART_TypeDef *() const { return &sim_uart[_index]; }
+private:
+	UARTIndex _index;
+};
+
+class Serial {
+public:
+	Serial(PinName tx, PinName rx, const char *name = NULL);
+	virtual ~Serial() {}
+
+	enum Parity {
+		None = 0
+		, Odd
+		, Even
+		, Forced1
+		, Forced0
+	};
+
+	enum IrqType {
+		RxIrq = 0
+		, TxIrq
+	};
+
+	void baud(int baudrate);
+	void format(int bits = 8, Parity parity = Serial::None, int stop_bits = 1) {}
+	int putc(int c) { return _putc(c); }
+	int getc() { return _getc(); }
+	int puts(const char *s);
+	int printf(const char *format, ...);
+	int readable();
+	int writeable() { return 1; }
+
+	void attach(void (*fptr)(void), IrqType type = RxIrq);
+	template<typename T>
+	void attach(T* tptr, void (T::*mptr)(void), IrqType type = RxIrq) {
+		if((mptr != NULL) && (tptr != NULL)) {
+			_irq[type].attach(tptr, mptr);
+			setup_interrupt(type);
+		}
+	}
+
+	// Called by the simulator from the UART interrupt
+	void _interrupt();
+
+protected:
+	void setup_interrupt(IrqType type);
+	void remove_interrupt(IrqType type);
+
+	virtual int _getc();
+	virtual int _putc(int c);
+
+	UARTName _uart;
+	FunctionPointer _irq[2];
+	int _irq_enabled[2];
+};
+
+using namespace std;
+
+#endif
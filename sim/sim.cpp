@@ -0,0 +1,353 @@
+/*
+  sim.cpp - runs the firmware on the host against the simulated LPC1768
+  Part of the Marlin simulator
+
+  Usage: mbed_marlin_sim [-o trace] [-t seconds] [-q] [-f flash] [file.gcode]
+
+  The G-code comes from the file, or from stdin. It is sent over the simulated UART0 like a host does:
+  one line, then wait for its "ok". Comments and empty lines are left out, the firmware doesn't answer them.
+  What the firmware sends back goes to stderr, -q drops it.
+
+  The trace, on stdout or in the -o file, has one line per event:
+
+    <microseconds since reset> <signal> <value>
+
+  X_STEP, X_DIR, X_ENABLE and the same for Y, Z and E are the levels of the stepper pins. HEATER_0, HEATER_BED
+  and FAN are the duty cycles of the hardware PWM outputs, or the levels of soft PWM pins. TEMP_0 and TEMP_BED
+  are the simulated temperatures in degC, once per second.
+
+  The hot end and the bed are simple thermal masses with a heater and a loss to ambient. Their temperature is
+  turned into ADC samples with the thermistor tables of the firmware.
+
+  The simulation ends with exit status 0 once the input is done and all moves have been executed, 1 if the
+  -t time limit (default one hour) runs out first, and 2 if the firmware kills itself.
+
+  The flash starts blank, or with the image in the -f file, which then keeps what the firmware writes (M500) for
+  the next run.
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <unistd.h>
+#include "mbed.h"
+#include "sim.h"
+#include "marlin/Marlin.h"
+#include "marlin/planner.h"
+#include "marlin/language.h"
+
+#ifdef SERIAL_RX_DMA_CHANNEL
+#error "The simulator has no GPDMA, undefine SERIAL_RX_DMA_CHANNEL"
+#endif
+
+// main() of main.cpp, renamed by the Makefile
+int firmware_main();
+
+#define AMBIENT_TEMP 25.0
+
+static FILE *input;
+static FILE *trace;
+static bool quiet;
+static bool input_done;
+static int lines_in_flight;
+static unsigned long long max_cycles = 3600ULL * SIM_CPU_CLOCK;
+static unsigned long long next_temp_trace;
+
+static std::string serial_line;
+
+//===========================================================================
+//=============================trace=========================================
+//===========================================================================
+
+static void trace_time()
+{
+	unsigned long long us = sim_cycles / (SIM_CPU_CLOCK / 1000000);
+	unsigned int ns = (sim_cycles % (SIM_CPU_CLOCK / 1000000)) * 1000 / (SIM_CPU_CLOCK / 1000000);
+	fprintf(trace, "%llu.%03u ", us, ns);
+}
+
+static const struct {
+	int pin;
+	const char *name;
+} traced_pins[] = {
+	{ X_STEP_PIN, "X_STEP" }, { X_DIR_PIN, "X_DIR" }, { X_ENABLE_PIN, "X_ENABLE" },
+	{ Y_STEP_PIN, "Y_STEP" }, { Y_DIR_PIN, "Y_DIR" }, { Y_ENABLE_PIN, "Y_ENABLE" },
+	{ Z_STEP_PIN, "Z_STEP" }, { Z_DIR_PIN, "Z_DIR" }, { Z_ENABLE_PIN, "Z_ENABLE" },
+	{ E_STEP_PIN, "E_STEP" }, { E_DIR_PIN, "E_DIR" }, { E_ENABLE_PIN, "E_ENABLE" },
+	{ HEATER_0_PIN, "HEATER_0" }, { HEATER_BED_PIN, "HEATER_BED" }, { FAN_PIN, "FAN" }
+};
+#define TRACED_PINS (sizeof(traced_pins) / sizeof(traced_pins[0]))
+
+static const char *pin_name(int pin)
+{
+	for(unsigned int i = 0; i < TRACED_PINS; i++) {
+		if(traced_pins[i].pin == pin)
+			return traced_pins[i].name;
+	}
+	return NULL;
+}
+
+//===========================================================================
+//=============================thermal model=================================
+//===========================================================================
+
+// The tables are the ones analog2temp() and analog2tempBed() use
+static struct heater_t {
+	const char *name;
+	int heater_pin;
+	int sensor_channel;
+	const short (*table)[2];
+	int table_len;
+	double watts;             // heater power
+	double capacity;          // J/K
+	double loss;              // W/K to ambient
+	double duty;              // 0..1
+	double temp;              // degC
+	unsigned long long time;  // sim_cycles of temp
+} heaters[] = {
+	{ "TEMP_0", HEATER_0_PIN, -1, temptable, NUMTEMPS, 40, 16, 0.12, 0, AMBIENT_TEMP, 0 },
+	{ "TEMP_BED", HEATER_BED_PIN, -1, bedtemptable, BNUMTEMPS, 200, 250, 1.2, 0, AMBIENT_TEMP, 0 }
+};
+#define HEATERS (sizeof(heaters) / sizeof(heaters[0]))
+
+static int adc_channel_of(int pin)
+{
+	switch(pin) {
+		case p15: return 0;
+		case p16: return 1;
+		case p17: return 2;
+		case p18: return 3;
+		case p19: return 4;
+		case p20: return 5;
+		default: return -1;
+	}
+}
+
+// Bring the temperature up to now. The duty cycle has been constant since the last update, so this is exact.
+static void heater_update(heater_t *h)
+{
+	double dt = (double)(sim_cycles - h->time) / SIM_CPU_CLOCK;
+	double settled = AMBIENT_TEMP + h->watts * h->duty / h->loss;
+	h->temp = settled + (h->temp - settled) * exp(-h->loss / h->capacity * dt);
+	h->time = sim_cycles;
+}
+
+static heater_t *heater_of_pin(int pin)
+{
+	for(unsigned int i = 0; i < HEATERS; i++) {
+		if(heaters[i].heater_pin == pin)
+			return &heaters[i];
+	}
+	return NULL;
+}
+
+// 12 bit ADC sample for a temperature: the inverse of analog2temp_thermistor(). The tables are in 10 bit
+// ADC units with falling temperatures.
+static int heater_sample(const heater_t *h)
+{
+	double adc;
+	if(h->table == NULL || h->table_len < 2)
+		return 0;
+	if(h->temp >= h->table[0][1])
+		adc = h->table[0][0];
+	else {
+		adc = h->table[h->table_len - 1][0];
+		for(int i = 1; i < h->table_len; i++) {
+			if(h->temp >= h->table[i][1]) {
+				double a0 = h->table[i - 1][0], t0 = h->table[i - 1][1];
+				double a1 = h->table[i][0], t1 = h->table[i][1];
+				adc = a0 + (h->temp - t0) * (a1 - a0) / (t1 - t0);
+				break;
+			}
+		}
+	}
+	return (int)(adc * 4 + 0.5);
+}
+
+int sim_adc_sample(int channel)
+{
+	for(unsigned int i = 0; i < HEATERS; i++) {
+		if(heaters[i].sensor_channel == channel) {
+			heater_update(&heaters[i]);
+			return heater_sample(&heaters[i]);
+		}
+	}
+	return 0;
+}
+
+//===========================================================================
+//=============================hardware events===============================
+//===========================================================================
+
+void sim_gpio_changed(int port, uint32_t changed, uint32_t pins)
+{
+	if(trace == NULL)
+		return; // static constructors, before main()
+	for(int bit = 0; bit < 32; bit++) {
+		if(!(changed & (1UL << bit)))
+			continue;
+		int pin = P0_0 + port * 32 + bit;
+		const char *name = pin_name(pin);
+		if(name == NULL)
+			continue;
+		int level = (pins >> bit) & 1;
+		heater_t *h = heater_of_pin(pin);
+		if(h) {
+			heater_update(h);
+			h->duty = level;
+		}
+		trace_time();
+		fprintf(trace, "%s %d\n", name, level);
+	}
+}
+
+void sim_pwm_changed(PinName pin, int pulsewidth_us, int period_us)
+{
+	if(trace == NULL)
+		return;
+	double duty = period_us > 0 ? (double)pulsewidth_us / period_us : 0;
+	heater_t *h = heater_of_pin(pin);
+	if(h) {
+		heater_update(h);
+		h->duty = duty;
+	}
+	const char *name = pin_name(pin);
+	if(name) {
+		trace_time();
+		fprintf(trace, "%s %.3f\n", name, duty);
+	}
+}
+
+void sim_flash_changed()
+{
+	// -f keeps the flash in its file
+}
+
+static void finish(int status)
+{
+	fflush(trace);
+	if(!serial_line.empty() && !quiet)
+		fprintf(stderr, "%s\n", serial_line.c_str());
+	exit(status);
+}
+
+void sim_serial_sent(char c)
+{
+	if(c == '\r')
+		return;
+	if(c != '\n') {
+		serial_line += c;
+		return;
+	}
+	if(!quiet)
+		fprintf(stderr, "%s\n", serial_line.c_str());
+	if(serial_line.compare(0, 2, "ok") == 0 && lines_in_flight > 0)
+		lines_in_flight--;
+	bool killed = serial_line.find(MSG_ERR_KILLED) != std::string::npos;
+	serial_line.clear();
+	if(killed)
+		finish(2);
+}
+
+// Send the next line of G-code that isn't empty once the last one has been answered
+static void send_line()
+{
+	char line[256];
+	while(!input_done && lines_in_flight == 0) {
+		if(fgets(line, sizeof(line), input) == NULL) {
+			// G0-G3 are answered as soon as they arrive, the M400 is answered once all moves are done
+			input_done = true;
+			sim_serial_receive("M400\n", 5);
+			lines_in_flight++;
+			break;
+		}
+		char *end = strchr(line, ';');
+		if(end == NULL)
+			end = line + strlen(line);
+		while(end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+			end--;
+		char *start = line;
+		while(start < end && (*start == ' ' || *start == '\t'))
+			start++;
+		if(start == end)
+			continue;
+		*end++ = '\n';
+		sim_serial_receive(start, end - start);
+		lines_in_flight++;
+	}
+}
+
+void sim_poll()
+{
+	send_line();
+
+	if(sim_cycles >= next_temp_trace) {
+		for(unsigned int i = 0; i < HEATERS; i++) {
+			heater_update(&heaters[i]);
+			trace_time();
+			fprintf(trace, "%s %.1f\n", heaters[i].name, heaters[i].temp);
+		}
+		next_temp_trace += SIM_CPU_CLOCK;
+	}
+
+	if(input_done && lines_in_flight == 0 && sim_serial_pending() == 0 && !blocks_queued())
+		finish(0);
+	if(sim_cycles >= max_cycles) {
+		fprintf(stderr, "sim: time limit reached\n");
+		finish(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	trace = stdout;
+	while((opt = getopt(argc, argv, "o:t:qf:")) != -1) {
+		switch(opt) {
+			case 'o':
+				trace = fopen(optarg, "w");
+				if(trace == NULL) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+			case 't':
+				max_cycles = (unsigned long long)(atof(optarg) * SIM_CPU_CLOCK);
+				break;
+			case 'q':
+				quiet = true;
+				break;
+			case 'f':
+				sim_flash_file(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-o trace] [-t seconds] [-q] [-f flash] [file.gcode]\n", argv[0]);
+				return 1;
+		}
+	}
+	input = stdin;
+	if(optind < argc) {
+		input = fopen(argv[optind], "r");
+		if(input == NULL) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	heaters[0].sensor_channel = adc_channel_of(TEMP_0_PIN);
+	heaters[1].sensor_channel = adc_channel_of(TEMP_BED_PIN);
+
+	firmware_main();
+	return 0;
+}
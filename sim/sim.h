@@ -0,0 +1,75 @@
+/*
+  sim.h - time and interrupts of the simulated LPC1768
+  Part of the Marlin simulator
+
+  The firmware runs unchanged on one host thread. Simulated time is counted in CPU cycles and only passes
+  where the firmware would see it pass: each read of a timer counter costs SIM_COUNTER_READ_CYCLES, and
+  wait() skips ahead. Whenever time passes, the timer matches, Ticker calls, ADC conversions and received
+  serial bytes that became due raise their interrupts, and the pending interrupts run on the same stack if
+  PRIMASK and the NVIC priorities allow it. So busy waits end, and an interrupt can preempt the main loop
+  or a lower priority interrupt at every counter read.
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include "mbed.h"
+
+#define SIM_CPU_CLOCK 96000000
+
+// Cost of a timer counter read, in CPU cycles. This is the resolution of busy waits, and the time one
+// pass of the main loop takes is a few of these.
+#define SIM_COUNTER_READ_CYCLES 32
+
+// Simulated time since reset
+extern unsigned long long sim_cycles;
+
+// Let cycles pass, running the interrupts that become due on the way
+void sim_advance(unsigned long cycles);
+
+// True while an interrupt handler runs
+bool sim_in_interrupt();
+
+// Queue bytes for reception by UART0, they arrive at the baud rate set by the firmware
+void sim_serial_receive(const char *s, size_t n);
+
+// Bytes queued by sim_serial_receive() that haven't been received yet
+size_t sim_serial_pending();
+
+// Keep the simulated flash in a file: load it now, and write it back whenever the IAP has changed it
+void sim_flash_file(const char *path);
+
+// Provided by sim.cpp, called by the simulated hardware:
+
+// The firmware has sent a byte through UART0
+void sim_serial_sent(char c);
+
+// The pins in changed of a GPIO port have been written, pins is the new FIOPIN
+void sim_gpio_changed(int port, uint32_t changed, uint32_t pins);
+
+// The duty cycle of a PWM output has changed
+void sim_pwm_changed(PinName pin, int pulsewidth_us, int period_us);
+
+// The IAP has written or erased the flash
+void sim_flash_changed();
+
+// The 12 bit result of an ADC conversion of a channel
+int sim_adc_sample(int channel);
+
+// Called in the main loop whenever time passes, outside of interrupts
+void sim_poll();
+
+#endif